@@ -36,6 +36,11 @@ int g_ohfi_count;
 pthread_mutexattr_t g_database_lock_attr;
 pthread_mutex_t g_database_lock;
 
+// objects whose size grew but whose parents don't know yet, see addObjectSize()
+static int *g_pending_sizes = NULL;
+static int g_num_pending_sizes = 0;
+static int g_max_pending_sizes = 0;
+
 static inline void initDatabase(struct cma_paths *paths, const char *uuid)
 {
     pthread_mutex_lock(&g_database_lock);
@@ -104,16 +109,26 @@ static inline void initDatabase(struct cma_paths *paths, const char *uuid)
     pthread_mutex_unlock(&g_database_lock);
 }
 
-// the database is structured as an array of linked list, each list representing a category (saves, vita games, etc)
-// each linked list contains the objects, files, directories, etc
-void createDatabase(struct cma_paths *paths, const char *uuid)
+// apps and backups are only listed by their top folders until one is sent
+static int isSummarized(int ohfi)
 {
-    pthread_mutexattr_init(&g_database_lock_attr);
-    pthread_mutexattr_settype(&g_database_lock_attr, PTHREAD_MUTEX_RECURSIVE);
-    pthread_mutex_init(&g_database_lock, &g_database_lock_attr);
+    switch (ohfi)
+    {
+    case VITA_OHFI_VITAAPP:
+    case VITA_OHFI_PSPAPP:
+    case VITA_OHFI_PSXAPP:
+    case VITA_OHFI_PSMAPP:
+    case VITA_OHFI_BACKUP:
+        return 1;
+
+    default:
+        return 0;
+    }
+}
 
+static void populateDatabase(struct cma_paths *paths, const char *uuid)
+{
     pthread_mutex_lock(&g_database_lock);
-    g_database = malloc(sizeof(struct cma_database));
     memset(g_database, 0, sizeof(struct cma_database));
     initDatabase(paths, uuid);
     int i;
@@ -121,28 +136,104 @@ void createDatabase(struct cma_paths *paths, const char *uuid)
     // the database is basically an array of cma_objects, so we'll cast it so
     struct cma_object *db_objects = (struct cma_object *)g_database;
     int count = sizeof(struct cma_database) / sizeof(struct cma_object);
+    char *sizes_file;
+
+    asprintf(&sizes_file, "%s/%s", paths->appsPath, DIRECTORY_SIZES_FILE);
+    loadDirectorySizes(sizes_file);
 
     // loop through all the master objects
     for (i = 0; i < count; i++)
     {
         current = &db_objects[i];
-        addEntriesForDirectory(current, current->metadata.ohfi);
+        addEntriesForDirectory(current, current->metadata.ohfi, isSummarized(current->metadata.ohfi));
     }
 
+    saveDirectorySizes(sizes_file);
+    free(sizes_file);
     pthread_mutex_unlock(&g_database_lock);
 }
 
-static void freeCMAObject(struct cma_object *obj)
+// the database is structured as an array of linked list, each list representing a category (saves, vita games, etc)
+// each linked list contains the objects, files, directories, etc
+void createDatabase(struct cma_paths *paths, const char *uuid)
 {
-    if (obj == NULL)
-        return;
+    pthread_mutexattr_init(&g_database_lock_attr);
+    pthread_mutexattr_settype(&g_database_lock_attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&g_database_lock, &g_database_lock_attr);
+
+    pthread_mutex_lock(&g_database_lock);
+    g_database = malloc(sizeof(struct cma_database));
+    populateDatabase(paths, uuid);
+    pthread_mutex_unlock(&g_database_lock);
+}
+
+static struct media_track *copyTracks(const struct media_track *tracks, int numTracks)
+{
+    struct media_track *copy;
+
+    if (tracks == NULL || numTracks <= 0)
+    {
+        return NULL;
+    }
+
+    copy = malloc(numTracks * sizeof(struct media_track));
+    memcpy(copy, tracks, numTracks * sizeof(struct media_track));
+    return copy;
+}
+
+static char *copyString(const char *str)
+{
+    return str ? strdup(str) : NULL;
+}
 
-    metadata_t *meta = &obj->metadata;
+// deep copy so the metadata can be used after the database is unlocked
+void copyMetadata(metadata_t *dest, const metadata_t *src)
+{
+    memcpy(dest, src, sizeof(metadata_t));
+    dest->name = copyString(src->name);
+    dest->path = copyString(src->path);
+    dest->next_metadata = NULL;
+
+    if (MASK_SET(src->dataType, SaveData | Folder))
+    {
+        dest->data.saveData.title = copyString(src->data.saveData.title);
+        dest->data.saveData.detail = copyString(src->data.saveData.detail);
+        dest->data.saveData.dirName = copyString(src->data.saveData.dirName);
+        dest->data.saveData.savedataTitle = copyString(src->data.saveData.savedataTitle);
+    }
+    else if (MASK_SET(src->dataType, Photo | File))
+    {
+        dest->data.photo.tracks = copyTracks(src->data.photo.tracks, src->data.photo.numTracks);
+        dest->data.photo.title = copyString(src->data.photo.title);
+        dest->data.photo.fileName = copyString(src->data.photo.fileName);
+    }
+    else if (MASK_SET(src->dataType, Music | File))
+    {
+        dest->data.music.tracks = copyTracks(src->data.music.tracks, src->data.music.numTracks);
+        dest->data.music.title = copyString(src->data.music.title);
+        dest->data.music.fileName = copyString(src->data.music.fileName);
+        dest->data.music.album = copyString(src->data.music.album);
+        dest->data.music.artist = copyString(src->data.music.artist);
+    }
+    else if (MASK_SET(src->dataType, Video | File))
+    {
+        dest->data.video.title = copyString(src->data.video.title);
+        dest->data.video.explanation = copyString(src->data.video.explanation);
+        dest->data.video.fileName = copyString(src->data.video.fileName);
+        dest->data.video.copyright = copyString(src->data.video.copyright);
+        dest->data.video.tracks = copyTracks(src->data.video.tracks, src->data.video.numTracks);
+    }
+}
+
+// frees what copyMetadata allocated, but not the metadata itself
+void freeMetadata(metadata_t *meta)
+{
     free(meta->name);
     free(meta->path);
 
     if (MASK_SET(meta->dataType, SaveData | Folder))
     {
+        free(meta->data.saveData.title);
         free(meta->data.saveData.detail);
         free(meta->data.saveData.dirName);
         free(meta->data.saveData.savedataTitle);
@@ -169,7 +260,44 @@ static void freeCMAObject(struct cma_object *obj)
         free(meta->data.video.copyright);
         free(meta->data.video.tracks);
     }
+}
 
+metadata_t *copyMetadataList(const metadata_t *head)
+{
+    metadata_t temp = {0};
+    metadata_t *tail = &temp;
+
+    pthread_mutex_lock(&g_database_lock);
+
+    for (; head != NULL; head = head->next_metadata)
+    {
+        tail->next_metadata = malloc(sizeof(metadata_t));
+        tail = tail->next_metadata;
+        copyMetadata(tail, head);
+    }
+
+    pthread_mutex_unlock(&g_database_lock);
+    return temp.next_metadata;
+}
+
+void freeMetadataList(metadata_t *head)
+{
+    metadata_t *next;
+
+    for (; head != NULL; head = next)
+    {
+        next = head->next_metadata;
+        freeMetadata(head);
+        free(head);
+    }
+}
+
+static void freeCMAObject(struct cma_object *obj)
+{
+    if (obj == NULL)
+        return;
+
+    freeMetadata(&obj->metadata);
     free(obj->path);
     free(obj->filters);
 
@@ -179,14 +307,8 @@ static void freeCMAObject(struct cma_object *obj)
     }
 }
 
-void destroyDatabase()
+static void freeDatabaseObjects(void)
 {
-    if (g_database == NULL)
-    {
-        return; // can't destroy what hasn't been created
-    }
-
-    pthread_mutex_lock(&g_database_lock);
     // the database is basically an array of cma_objects, so we'll cast it so
     struct cma_object *db_objects = (struct cma_object *)g_database;
     int count = sizeof(struct cma_database) / sizeof(struct cma_object);
@@ -205,6 +327,18 @@ void destroyDatabase()
         }
     }
 
+    g_num_pending_sizes = 0;
+}
+
+void destroyDatabase()
+{
+    if (g_database == NULL)
+    {
+        return; // can't destroy what hasn't been created
+    }
+
+    pthread_mutex_lock(&g_database_lock);
+    freeDatabaseObjects();
     pthread_mutex_unlock(&g_database_lock);
 
     pthread_mutex_destroy(&g_database_lock);
@@ -213,6 +347,22 @@ void destroyDatabase()
     g_database = NULL;
 }
 
+// unlike destroying and creating, the lock stays valid so event handlers
+// that dropped it while doing I/O can safely take it again afterwards
+void refreshDatabase(struct cma_paths *paths, const char *uuid)
+{
+    if (g_database == NULL)
+    {
+        createDatabase(paths, uuid);
+        return;
+    }
+
+    pthread_mutex_lock(&g_database_lock);
+    freeDatabaseObjects();
+    populateDatabase(paths, uuid);
+    pthread_mutex_unlock(&g_database_lock);
+}
+
 inline void lockDatabase()
 {
     pthread_mutex_lock(&g_database_lock);
@@ -226,6 +376,12 @@ inline void unlockDatabase()
 struct cma_object *addToDatabase(struct cma_object *root, const char *name, size_t size, const enum DataType type)
 {
     pthread_mutex_lock(&g_database_lock);
+
+    if (root->collapsed)
+    {
+        expandObject(root); // or its contents would be added twice later on
+    }
+
     struct cma_object *current = malloc(sizeof(struct cma_object));
     memset(current, 0, sizeof(struct cma_object));
     current->metadata.name = strdup(name);
@@ -364,41 +520,49 @@ void removeFromDatabase(int ohfi, struct cma_object *start)
     freeCMAObject(prev);
 }
 
-void renameRootEntry(struct cma_object *object, const char *name, const char *newname)
+static void replacePrefix(char **p_str, size_t len, const char *prefix)
+{
+    char *str;
+
+    asprintf(&str, "%s%s", prefix, *p_str + len);
+    free(*p_str);
+    *p_str = str;
+}
+
+// The paths of everything under the object start with the object's own, and
+// all of it comes after the object in its list, so one pass over the rest of
+// the list finds it all and only the start of each path is changed.
+void renameRootEntry(struct cma_object *object, const char *newname)
 {
     pthread_mutex_lock(&g_database_lock);
     struct cma_object *temp;
     char *origPath = object->path;
     char *origRelPath = object->metadata.path;
-    char *origName = object->metadata.name;
+    const char *slash = strrchr(origRelPath, '/');
+    size_t relLen = strlen(origRelPath);
+    size_t absLen = strlen(origPath);
+    char *newRelPath;
+    char *newPath;
 
-    if (name == NULL)
-    {
-        name = origName;
-    }
-
-    object->metadata.name = strreplace(origName, name, newname);
-    object->metadata.path = strreplace(origRelPath, name, newname);
-    object->path = strreplace(origPath, origRelPath, object->metadata.path);
+    // the relative path is the end of the full one
+    asprintf(&newRelPath, "%.*s%s", slash ? (int)(slash - origRelPath + 1) : 0, origRelPath, newname);
+    asprintf(&newPath, "%.*s%s", (int)(absLen - relLen), origPath, newRelPath);
 
-    for (temp = object; temp != NULL; temp = temp->next_object)
+    for (temp = object->next_object; temp != NULL; temp = temp->next_object)
     {
-        // rename all child objects
-        if (temp->metadata.ohfiParent == object->metadata.ohfi)
+        if (strncmp(temp->metadata.path, origRelPath, relLen) == 0 && temp->metadata.path[relLen] == '/')
         {
-            char *nname;
-            char *nnewname;
-            asprintf(&nname, "%s/%s", origRelPath, temp->metadata.name);
-            asprintf(&nnewname, "%s/%s", object->metadata.path, temp->metadata.name);
-            renameRootEntry(temp, nname, nnewname);
-            free(nname);
-            free(nnewname);
+            replacePrefix(&temp->metadata.path, relLen, newRelPath);
+            replacePrefix(&temp->path, absLen, newPath);
         }
     }
 
+    free(object->metadata.name);
+    object->metadata.name = strdup(newname);
+    object->metadata.path = newRelPath;
+    object->path = newPath;
     free(origPath);
     free(origRelPath);
-    free(origName);
     pthread_mutex_unlock(&g_database_lock);
 }
 
@@ -448,6 +612,135 @@ struct cma_object *ohfiToObject(int ohfi)
     return found;
 }
 
+// the OHFI may belong to another object if the database was refreshed while
+// it was unlocked, so the path is checked as well when one is given
+struct cma_object *findObject(int ohfi, const char *path)
+{
+    pthread_mutex_lock(&g_database_lock);
+    struct cma_object *object = ohfiToObject(ohfi);
+
+    if (object != NULL && (object->metadata.ohfi != ohfi || (path != NULL && strcmp(object->path, path) != 0)))
+    {
+        object = NULL;
+    }
+
+    pthread_mutex_unlock(&g_database_lock);
+    return object;
+}
+
+static void flushObjectSize(struct cma_object *object)
+{
+    size_t size = object->pending_size;
+
+    object->pending_size = 0;
+
+    while (object->metadata.ohfiParent > 0 && (object = ohfiToObject(object->metadata.ohfiParent)) != NULL)
+    {
+        object->metadata.size += size;
+    }
+}
+
+/**
+ * Grows an object by size. Its folders are only told about it by
+ * flushObjectSizes(), so a file received in many parts is added to
+ * them once instead of once per part.
+ *
+ * @param object the object that grew
+ * @param size by how much
+ */
+void addObjectSize(struct cma_object *object, size_t size)
+{
+    int *pending;
+
+    if (size == 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&g_database_lock);
+    object->metadata.size += size;
+
+    if (object->pending_size == 0)
+    {
+        if (g_num_pending_sizes == g_max_pending_sizes)
+        {
+            if ((pending = realloc(g_pending_sizes, (g_max_pending_sizes + 16) * sizeof(int))) == NULL)
+            {
+                // too bad, do it now
+                object->pending_size = size;
+                flushObjectSize(object);
+                pthread_mutex_unlock(&g_database_lock);
+                return;
+            }
+
+            g_pending_sizes = pending;
+            g_max_pending_sizes += 16;
+        }
+
+        g_pending_sizes[g_num_pending_sizes++] = object->metadata.ohfi;
+    }
+
+    object->pending_size += size;
+    pthread_mutex_unlock(&g_database_lock);
+}
+
+/**
+ * Adds what objects grew by since the last call to the sizes of their folders.
+ */
+void flushObjectSizes(void)
+{
+    struct cma_object *object;
+    int i;
+
+    pthread_mutex_lock(&g_database_lock);
+
+    for (i = 0; i < g_num_pending_sizes; i++)
+    {
+        // it might have been removed since
+        if ((object = findObject(g_pending_sizes[i], NULL)) != NULL && object->pending_size > 0)
+        {
+            flushObjectSize(object);
+        }
+    }
+
+    g_num_pending_sizes = 0;
+    pthread_mutex_unlock(&g_database_lock);
+}
+
+/**
+ * Adds what is in a folder that was added without its contents. They are
+ * put right after it, so everything under an object still follows it.
+ *
+ * @param object the folder
+ */
+void expandObject(struct cma_object *object)
+{
+    struct cma_object *rest;
+    struct cma_object *last;
+    uint64_t size;
+
+    pthread_mutex_lock(&g_database_lock);
+
+    if (!object->collapsed)
+    {
+        pthread_mutex_unlock(&g_database_lock);
+        return;
+    }
+
+    LOG(LVERBOSE, "Reading the contents of %s.\n", object->path);
+    object->collapsed = 0;
+    rest = object->next_object;
+    object->next_object = NULL;
+    size = object->metadata.size; // it is already counted in
+    addEntriesForDirectory(object, object->metadata.ohfi, 0);
+    object->metadata.size = size;
+
+    for (last = object; last->next_object != NULL; last = last->next_object);
+
+    last->next_object = rest;
+    pthread_mutex_unlock(&g_database_lock);
+}
+
 // ohfiRoot == 0 means look in all lists
 struct cma_object *pathToObject(char *path, int ohfiRoot)
 {
@@ -487,6 +780,90 @@ struct cma_object *pathToObject(char *path, int ohfiRoot)
     return found;
 }
 
+// The Vita only tells us the name, the size and the first bytes of an object
+// it asks about. A file is only reported as the same if all of them match,
+// anything less and the Vita would skip a file we don't have. The hash of a
+// file's first bytes is read the first time it is needed and kept with it.
+static int matchesFingerprint(const struct cma_object *object, uint64_t size, uint64_t head_hash,
+                              unsigned int head_length)
+{
+    return head_length > 0 && object->metadata.size == size && object->head_length == head_length &&
+           object->head_hash == head_hash;
+}
+
+/**
+ * Looks for an object that is the same as one the Vita is about to send.
+ * A file with the name asked for is only the same if its size and first
+ * bytes match too.
+ *
+ * @param name the name of the object on the Vita
+ * @param size its size, 0 for folders
+ * @param head its first bytes
+ * @param head_length how many there are, at most the size
+ * @return the OHFI of the same object or 0 if there is none
+ */
+int findSameObject(char *name, uint64_t size, const unsigned char *head, unsigned int head_length)
+{
+    struct cma_object *object;
+    uint64_t head_hash = hashData(head, head_length);
+    unsigned char *data;
+    unsigned int len;
+    char *path = NULL;
+    int ohfi = 0;
+    int found = 0;
+
+    lockDatabase();
+
+    if ((object = pathToObject(name, 0)) == NULL)
+    {
+        // not here
+    }
+    else if (!(object->metadata.dataType & File))
+    {
+        found = object->metadata.ohfi;  // nothing more to compare folders by
+    }
+    else if (object->metadata.size != size || head_length == 0)
+    {
+        // different, or nothing to tell them apart by
+    }
+    else if (object->head_length > 0)
+    {
+        found = matchesFingerprint(object, size, head_hash, head_length) ? object->metadata.ohfi : 0;
+    }
+    else
+    {
+        ohfi = object->metadata.ohfi;
+        path = strdup(object->path);
+    }
+
+    unlockDatabase();
+
+    // the file is read without the lock held
+    len = head_length;
+
+    if (path != NULL && readFileToBuffer(path, 0, &data, &len) == 0)
+    {
+        lockDatabase();
+
+        if ((object = findObject(ohfi, path)) != NULL)
+        {
+            object->head_hash = hashData(data, len);
+            object->head_length = len;
+
+            if (matchesFingerprint(object, size, head_hash, head_length))
+            {
+                found = object->metadata.ohfi;
+            }
+        }
+
+        unlockDatabase();
+        free(data);
+    }
+
+    free(path);
+    return found;
+}
+
 static int acceptFilteredObject(const struct cma_object *parent, const struct cma_object *current, int type)
 {
     int result = 0;
@@ -556,6 +933,8 @@ int filterObjects(int ohfiParent, metadata_t **p_head)
         return 0;
     }
 
+    expandObject(parent);
+
     int type = parent->metadata.type;
     int j;
 
@@ -18,7 +18,10 @@
 //
 
 #include <memory.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
 #include "ptp.h"
 #define _EXPORTING
 #include "vitamtp.h"
@@ -95,11 +98,24 @@ VITAMTP_EXPORT vita_device_t *VitaMTP_Get_First_Wireless_Vita(wireless_host_info
     return NULL;
 }
 
+VITAMTP_EXPORT int VitaMTP_Serve_Wireless(wireless_host_info_t *info, unsigned int host_addr, int timeout,
+        device_registered_callback_t is_registered, register_device_callback_t create_register_pin,
+        device_connected_callback_t device_connected)
+{
+    VitaMTP_Log(VitaMTP_ERROR, "wireless is unsupported\n");
+    return -1;
+}
+
 VITAMTP_EXPORT int VitaMTP_Get_Device_IP(vita_device_t *device)
 {
     VitaMTP_Log(VitaMTP_ERROR, "wireless is unsupported\n");
     return -1;
 }
+
+VITAMTP_EXPORT int VitaMTP_Get_Event_FD(vita_device_t *device)
+{
+    return -1;
+}
 #endif
 
 /**
@@ -310,3 +326,412 @@ VITAMTP_EXPORT uint16_t VitaMTP_GetData(vita_device_t *device, uint32_t event_id
 
     return ret;
 }
+
+/**
+ * Data phases smaller than this are not used for calibration because
+ * the command and response overhead would dominate the timing.
+ */
+#define TUNER_MIN_SAMPLE_SIZE   0x40000
+/**
+ * Amount of data each candidate block size has to move before the
+ * calibration moves on to the next candidate.
+ */
+#define TUNER_CANDIDATE_BYTES   0x1000000
+#define TUNER_MAX_CANDIDATES    8
+
+/**
+ * Picks the block size used for bulk data phases
+ *
+ * Every transport registers a list of candidate block sizes, the first
+ * being the one it has always used. Calibration is done on live
+ * transfers since the Vita drives the session and we cannot issue
+ * transfers of our own. Each candidate is used in turn until it has moved
+ * TUNER_CANDIDATE_BYTES and the fastest one is kept.
+ *
+ * The transport's data phases and the calls below from the application
+ * come from different threads, so everything is done under lock.
+ */
+struct vita_transfer_tuner
+{
+    pthread_mutex_t lock;
+    uint32_t block_size;
+    uint32_t candidates[TUNER_MAX_CANDIDATES];
+    int num_candidates;
+    int calibrating; // non-zero while candidates are being measured
+    int current; // candidate being measured
+    uint64_t bytes[TUNER_MAX_CANDIDATES];
+    double seconds[TUNER_MAX_CANDIDATES];
+    double start;
+    int sampling; // a data phase is being measured for current
+    uint32_t throughput; // of block_size, 0 if it was never measured
+};
+
+static double VitaMTP_Tuner_Time(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/**
+ * Sets up block size selection for a device
+ *
+ * Called by the transports when the connection is made.
+ * @param params PTP params of the device.
+ * @param candidates block sizes the transport supports, the first one is
+ *  used until a profile is set or calibration finishes.
+ * @param num number of candidates.
+ * @return zero on success.
+ */
+int vita_tuner_init(PTPParams *params, const uint32_t *candidates, int num);
+int vita_tuner_init(PTPParams *params, const uint32_t *candidates, int num)
+{
+    struct vita_transfer_tuner *tuner;
+
+    if (num < 1 || num > TUNER_MAX_CANDIDATES)
+    {
+        return -1;
+    }
+
+    if ((tuner = calloc(1, sizeof(struct vita_transfer_tuner))) == NULL)
+    {
+        VitaMTP_Log(VitaMTP_ERROR, "out of memory\n");
+        return -1;
+    }
+
+    pthread_mutex_init(&tuner->lock, NULL);
+    memcpy(tuner->candidates, candidates, num * sizeof(uint32_t));
+    tuner->num_candidates = num;
+    tuner->block_size = candidates[0];
+    params->tuner = tuner;
+    return 0;
+}
+
+void vita_tuner_free(PTPParams *params);
+void vita_tuner_free(PTPParams *params)
+{
+    if (params->tuner != NULL)
+    {
+        pthread_mutex_destroy(&params->tuner->lock);
+    }
+
+    free(params->tuner);
+    params->tuner = NULL;
+}
+
+/**
+ * Called by the transport before a data phase
+ *
+ * @return the block size to use for this data phase.
+ */
+uint32_t vita_tuner_begin(PTPParams *params);
+uint32_t vita_tuner_begin(PTPParams *params)
+{
+    struct vita_transfer_tuner *tuner = params->tuner;
+    uint32_t block_size;
+
+    pthread_mutex_lock(&tuner->lock);
+
+    if (tuner->calibrating)
+    {
+        tuner->block_size = tuner->candidates[tuner->current];
+        tuner->start = VitaMTP_Tuner_Time();
+        tuner->sampling = 1;
+    }
+
+    block_size = tuner->block_size;
+    pthread_mutex_unlock(&tuner->lock);
+    return block_size;
+}
+
+/**
+ * Called by the transport after a successful data phase
+ *
+ * @param bytes how much data was moved in the data phase.
+ */
+void vita_tuner_end(PTPParams *params, uint64_t bytes);
+void vita_tuner_end(PTPParams *params, uint64_t bytes)
+{
+    struct vita_transfer_tuner *tuner = params->tuner;
+    int i, best;
+
+    pthread_mutex_lock(&tuner->lock);
+
+    // a calibration started or stopped during the data phase drops it
+    if (!tuner->sampling || !tuner->calibrating || bytes < TUNER_MIN_SAMPLE_SIZE)
+    {
+        tuner->sampling = 0;
+        pthread_mutex_unlock(&tuner->lock);
+        return;
+    }
+
+    tuner->sampling = 0;
+    tuner->bytes[tuner->current] += bytes;
+    tuner->seconds[tuner->current] += VitaMTP_Tuner_Time() - tuner->start;
+
+    if (tuner->bytes[tuner->current] < TUNER_CANDIDATE_BYTES)
+    {
+        pthread_mutex_unlock(&tuner->lock);
+        return;
+    }
+
+    VitaMTP_Log(VitaMTP_VERBOSE, "block size 0x%x: %.0f bytes/s\n", tuner->candidates[tuner->current],
+                tuner->bytes[tuner->current] / tuner->seconds[tuner->current]);
+
+    if (++tuner->current < tuner->num_candidates)
+    {
+        pthread_mutex_unlock(&tuner->lock);
+        return;
+    }
+
+    for (i = 1, best = 0; i < tuner->num_candidates; i++)
+    {
+        // compare bytes/seconds without dividing by a zero duration
+        if (tuner->bytes[i] * tuner->seconds[best] > tuner->bytes[best] * tuner->seconds[i])
+        {
+            best = i;
+        }
+    }
+
+    tuner->calibrating = 0;
+    tuner->block_size = tuner->candidates[best];
+    tuner->throughput = tuner->seconds[best] > 0 ? (uint32_t)(tuner->bytes[best] / tuner->seconds[best]) : UINT32_MAX;
+    VitaMTP_Log(VitaMTP_INFO, "transfer calibration done, using block size 0x%x (%u bytes/s)\n", tuner->block_size,
+                tuner->throughput);
+    pthread_mutex_unlock(&tuner->lock);
+}
+
+/**
+ * Starts measuring transfer speeds
+ *
+ * The following large transfers are each done with a different block
+ * size and once all of them have been measured, the fastest one is used
+ * for the rest of the session. Use VitaMTP_Get_Transfer_Profile() to
+ * see if calibration is done and to get the result.
+ *
+ * @param device a pointer to the device.
+ * @return zero if calibration has started.
+ */
+VITAMTP_EXPORT int VitaMTP_Calibrate_Transfers(vita_device_t *device)
+{
+    struct vita_transfer_tuner *tuner = device->params->tuner;
+
+    if (tuner == NULL)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&tuner->lock);
+    memset(tuner->bytes, 0, sizeof(tuner->bytes));
+    memset(tuner->seconds, 0, sizeof(tuner->seconds));
+    tuner->current = 0;
+    tuner->sampling = 0;
+    tuner->throughput = 0;
+    tuner->calibrating = 1;
+    pthread_mutex_unlock(&tuner->lock);
+    VitaMTP_Log(VitaMTP_VERBOSE, "calibrating %d block sizes\n", tuner->num_candidates);
+    return 0;
+}
+
+/**
+ * Gets the transfer profile in use
+ *
+ * @param device a pointer to the device.
+ * @param profile filled in with the block size currently used and its
+ *  measured throughput.
+ * @return zero if the profile was measured or set with
+ *  VitaMTP_Set_Transfer_Profile(), one if the default profile is used or
+ *  calibration is still running, negative on error.
+ */
+VITAMTP_EXPORT int VitaMTP_Get_Transfer_Profile(vita_device_t *device, vita_transfer_profile_t *profile)
+{
+    struct vita_transfer_tuner *tuner = device->params->tuner;
+
+    if (tuner == NULL)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&tuner->lock);
+    profile->block_size = tuner->calibrating ? tuner->candidates[0] : tuner->block_size;
+    profile->throughput = tuner->calibrating ? 0 : tuner->throughput;
+    pthread_mutex_unlock(&tuner->lock);
+    return profile->throughput > 0 ? 0 : 1;
+}
+
+/**
+ * Applies a saved transfer profile
+ *
+ * Profiles are only accepted if the block size is one that the
+ * transport of the device supports. This stops any running calibration.
+ *
+ * @param device a pointer to the device.
+ * @param profile a profile obtained from VitaMTP_Get_Transfer_Profile().
+ * @return zero if the profile was applied.
+ */
+VITAMTP_EXPORT int VitaMTP_Set_Transfer_Profile(vita_device_t *device, const vita_transfer_profile_t *profile)
+{
+    struct vita_transfer_tuner *tuner = device->params->tuner;
+    int i;
+
+    if (tuner == NULL)
+    {
+        return -1;
+    }
+
+    for (i = 0; i < tuner->num_candidates; i++)
+    {
+        if (tuner->candidates[i] == profile->block_size)
+        {
+            pthread_mutex_lock(&tuner->lock);
+            tuner->calibrating = 0;
+            tuner->sampling = 0;
+            tuner->block_size = profile->block_size;
+            tuner->throughput = profile->throughput;
+            pthread_mutex_unlock(&tuner->lock);
+            return 0;
+        }
+    }
+
+    VitaMTP_Log(VitaMTP_INFO, "block size 0x%x not supported by device\n", profile->block_size);
+    return -1;
+}
+
+/**
+ * Picks the scheduling class of a transaction
+ *
+ * Replies the Vita is waiting on go ahead of everything else, which
+ * includes the result of a RequestCancelTask, so a cancel is answered
+ * while transfers are queued. Object data goes last so a long transfer
+ * queue doesn't hold up short requests. A transaction that is cancelled
+ * while it runs already holds its turn, its cancel request goes out
+ * from within it.
+ */
+static int VitaMTP_Transaction_Priority(PTPParams *params, uint16_t code, uint16_t flags)
+{
+    switch (code)
+    {
+        case PTP_OC_VITA_ReportResult:
+        case PTP_OC_VITA_KeepAlive:
+            return PTP_TP_URGENT;
+
+        case PTP_OC_GetObject:
+        case PTP_OC_GetPartialObject:
+        case PTP_OC_SendObject:
+        case PTP_OC_VITA_SendObjectThumb:
+        case PTP_OC_VITA_SendHttpObjectFromURL:
+        case PTP_OC_VITA_SendPartOfObject:
+        case PTP_OC_VITA_GetPartOfObject:
+            return PTP_TP_BULK;
+
+        default:
+            return PTP_TP_CONTROL;
+    }
+}
+
+#define CANCEL_LIST_SIZE    16
+
+/**
+ * The most recently cancelled events
+ *
+ * Written by the thread handling RequestCancelTask and read by the
+ * threads doing transfers before every block.
+ */
+struct vita_cancel_list
+{
+    pthread_mutex_t lock;
+    uint32_t event_ids[CANCEL_LIST_SIZE];
+    int next; // oldest entry, overwritten next
+};
+
+/**
+ * Makes transactions on a device safe to run from several threads
+ * and lets them be cancelled.
+ *
+ * Called by the transports when the connection is made.
+ * @param params PTP params of the device.
+ * @return zero on success.
+ */
+int vita_scheduler_init(PTPParams *params);
+int vita_scheduler_init(PTPParams *params)
+{
+    struct vita_cancel_list *cancelled;
+
+    if ((cancelled = calloc(1, sizeof(struct vita_cancel_list))) == NULL)
+    {
+        VitaMTP_Log(VitaMTP_ERROR, "out of memory\n");
+        return -1;
+    }
+
+    if (ptp_scheduler_init(params) != PTP_RC_OK)
+    {
+        VitaMTP_Log(VitaMTP_ERROR, "cannot create transaction scheduler\n");
+        free(cancelled);
+        return -1;
+    }
+
+    pthread_mutex_init(&cancelled->lock, NULL);
+    params->cancelled = cancelled;
+    params->priority_func = VitaMTP_Transaction_Priority;
+    return 0;
+}
+
+void vita_scheduler_free(PTPParams *params);
+void vita_scheduler_free(PTPParams *params)
+{
+    ptp_scheduler_free(params);
+
+    if (params->cancelled)
+    {
+        pthread_mutex_destroy(&params->cancelled->lock);
+        free(params->cancelled);
+        params->cancelled = NULL;
+    }
+}
+
+/**
+ * Marks an event as cancelled, called by VitaMTP_CancelTask().
+ */
+void vita_cancel_event(PTPParams *params, uint32_t event_id);
+void vita_cancel_event(PTPParams *params, uint32_t event_id)
+{
+    struct vita_cancel_list *cancelled = params->cancelled;
+
+    pthread_mutex_lock(&cancelled->lock);
+    cancelled->event_ids[cancelled->next] = event_id;
+    cancelled->next = (cancelled->next + 1) % CANCEL_LIST_SIZE;
+    pthread_mutex_unlock(&cancelled->lock);
+}
+
+/**
+ * Checks if the Vita has cancelled an event with RequestCancelTask.
+ * Streaming transfers for the event check this before every block,
+ * long running work of your own for the event should check it too and
+ * stop early.
+ *
+ * @param device a pointer to the device.
+ * @param event_id the unique ID sent by the Vita with the event.
+ * @return 1 if the event was cancelled, 0 otherwise.
+ * @see VitaMTP_CancelTask()
+ */
+VITAMTP_EXPORT int VitaMTP_Is_Task_Cancelled(vita_device_t *device, uint32_t event_id)
+{
+    struct vita_cancel_list *cancelled = device->params->cancelled;
+    int i, found = 0;
+
+    if (cancelled == NULL || event_id == 0)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&cancelled->lock);
+
+    for (i = 0; i < CANCEL_LIST_SIZE && !found; i++)
+    {
+        found = cancelled->event_ids[i] == event_id;
+    }
+
+    pthread_mutex_unlock(&cancelled->lock);
+    return found;
+}
@@ -18,6 +18,7 @@
 //  along with this program.  If not, see <http://www.gnu.org/licenses/>.
 //
 
+#define _GNU_SOURCE
 #include <fcntl.h>
 #include <limits.h>
 #include <pthread.h>
@@ -25,6 +26,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -37,6 +39,10 @@
 #define sleep(x) (Sleep((x)*1000))
 #endif
 
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
 extern struct cma_database *g_database;
 struct cma_paths g_paths;
 char *g_uuid;
@@ -46,6 +52,14 @@ static sem_t g_sem_storage;
 static sem_t *g_refresh_database_request;
 int g_connected = 0;
 unsigned int g_log_level = LINFO;
+static const char *g_profiles_path = "transfer_profiles";
+static int g_calibrate_request = 0; // taken by an event worker under the event queue lock
+static int g_calibrating = 0;
+static pthread_mutex_t g_calibration_lock = PTHREAD_MUTEX_INITIALIZER; // guards g_calibrating and the profile file
+// the Vita reads large files as a run of parts, so the last file stays open between them
+static pthread_mutex_t g_part_file_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *g_part_file_path = NULL;
+static int g_part_file_fd = -1;
 
 static const char *g_help_string =
     "usage: opencma [wireless|usb] paths [options]\n"
@@ -62,6 +76,10 @@ static const char *g_help_string =
 #endif
     "   options\n"
     "       -u path     Path to local URL mappings\n"
+    "       -t file     File to keep transfer profiles in\n"
+    "                   (default ./transfer_profiles)\n"
+    "       -s          Keep backups and saves in a deduplicating store,\n"
+    "                   files that are the same are only on disk once\n"
     "       -l level    logging level, number 1-4.\n"
     "                   1 = error, 2 = info, 3 = verbose, 4 = debug\n"
     "       -h          Show this help text\n"
@@ -100,17 +118,23 @@ static const char *g_help_string =
     "   output so the issue can be resolved quickly. Please note that more\n"
     "   logging means OpenCMA will run slower.\n"
     "\n"
+    "   The first time a Vita connects, OpenCMA measures which transfer\n"
+    "   block size is fastest over the first large transfers and saves it\n"
+    "   to the file given by '-t' so later connections use it right away.\n"
+    "\n"
     "   Once OpenCMA is running, you can execute various commands like\n"
     "   manually refreshing the database. For more information type in\n"
     "   'help' after the Vita is connected.\n";
 
-static const char *g_update_list =
+// sent as it is, its length is known when compiling
+static const char g_update_list[] =
     "<?xml version=\"1.0\" encoding=\"UTF-8\"?><update_data_list><region id=\"au\"><np level0_system_version=\"00.000.000\" level1_system_version=\"00.000.000\" level2_system_version=\"00.000.000\" map=\"00.000.000\" /><version system_version=\"00.000.000\" label=\"0.00\"></version></region><region id=\"eu\"><np level0_system_version=\"00.000.000\" level1_system_version=\"00.000.000\" level2_system_version=\"00.000.000\" map=\"00.000.000\" /><version system_version=\"00.000.000\" label=\"0.00\"></version></region><region id=\"jp\"><np level0_system_version=\"00.000.000\" level1_system_version=\"00.000.000\" level2_system_version=\"00.000.000\" map=\"00.000.000\" /><version system_version=\"00.000.000\" label=\"0.00\"></version></region><region id=\"kr\"><np level0_system_version=\"00.000.000\" level1_system_version=\"00.000.000\" level2_system_version=\"00.000.000\" map=\"00.000.000\" /><version system_version=\"00.000.000\" label=\"0.00\"></version></region><region id=\"mx\"><np level0_system_version=\"00.000.000\" level1_system_version=\"00.000.000\" level2_system_version=\"00.000.000\" map=\"00.000.000\" /><version system_version=\"00.000.000\" label=\"0.00\"></version></region><region id=\"ru\"><np level0_system_version=\"00.000.000\" level1_system_version=\"00.000.000\" level2_system_version=\"00.000.000\" map=\"00.000.000\" /><version system_version=\"00.000.000\" label=\"0.00\"></version></region><region id=\"tw\"><np level0_system_version=\"00.000.000\" level1_system_version=\"00.000.000\" level2_system_version=\"00.000.000\" map=\"00.000.000\" /><version system_version=\"00.000.000\" label=\"0.00\"></version></region><region id=\"uk\"><np level0_system_version=\"00.000.000\" level1_system_version=\"00.000.000\" level2_system_version=\"00.000.000\" map=\"00.000.000\" /><version system_version=\"00.000.000\" label=\"0.00\"></version></region><region id=\"us\"><np level0_system_version=\"00.000.000\" level1_system_version=\"00.000.000\" level2_system_version=\"00.000.000\" map=\"00.000.000\" /><version system_version=\"00.000.000\" label=\"0.00\"></version></region></update_data_list>";
 
 static const char *g_commands_help_string =
     "commands:\n"
     "   exit: disconnect and exit\n"
     "   refresh: refresh database\n"
+    "   calibrate: measure transfer speeds again\n"
     "   help: show this\n";
 
 static const metadata_t g_thumbmeta = {0, 0, 0, NULL, NULL, 0, 0, 0, Thumbnail, {18, 144, 80, 0, 1, 1.0f, 2}, NULL};
@@ -190,15 +214,6 @@ int asprintf(char **ret, const char *format, ...)
 }
 #endif
 
-static inline void incrementSizeMetadata(struct cma_object *object, size_t size)
-{
-    do
-    {
-        object->metadata.size += size;
-    }
-    while (object->metadata.ohfiParent > 0 && (object = ohfiToObject(object->metadata.ohfiParent)) != NULL);
-}
-
 void vitaEventSendNumOfObject(vita_device_t *device, vita_event_t *event, int eventId)
 {
     LOG(LVERBOSE, "Event recieved: %s, code: 0x%x, id: %d\n", "RequestSendNumOfObject", event->Code, eventId);
@@ -223,7 +238,6 @@ void vitaEventSendNumOfObject(vita_device_t *device, vita_event_t *event, int ev
         return;
     }
 
-    lockDatabase();
     int items = filterObjects(ohfi, NULL);
 
     if (VitaMTP_SendNumOfObject(device, eventId, items) != PTP_RC_OK)
@@ -235,8 +249,6 @@ void vitaEventSendNumOfObject(vita_device_t *device, vita_event_t *event, int ev
         LOG(LVERBOSE, "Returned count of %d objects for OHFI parent %d\n", items, ohfi);
         VitaMTP_ReportResult(device, eventId, PTP_RC_OK);
     }
-
-    unlockDatabase();
 }
 
 void vitaEventSendObjectMetadata(vita_device_t *device, vita_event_t *event, int eventId)
@@ -253,6 +265,9 @@ void vitaEventSendObjectMetadata(vita_device_t *device, vita_event_t *event, int
 
     lockDatabase();
     filterObjects(browse.ohfiParent, &meta);  // if meta is null, will return empty XML
+    // send a copy so the database isn't locked while it goes to the device
+    meta = copyMetadataList(meta);
+    unlockDatabase();
 
     if (VitaMTP_SendObjectMetadata(device, eventId, meta) != PTP_RC_OK)   // send all objects with OHFI parent
     {
@@ -264,7 +279,77 @@ void vitaEventSendObjectMetadata(vita_device_t *device, vita_event_t *event, int
         VitaMTP_ReportResult(device, eventId, PTP_RC_OK);
     }
 
+    freeMetadataList(meta);
+}
+
+// copies an object and everything under it so it can be sent without the database locked
+static struct cma_object *copyObjectTree(int ohfi, int *p_count)
+{
+    struct cma_object *start;
+    struct cma_object *object;
+    struct cma_object *copy;
+    int count = 0;
+    int i;
+
+    lockDatabase();
+
+    if ((start = ohfiToObject(ohfi)) == NULL)
+    {
+        unlockDatabase();
+        return NULL;
+    }
+
+    expandObject(start);
+    object = start;
+
+    do
+    {
+        count++;
+        object = object->next_object;
+    }
+    while (object != NULL && object->metadata.ohfiParent >= OHFI_OFFSET);  // get everything under this "folder"
+
+    copy = calloc(count, sizeof(struct cma_object));
+
+    for (i = 0, object = start; i < count; i++, object = object->next_object)
+    {
+        copyMetadata(&copy[i].metadata, &object->metadata);
+        copy[i].path = strdup(object->path);
+    }
+
     unlockDatabase();
+    *p_count = count;
+    return copy;
+}
+
+static void freeObjectTree(struct cma_object *objects, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        freeMetadata(&objects[i].metadata);
+        free(objects[i].path);
+    }
+
+    free(objects);
+}
+
+// Writes out the parts received so far. A backup's last part is only written
+// after the Vita has been answered, so its failure is reported on the next
+// request about the same object instead.
+static int finishReceivedParts(vita_device_t *device, int eventId, int ohfi)
+{
+    finishFileWrites();
+
+    if (takeFileWriteError(ohfi))
+    {
+        LOG(LERROR, "Writing OHFI %d failed.\n", ohfi);
+        VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Invalid_Permission);
+        return -1;
+    }
+
+    return 0;
 }
 
 void vitaEventSendObject(vita_device_t *device, vita_event_t *event, int eventId)
@@ -273,73 +358,117 @@ void vitaEventSendObject(vita_device_t *device, vita_event_t *event, int eventId
     uint32_t ohfi = event->Param2;
     uint32_t parentHandle = event->Param3;
     uint32_t handle;
-    lockDatabase();
-    struct cma_object *object = ohfiToObject(ohfi);
-    struct cma_object *start = object;
-    struct cma_object *temp = NULL;
+    uint16_t ret;
+    struct cma_object *objects;
+    struct cma_object *object;
+    int count;
+    int i;
+    int j;
 
-    if (object == NULL)
+    finishFileWrites();
+
+    if ((objects = copyObjectTree(ohfi, &count)) == NULL)
     {
-        unlockDatabase();
         LOG(LERROR, "Failed to find OHFI %d.\n", ohfi);
         VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Invalid_OHFI);
         return;
     }
 
-    unsigned char *data = NULL;
-    unsigned int len = 0;
+    for (i = 0; i < count; i++)
+    {
+        if (takeFileWriteError(objects[i].metadata.ohfi))
+        {
+            LOG(LERROR, "Writing OHFI %d failed.\n", objects[i].metadata.ohfi);
+            freeObjectTree(objects, count);
+            VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Invalid_Permission);
+            return;
+        }
+    }
 
-    do
+    int fd;
+
+    for (i = 0; i < count; i++)
     {
-        data = NULL;
-        len = (unsigned int)object->metadata.size;
+        object = &objects[i];
+        fd = -1;
 
-        // read the file to send if it's not a directory
-        // if it is a directory, data and len are not used by VitaMTP
+        // open the file to send if it's not a directory
+        // if it is a directory, the file is not used by VitaMTP
         if (object->metadata.dataType & File)
         {
-            if (readFileToBuffer(object->path, 0, &data, &len) < 0)
+            if ((fd = open(object->path, O_RDONLY | O_BINARY)) < 0)
             {
-                unlockDatabase();
                 LOG(LERROR, "Failed to read %s.\n", object->path);
+                freeObjectTree(objects, count);
                 VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Not_Exist_Object);
                 return;
             }
         }
 
+        // have the disk start on the next file while this one goes out
+        for (j = i + 1; j < count; j++)
+        {
+            if (objects[j].metadata.dataType & File)
+            {
+                prefetchFile(objects[j].path, PREFETCH_SIZE);
+                break;
+            }
+        }
+
         // get the PTP object ID for the parent to put the object
         // we know the parent has to be before the current node
         // the first time this is called, parentHandle is left untouched
-        for (temp = start; temp != NULL && temp != object; temp = temp->next_object)
+        for (j = 0; j < i; j++)
         {
-            if (temp->metadata.ohfi == object->metadata.ohfiParent)
+            if (objects[j].metadata.ohfi == object->metadata.ohfiParent)
             {
-                parentHandle = temp->metadata.handle;
+                parentHandle = objects[j].metadata.handle;
                 break;
             }
         }
 
-        // send the data over
-        // TODO: Use mmap when sending extra large objects like videos
-        LOG(LINFO, "Sending %s of %u bytes to device.\n", object->metadata.name, len);
+        // send the data over, the file is read as it is sent
+        LOG(LINFO, "Sending %s of %lu bytes to device.\n", object->metadata.name, object->metadata.size);
         LOG(LDEBUG, "OHFI %d with handle 0x%08X\n", ohfi, parentHandle);
 
-        if (VitaMTP_SendObject(device, &parentHandle, &handle, &object->metadata, data) != PTP_RC_OK)
+        ret = VitaMTP_SendObjectFromFD(device, &parentHandle, &handle, &object->metadata, fd, eventId);
+
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+
+        if (ret == PTP_ERROR_CANCEL)
+        {
+            LOG(LINFO, "Sending of %s cancelled.\n", object->metadata.name);
+            freeObjectTree(objects, count);
+            VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Canceled);
+            return;
+        }
+
+        if (ret != PTP_RC_OK)
         {
             LOG(LERROR, "Sending of %s failed.\n", object->metadata.name);
-            unlockDatabase();
-            free(data);
+            freeObjectTree(objects, count);
             return;
         }
 
         object->metadata.handle = handle;
-        object = object->next_object;
+    }
+
+    // record the handles on whatever is still in the database
+    lockDatabase();
 
-        free(data);
+    for (i = 0; i < count; i++)
+    {
+        if ((object = findObject(objects[i].metadata.ohfi, objects[i].path)) != NULL)
+        {
+            object->metadata.handle = objects[i].metadata.handle;
+        }
     }
-    while (object != NULL && object->metadata.ohfiParent >= OHFI_OFFSET);  // get everything under this "folder"
 
     unlockDatabase();
+    freeObjectTree(objects, count);
     VitaMTP_ReportResultWithParam(device, eventId, PTP_RC_OK, handle);
     VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Invalid_Data);  // TODO: Send thumbnail
 }
@@ -348,8 +477,16 @@ void vitaEventCancelTask(vita_device_t *device, vita_event_t *event, int eventId
 {
     LOG(LVERBOSE, "Event recieved: %s, code: 0x%x, id: %d\n", "RequestCancelTask", event->Code, eventId);
     int eventIdToCancel = event->Param2;
-    VitaMTP_CancelTask(device, eventIdToCancel);
-    LOG(LERROR, "Event CancelTask (0x%x) unimplemented!\n", event->Code);
+
+    // the transfer for the event stops on its next block
+    // and the event's handler reports the cancel
+    if (VitaMTP_CancelTask(device, eventIdToCancel) != PTP_RC_OK)
+    {
+        LOG(LERROR, "Cannot cancel event %d.\n", eventIdToCancel);
+        return;
+    }
+
+    LOG(LINFO, "Cancelling event %d.\n", eventIdToCancel);
 }
 
 void vitaEventSendHttpObjectFromURL(vita_device_t *device, vita_event_t *event, int eventId)
@@ -363,28 +500,32 @@ void vitaEventSendHttpObjectFromURL(vita_device_t *device, vita_event_t *event,
         return;
     }
 
-    unsigned char *data;
-    unsigned int len = 0;
-    int ret = requestURL(url, &data, &len);
+    uint64_t len;
+    uint16_t ret;
+    int fd;
 
-    if (ret < 0 && strstr(url, "/psp2-updatelist.xml"))
+    // mapped files are sent straight from disk, they can be firmware updates
+    if ((fd = openURL(url, &len)) >= 0)
+    {
+        LOG(LINFO, "Sending %llu bytes of data for HTTP request %s\n", (unsigned long long)len, url);
+        ret = VitaMTP_SendHttpObjectFromURLFD(device, eventId, fd, len);
+        close(fd);
+    }
+    else if (strstr(url, "/psp2-updatelist.xml"))
     {
         LOG(LINFO, "Found request for update request. Sending cached data.\n");
-        data = (unsigned char *)strdup(g_update_list);
         // weirdly there must NOT be a null terminator
-        len = (unsigned int)strlen(g_update_list);
+        ret = VitaMTP_SendHttpObjectFromURL(device, eventId, (void *)g_update_list, sizeof(g_update_list) - 1);
     }
-    else if (ret < 0)
+    else
     {
-        free(url);
         LOG(LERROR, "Failed to download %s\n", url);
         VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Failed_Download);
+        free(url);
         return;
     }
 
-    LOG(LINFO, "Sending %ud bytes of data for HTTP request %s\n", len, url);
-
-    if (VitaMTP_SendHttpObjectFromURL(device, eventId, data, len) != PTP_RC_OK)
+    if (ret != PTP_RC_OK)
     {
         LOG(LERROR, "Failed to send HTTP object.\n");
     }
@@ -394,7 +535,6 @@ void vitaEventSendHttpObjectFromURL(vita_device_t *device, vita_event_t *event,
     }
 
     free(url);
-    free(data);
 }
 
 void vitaEventSendObjectStatus(vita_device_t *device, vita_event_t *event, int eventId)
@@ -502,6 +642,8 @@ void vitaEventDeleteObject(vita_device_t *device, vita_event_t *event, int event
 {
     LOG(LVERBOSE, "Event recieved: %s, code: 0x%x, id: %d\n", "RequestDeleteObject", event->Code, eventId);
     int ohfi = event->Param2;
+    finishFileWrites();
+    takeFileWriteError(ohfi); // the object is going away, it does not matter if it was written
     lockDatabase();
     struct cma_object *object = ohfiToObject(ohfi);
 
@@ -514,8 +656,7 @@ void vitaEventDeleteObject(vita_device_t *device, vita_event_t *event, int event
     }
 
     struct cma_object *parent = ohfiToObject(object->metadata.ohfiParent);
-
-    deleteAll(object->path);
+    char *path = strdup(object->path);
 
     LOG(LINFO, "Deleted %s\n", object->metadata.path);
 
@@ -523,6 +664,10 @@ void vitaEventDeleteObject(vita_device_t *device, vita_event_t *event, int event
 
     unlockDatabase();
 
+    // the files are removed in the background
+    trashEntry(path);
+    free(path);
+
     VitaMTP_ReportResult(device, eventId, PTP_RC_OK);
 }
 
@@ -551,8 +696,8 @@ void vitaEventSendHttpObjectPropFromURL(vita_device_t *device, vita_event_t *eve
 {
     LOG(LVERBOSE, "Event recieved: %s, code: 0x%x, id: %d\n", "RequestSendHttpObjectPropFromURL", event->Code, eventId);
     char *url = NULL;
-    unsigned char *data;
     http_object_prop_t httpobjectprop;
+    uint64_t size;
 
     if (VitaMTP_GetUrl(device, eventId, &url) != PTP_RC_OK)
     {
@@ -560,7 +705,16 @@ void vitaEventSendHttpObjectPropFromURL(vita_device_t *device, vita_event_t *eve
         return;
     }
 
-    if (requestURL(url, &data, (unsigned int *)&httpobjectprop.size) < 0)
+    // only the size is needed, the file is read when it is asked for
+    if (statURL(url, &size) == 0)
+    {
+        httpobjectprop.size = size;
+    }
+    else if (strstr(url, "/psp2-updatelist.xml"))
+    {
+        httpobjectprop.size = sizeof(g_update_list) - 1;
+    }
+    else
     {
         LOG(LERROR, "Failed to read data for %s\n", url);
         VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Failed_Download);
@@ -568,7 +722,6 @@ void vitaEventSendHttpObjectPropFromURL(vita_device_t *device, vita_event_t *eve
         return;
     }
 
-    free(data);
     httpobjectprop.timestamp = NULL; // TODO: Actually get timestamp
     httpobjectprop.timestamp_len = 0;
 
@@ -584,6 +737,59 @@ void vitaEventSendHttpObjectPropFromURL(vita_device_t *device, vita_event_t *eve
     free(url);
 }
 
+// takes the kept descriptor if it is for path, otherwise opens path
+static int openPartFile(const char *path)
+{
+    struct stat st;
+    struct stat cached;
+    int fd = -1;
+
+    pthread_mutex_lock(&g_part_file_lock);
+
+    if (g_part_file_fd >= 0 && strcmp(g_part_file_path, path) == 0)
+    {
+        // the file could have been replaced since it was opened
+        if (stat(path, &st) == 0 && fstat(g_part_file_fd, &cached) == 0 &&
+                st.st_dev == cached.st_dev && st.st_ino == cached.st_ino)
+        {
+            fd = g_part_file_fd;
+        }
+        else
+        {
+            close(g_part_file_fd);
+        }
+
+        g_part_file_fd = -1;
+        free(g_part_file_path);
+        g_part_file_path = NULL;
+    }
+
+    pthread_mutex_unlock(&g_part_file_lock);
+
+    if (fd < 0)
+    {
+        fd = open(path, O_RDONLY | O_BINARY);
+    }
+
+    return fd;
+}
+
+// keeps fd open for the next part, closing the one kept before
+static void keepPartFile(const char *path, int fd)
+{
+    pthread_mutex_lock(&g_part_file_lock);
+
+    if (g_part_file_fd >= 0)
+    {
+        close(g_part_file_fd);
+        free(g_part_file_path);
+    }
+
+    g_part_file_path = fd >= 0 ? strdup(path) : NULL;
+    g_part_file_fd = fd;
+    pthread_mutex_unlock(&g_part_file_lock);
+}
+
 void vitaEventSendPartOfObject(vita_device_t *device, vita_event_t *event, int eventId)
 {
     LOG(LVERBOSE, "Event recieved: %s, code: 0x%x, id: %d\n", "RequestSendPartOfObject", event->Code, eventId);
@@ -606,21 +812,36 @@ void vitaEventSendPartOfObject(vita_device_t *device, vita_event_t *event, int e
         return;
     }
 
-    unsigned char *data;
-    unsigned int len = (unsigned int)part_init.size;
+    char *path = strdup(object->path);
+    LOG(LINFO, "Sending %s at file offset %llu for %llu bytes\n", object->metadata.path, part_init.offset, part_init.size);
+    unlockDatabase();
 
-    if (readFileToBuffer(object->path, part_init.offset, &data, &len) < 0)
+    struct stat st;
+    int fd;
+
+    // the part is sent straight from the file so it has to be all there
+    if (finishReceivedParts(device, eventId, part_init.ohfi) < 0)
     {
-        LOG(LERROR, "Cannot read %s.\n", object->path);
-        VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Not_Exist_Object);
-        unlockDatabase();
+        free(path);
         return;
     }
 
-    LOG(LINFO, "Sending %s at file offset %llu for %llu bytes\n", object->metadata.path, part_init.offset, part_init.size);
-    unlockDatabase();
+    if ((fd = openPartFile(path)) < 0 || fstat(fd, &st) < 0 ||
+            part_init.offset + part_init.size > (uint64_t)st.st_size)
+    {
+        LOG(LERROR, "Cannot read %s.\n", path);
+
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+
+        VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Not_Exist_Object);
+        free(path);
+        return;
+    }
 
-    if (VitaMTP_SendPartOfObject(device, eventId, data, len) != PTP_RC_OK)
+    if (VitaMTP_SendPartOfObjectFromFD(device, eventId, fd, part_init.offset, part_init.size) != PTP_RC_OK)
     {
         LOG(LERROR, "Failed to send part of object OHFI %d\n", part_init.ohfi);
     }
@@ -629,7 +850,8 @@ void vitaEventSendPartOfObject(vita_device_t *device, vita_event_t *event, int e
         VitaMTP_ReportResult(device, eventId, PTP_RC_OK);
     }
 
-    free(data);
+    keepPartFile(path, fd);
+    free(path);
 }
 
 void vitaEventOperateObject(vita_device_t *device, vita_event_t *event, int eventId)
@@ -643,6 +865,11 @@ void vitaEventOperateObject(vita_device_t *device, vita_event_t *event, int even
         return;
     }
 
+    if (finishReceivedParts(device, eventId, operateobject.ohfi) < 0)
+    {
+        return;
+    }
+
     lockDatabase();
     struct cma_object *root = ohfiToObject(operateobject.ohfi);
     struct cma_object *newobj;
@@ -700,7 +927,7 @@ void vitaEventOperateObject(vita_device_t *device, vita_event_t *event, int even
         origName = strdup(root->metadata.name);
         origFullPath = strdup(root->path);
         // rename in database
-        renameRootEntry(root, NULL, operateobject.title);
+        renameRootEntry(root, operateobject.title);
 
         // rename in filesystem
         if (move(origFullPath, root->path) < 0)
@@ -708,7 +935,7 @@ void vitaEventOperateObject(vita_device_t *device, vita_event_t *event, int even
             // report the failure
             LOG(LERROR, "Unable to rename %s to %s\n", origName, operateobject.title);
             // rename back
-            renameRootEntry(root, NULL, origName);
+            renameRootEntry(root, origName);
             // free old data
             free(origFullPath);
             free(origName);
@@ -740,10 +967,11 @@ void vitaEventOperateObject(vita_device_t *device, vita_event_t *event, int even
 void vitaEventGetPartOfObject(vita_device_t *device, vita_event_t *event, int eventId)
 {
     LOG(LVERBOSE, "Event recieved: %s, code: 0x%x, id: %d\n", "RequestGetPartOfObject", event->Code, eventId);
-    unsigned char *data;
+    unsigned char *buffer;
     send_part_init_t part_init;
 
-    if (VitaMTP_GetPartOfObject(device, eventId, &part_init, &data) != PTP_RC_OK)
+    // the data is left where it was received and written from there
+    if (VitaMTP_GetPartOfObjectBuffer(device, eventId, &part_init, &buffer) != PTP_RC_OK)
     {
         LOG(LERROR, "Cannot get object from device.\n");
         return;
@@ -757,27 +985,44 @@ void vitaEventGetPartOfObject(vita_device_t *device, vita_event_t *event, int ev
         unlockDatabase();
         LOG(LERROR, "Cannot find OHFI %d.\n", part_init.ohfi);
         VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Invalid_OHFI);
-        free(data);
+        free(buffer);
         return;
     }
 
+    char *path = strdup(object->path);
     LOG(LINFO, "Receiving %s at offset %llu for %llu bytes\n", object->metadata.path, part_init.offset, part_init.size);
+    unlockDatabase();
 
-    if (writeFileFromBuffer(object->path, part_init.offset, data, part_init.size) < 0)
+    // earlier parts are written behind our back, so their errors show up now
+    if (takeFileWriteError(part_init.ohfi))
+    {
+        LOG(LERROR, "Writing an earlier part of OHFI %d failed.\n", part_init.ohfi);
+        VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Invalid_Permission);
+        free(buffer);
+    }
+    else if (queueFileWrite(part_init.ohfi, path, part_init.offset, buffer, buffer + sizeof(send_part_init_t),
+                            part_init.size) < 0)
     {
-        LOG(LERROR, "Cannot write to file %s.\n", object->path);
+        LOG(LERROR, "Cannot write to file %s.\n", path);
         VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Invalid_Permission);
     }
     else
     {
-        // add size to all parents
-        incrementSizeMetadata(object, part_init.size);
-        LOG(LDEBUG, "Written %llu bytes to %s at offset %llu.\n", part_init.size, object->path, part_init.offset);
+        // add size to all parents, unless the object went away while unlocked
+        lockDatabase();
+
+        if ((object = findObject(part_init.ohfi, path)) != NULL)
+        {
+            addObjectSize(object, part_init.size);
+            object->head_length = 0; // the fingerprint has to be read again
+        }
+
+        unlockDatabase();
+        LOG(LDEBUG, "Queued %llu bytes for %s at offset %llu.\n", part_init.size, path, part_init.offset);
         VitaMTP_ReportResult(device, eventId, PTP_RC_OK);
     }
 
-    unlockDatabase();
-    free(data);
+    free(path);
 }
 
 void vitaEventSendStorageSize(vita_device_t *device, vita_event_t *event, int eventId)
@@ -836,7 +1081,7 @@ void vitaEventCheckExistance(vita_device_t *device, vita_event_t *event, int eve
     LOG(LVERBOSE, "Event recieved: %s, code: 0x%x, id: %d\n", "RequestCheckExistance [sic]", event->Code, eventId);
     int handle = event->Param2;
     existance_object_t existance;
-    struct cma_object *object;
+    int ohfi;
 
     if (VitaMTP_CheckExistance(device, handle, &existance) != PTP_RC_OK)
     {
@@ -844,113 +1089,271 @@ void vitaEventCheckExistance(vita_device_t *device, vita_event_t *event, int eve
         return;
     }
 
-    lockDatabase();
+    finishFileWrites(); // files are compared by what is on disk
 
-    if ((object = pathToObject(existance.name, 0)) == NULL)
+    // a file that was not written completely is not the same
+    if ((ohfi = findSameObject(existance.name, existance.size, (unsigned char *)existance.data,
+                               existance.data_length)) == 0 || takeFileWriteError(ohfi))
     {
         VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Different_Object);
     }
     else
     {
-        VitaMTP_ReportResultWithParam(device, eventId, PTP_RC_VITA_Same_Object, object->metadata.ohfi);
+        LOG(LVERBOSE, "%s is already here as OHFI %d.\n", existance.name, ohfi);
+        VitaMTP_ReportResultWithParam(device, eventId, PTP_RC_VITA_Same_Object, ohfi);
     }
 
-    unlockDatabase();
+    free(existance.name);
     VitaMTP_ReportResult(device, eventId, PTP_RC_OK);
 }
 
-uint16_t vitaGetAllObjects(vita_device_t *device, int eventId, struct cma_object *parent, uint32_t handle)
+struct received_file
 {
-    union
+    int fd;
+    uint64_t offset;
+    struct store_stream *stream;
+};
+
+// writes out what is received and hashes it for the store on the way
+static int writeReceived(void *priv, const unsigned char *data, unsigned long len)
+{
+    struct received_file *file = priv;
+    unsigned long written;
+    ssize_t ret;
+
+    for (written = 0; written < len; written += ret)
     {
-        unsigned char *fileData;
-        uint32_t *handles;
-    } data;
-    unsigned int length;
+        if ((ret = write(file->fd, data + written, len - written)) <= 0)
+        {
+            return -1;
+        }
+    }
+
+    storeData(file->stream, file->offset, data, len);
+    file->offset += len;
+    return 0;
+}
+
+// dir is where the object is written on disk. The top object (dir == NULL) is
+// received next to where it belongs and moved into place once it is all
+// there, so a failed restore leaves any old copy as it was.
+uint16_t vitaGetAllObjects(vita_device_t *device, int eventId, int ohfiParent, const char *parentPath, const char *dir,
+                           uint32_t handle)
+{
+    uint32_t *handles = NULL;
+    unsigned int length = 0;
     metadata_t tempMeta;
+    struct cma_object *parent;
     struct cma_object *object;
     struct cma_object *temp;
+    char *path;
+    char *dest;
+    int ohfi;
+    int ohfiOld = 0;
     unsigned int i;
-    uint16_t ret;
+    uint16_t ret = PTP_RC_OK;
+    struct received_file file;
+    int fd;
 
-    if (VitaMTP_GetObject(device, handle, &tempMeta, (void **)&data, &length) != PTP_RC_OK)
+    if (VitaMTP_Is_Task_Cancelled(device, eventId))
+    {
+        LOG(LINFO, "Receiving cancelled.\n");
+        return PTP_RC_VITA_Canceled;
+    }
+
+    if (VitaMTP_GetObjectInfo(device, handle, &tempMeta) != PTP_RC_OK)
     {
         LOG(LERROR, "Cannot get object for handle %d.\n", handle);
         return PTP_RC_VITA_Invalid_Data;
     }
 
+    if ((tempMeta.dataType & Folder) && VitaMTP_GetObjectHandles(device, handle, &handles, &length) != PTP_RC_OK)
+    {
+        LOG(LERROR, "Cannot get contents of %s.\n", tempMeta.name);
+        free(tempMeta.name);
+        return PTP_RC_VITA_Invalid_Data;
+    }
+
+    // only the bookkeeping is done with the database locked, not the transfer
     lockDatabase();
 
+    if ((parent = findObject(ohfiParent, parentPath)) == NULL)
+    {
+        unlockDatabase();
+        LOG(LERROR, "Parent OHFI %d no longer exists.\n", ohfiParent);
+        free(tempMeta.name);
+        free(handles);
+        return PTP_RC_VITA_Invalid_OHFI;
+    }
+
     if ((object = addToDatabase(parent, tempMeta.name, 0, tempMeta.dataType)) == NULL)    // size will be added after read
     {
         unlockDatabase();
         LOG(LERROR, "Cannot add object %s to database.\n", tempMeta.name);
         free(tempMeta.name);
-        free(data.fileData);
+        free(handles);
         return PTP_RC_VITA_Invalid_Data;
     }
 
     object->metadata.handle = tempMeta.handle;
-    free(tempMeta.name);  // not needed anymore, copy in object
 
     if ((temp = pathToObject(object->metadata.name, parent->metadata.ohfi)) != object
             && temp != NULL)    // check if object exists already
     {
-        // delete existing file/folder
-        LOG(LDEBUG, "Deleting %s\n", temp->path);
-        deleteAll(temp->path);
-        removeFromDatabase(temp->metadata.ohfi, parent);
+        // it is replaced once the new one is all there
+        ohfiOld = temp->metadata.ohfi;
     }
 
     if (object->metadata.dataType & File)
     {
         LOG(LINFO, "Receiving %s for %lu bytes.\n", object->metadata.path, tempMeta.size);
-        
-        if (createNewFile(object->path) < 0 || writeFileFromBuffer(object->path, 0, data.fileData, tempMeta.size) < 0)
-        {
-            LOG(LERROR, "Cannot write to %s.\n", object->path);
-            removeFromDatabase(object->metadata.ohfi, parent);
-            unlockDatabase();
-            free(data.fileData);
-            return PTP_RC_VITA_Invalid_Permission;
-        }
-
-        incrementSizeMetadata(object, tempMeta.size);
     }
     else if (object->metadata.dataType & Folder)
     {
         LOG(LINFO, "Receiving directory %s\n", object->metadata.path);
+    }
 
-        if (createNewDirectory(object->path) < 0)
+    ohfi = object->metadata.ohfi;
+    path = strdup(object->path);
+    unlockDatabase();
+
+    fd = -1;
+
+    if (dir == NULL)
+    {
+        // the old copy is kept until the new one is complete
+        dest = createIncomingEntry(path, (tempMeta.dataType & Folder) != 0, &fd);
+    }
+    else
+    {
+        asprintf(&dest, "%s/%s", dir, tempMeta.name);
+
+        if (tempMeta.dataType & File)
         {
-            removeFromDatabase(object->metadata.ohfi, parent);
-            LOG(LERROR, "Cannot create directory: %s\n", object->path);
-            unlockDatabase();
-            free(data.fileData);
-            return PTP_RC_VITA_Failed_Operate_Object;
+            fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0777);
         }
+        else if (tempMeta.dataType & Folder && createNewDirectory(dest) < 0)
+        {
+            LOG(LERROR, "Cannot create directory: %s\n", dest);
+            ret = PTP_RC_VITA_Failed_Operate_Object;
+        }
+    }
 
-        for (i = 0; i < length; i++)
+    free(tempMeta.name);  // not needed anymore, copy in object
+
+    if (dest == NULL)
+    {
+        LOG(LERROR, "Cannot receive %s.\n", path);
+        ret = PTP_RC_VITA_Invalid_Permission;
+    }
+    else if (tempMeta.dataType & File)
+    {
+        if (fd < 0)
+        {
+            LOG(LERROR, "Cannot write to %s.\n", dest);
+            ret = PTP_RC_VITA_Invalid_Permission;
+        }
+        else
         {
-            ret = vitaGetAllObjects(device, eventId, object, data.handles[i]);
+            // the data is written out as it is received
+            file.fd = fd;
+            file.offset = 0;
+            file.stream = storeBegin(path);
+            ret = VitaMTP_GetObjectToCallback(device, handle, writeReceived, &file, eventId);
 
             if (ret != PTP_RC_OK)
             {
-                removeFromDatabase(object->metadata.ohfi, parent);
-                unlockDatabase();
-                free(data.fileData);
-                return ret;
+                LOG(LERROR, "Cannot receive %s.\n", path);
+                ret = ret == PTP_ERROR_CANCEL ? PTP_RC_VITA_Canceled : PTP_RC_VITA_Invalid_Data;
+            }
+
+            // it has to be on disk before it replaces the old copy
+#ifdef _WIN32
+            if (ret == PTP_RC_OK && _commit(fd) < 0)
+#else
+            if (ret == PTP_RC_OK && fsync(fd) < 0)
+#endif
+            {
+                LOG(LERROR, "Cannot write to %s.\n", dest);
+                ret = PTP_RC_VITA_Invalid_Permission;
+            }
+
+            // the store gets to it once it is moved into place
+            if (ret == PTP_RC_OK)
+            {
+                storeFile(file.stream, fd, path);
+            }
+            else
+            {
+                storeDiscard(file.stream);
+            }
+
+            if (close(fd) < 0 && ret == PTP_RC_OK)
+            {
+                LOG(LERROR, "Cannot write to %s.\n", dest);
+                ret = PTP_RC_VITA_Invalid_Permission;
             }
         }
     }
+    else if (tempMeta.dataType & Folder)
+    {
+        for (i = 0; ret == PTP_RC_OK && i < length; i++)
+        {
+            ret = vitaGetAllObjects(device, eventId, ohfi, path, dest, handles[i]);
+        }
+    }
     else
     {
         LOG(LERROR, "Invalid object.\n"); // should not be here
     }
 
+    if (dir == NULL && dest != NULL)
+    {
+        if (ret == PTP_RC_OK && replaceEntry(dest, path) < 0)
+        {
+            LOG(LERROR, "Cannot move %s into place.\n", path);
+            ret = PTP_RC_VITA_Invalid_Permission;
+        }
+
+        if (ret != PTP_RC_OK)
+        {
+            deleteAll(dest);
+        }
+    }
+
+    // commit the result, unless the database was refreshed in the meantime
+    lockDatabase();
+
+    if ((object = findObject(ohfi, path)) != NULL)
+    {
+        parent = findObject(ohfiParent, parentPath);
+
+        if (ret != PTP_RC_OK)
+        {
+            if (parent != NULL)
+            {
+                removeFromDatabase(ohfi, parent);
+            }
+        }
+        else
+        {
+            if (tempMeta.dataType & File)
+            {
+                addObjectSize(object, tempMeta.size);
+            }
+
+            if (ohfiOld != 0 && parent != NULL && findObject(ohfiOld, path) != NULL)
+            {
+                removeFromDatabase(ohfiOld, parent);
+            }
+        }
+    }
+
     unlockDatabase();
-    free(data.fileData);
-    return PTP_RC_OK;
+    free(dest);
+    free(path);
+    free(handles);
+    return ret;
 }
 
 void vitaEventGetTreatObject(vita_device_t *device, vita_event_t *event, int eventId)
@@ -958,6 +1361,9 @@ void vitaEventGetTreatObject(vita_device_t *device, vita_event_t *event, int eve
     LOG(LVERBOSE, "Event recieved: %s, code: 0x%x, id: %d\n", "RequestGetTreatObject", event->Code, eventId);
     treat_object_t treatObject;
     struct cma_object *parent;
+    char *parentPath;
+    int ohfiParent;
+    uint16_t ret;
 
     if (VitaMTP_GetTreatObject(device, eventId, &treatObject) != PTP_RC_OK)
     {
@@ -965,14 +1371,31 @@ void vitaEventGetTreatObject(vita_device_t *device, vita_event_t *event, int eve
         return;
     }
 
+    finishFileWrites();
+    lockDatabase();
+
     if ((parent = ohfiToObject(treatObject.ohfiParent)) == NULL)
     {
+        unlockDatabase();
         LOG(LERROR, "Cannot find parent OHFI %d.\n", treatObject.ohfiParent);
         VitaMTP_ReportResult(device, eventId, PTP_RC_VITA_Invalid_OHFI);
         return;
     }
 
-    VitaMTP_ReportResult(device, eventId, vitaGetAllObjects(device, eventId, parent, treatObject.handle));
+    ohfiParent = parent->metadata.ohfi;
+    parentPath = strdup(parent->path);
+    unlockDatabase();
+
+    // one request for the whole tree's metadata instead of several per object
+    // if it fails we just ask for each object as we go
+    VitaMTP_PrefetchObjectTree(device, treatObject.handle);
+    // the files are stored by where they end up, so not until they are there
+    storeHold();
+    ret = vitaGetAllObjects(device, eventId, ohfiParent, parentPath, NULL, treatObject.handle);
+    storeRelease();
+    VitaMTP_ReportResult(device, eventId, ret);
+    VitaMTP_ReleaseObjectTree(device);
+    free(parentPath);
 }
 
 void vitaEventSendCopyConfirmationInfo(vita_device_t *device, vita_event_t *event, int eventId)
@@ -1075,30 +1498,333 @@ void vitaEventUnimplementated(vita_device_t *device, vita_event_t *event, int ev
     LOG(LDEBUG, "Param1: 0x%08X, Param2: 0x%08X, Param3: 0x%08X\n", event->Param1, event->Param2, event->Param3);
 }
 
+static void transferProfileId(vita_device_t *device, char *id, size_t len)
+{
+    snprintf(id, len, "%s:%s", VitaMTP_Get_Device_Type(device) == VitaDeviceWireless ? "wireless" : "usb",
+             VitaMTP_Get_Identification(device));
+}
+
+static void startCalibration(vita_device_t *device)
+{
+    pthread_mutex_lock(&g_calibration_lock);
+    g_calibrating = VitaMTP_Calibrate_Transfers(device) == 0;
+    pthread_mutex_unlock(&g_calibration_lock);
+}
+
+static void loadTransferProfile(vita_device_t *device)
+{
+    vita_transfer_profile_t profile;
+    char id[64];
+
+    transferProfileId(device, id, sizeof(id));
+
+    if (readTransferProfile(g_profiles_path, id, &profile) == 0 && VitaMTP_Set_Transfer_Profile(device, &profile) == 0)
+    {
+        LOG(LVERBOSE, "Using saved transfer profile for %s, block size 0x%x\n", id, profile.block_size);
+    }
+    else
+    {
+        LOG(LVERBOSE, "No transfer profile for %s, calibrating.\n", id);
+        startCalibration(device);
+    }
+}
+
+// saves the profile once calibration is done, only one caller gets to save it
+static void saveTransferProfile(vita_device_t *device)
+{
+    vita_transfer_profile_t profile;
+    char id[64];
+
+    pthread_mutex_lock(&g_calibration_lock);
+
+    if (!g_calibrating || VitaMTP_Get_Transfer_Profile(device, &profile) != 0)
+    {
+        pthread_mutex_unlock(&g_calibration_lock);
+        return; // not calibrating or still at it
+    }
+
+    g_calibrating = 0;
+    transferProfileId(device, id, sizeof(id));
+    LOG(LINFO, "Saving transfer profile for %s, block size 0x%x\n", id, profile.block_size);
+    writeTransferProfile(g_profiles_path, id, &profile);
+    pthread_mutex_unlock(&g_calibration_lock);
+}
+
+// Events are run by a pool of workers in the order they came in, except
+// that an event may start while earlier ones are still running if it
+// cannot get in their way: events that only read can run next to each
+// other unless they are about the same object, and events that change
+// the database, the files or the settings run alone. The transactions
+// themselves are put on the wire one at a time by libvitamtp.
+struct event_queue_item
+{
+    vita_event_t event;
+    int exclusive; // runs with no other event
+    int ohfi; // the object it is about if that is known up front, or 0
+    int running;
+    struct event_queue_item *next;
+};
+
+// events waiting for a worker or still running, oldest first
+static struct event_queue_item *g_event_queue_head = NULL;
+static struct event_queue_item *g_event_queue_tail = NULL;
+static pthread_mutex_t g_event_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_event_queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t g_event_workers[OPENCMA_EVENT_WORKERS];
+static int g_event_worker_count = 0;
+
+static void processEvent(vita_device_t *device, vita_event_t *event)
+{
+    int slot = event->Code - PTP_EC_VITA_RequestSendNumOfObject;
+
+    if (slot < 0 || slot >= sizeof(g_event_processes)/sizeof(void *))
+    {
+        slot = sizeof(g_event_processes)/sizeof(void *) - 1;  // last item is pointer to "unimplemented
+    }
+
+    LOG(LDEBUG, "Event 0x%04X recieved, slot %d with function address %p\n", event->Code, slot, g_event_processes[slot]);
+    g_event_processes[slot](device, event, event->Param1);
+}
+
+static void classifyEvent(struct event_queue_item *item)
+{
+    item->exclusive = 0;
+    item->ohfi = 0;
+
+    switch (item->event.Code)
+    {
+    case PTP_EC_VITA_RequestSendNumOfObject:
+        // may ask for the database to be created, see the handler
+        item->exclusive = item->event.Param2 == VITA_OHFI_PACKAGE;
+        item->ohfi = item->event.Param2;
+        break;
+
+    case PTP_EC_VITA_RequestSendObject:
+    case PTP_EC_VITA_RequestSendObjectThumb:
+    case PTP_EC_VITA_RequestSendStorageSize:
+        item->ohfi = item->event.Param2;
+        break;
+
+    case PTP_EC_VITA_RequestSendObjectMetadata:
+    case PTP_EC_VITA_RequestSendHttpObjectFromURL:
+    case PTP_EC_VITA_RequestSendObjectStatus:
+    case PTP_EC_VITA_RequestSendHttpObjectPropFromURL:
+    case PTP_EC_VITA_RequestSendPartOfObject:
+    case PTP_EC_VITA_RequestCheckExistance:
+    case PTP_EC_VITA_RequestSendCopyConfirmationInfo:
+    case PTP_EC_VITA_RequestSendObjectMetadataItems:
+    case PTP_EC_VITA_RequestSendNPAccountInfo:
+        break;
+
+    default:
+        item->exclusive = 1;
+        break;
+    }
+}
+
+// the oldest event that can start now, call with the queue locked
+static struct event_queue_item *nextRunnableEvent(void)
+{
+    struct event_queue_item *item;
+    struct event_queue_item *earlier;
+
+    for (item = g_event_queue_head; item != NULL; item = item->next)
+    {
+        if (item->running)
+        {
+            continue;
+        }
+
+        for (earlier = g_event_queue_head; earlier != item; earlier = earlier->next)
+        {
+            if (item->exclusive || earlier->exclusive || (item->ohfi != 0 && earlier->ohfi == item->ohfi))
+            {
+                break;
+            }
+        }
+
+        if (earlier == item)
+        {
+            return item;
+        }
+
+        if (item->exclusive)
+        {
+            return NULL; // nothing after it may pass it
+        }
+    }
+
+    return NULL;
+}
+
+// call with the queue locked
+static int eventsRunning(void)
+{
+    struct event_queue_item *item;
+
+    for (item = g_event_queue_head; item != NULL; item = item->next)
+    {
+        if (item->running)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void removeEvent(struct event_queue_item *item)
+{
+    struct event_queue_item **p_item;
+    struct event_queue_item *prev = NULL;
+
+    for (p_item = &g_event_queue_head; *p_item != item; p_item = &(*p_item)->next)
+    {
+        prev = *p_item;
+    }
+
+    *p_item = item->next;
+
+    if (g_event_queue_tail == item)
+    {
+        g_event_queue_tail = prev;
+    }
+}
+
+static void *vitaEventWorker(void *args)
+{
+    vita_device_t *device = (vita_device_t *)args;
+    struct event_queue_item *item;
+
+    pthread_mutex_lock(&g_event_queue_lock);
+
+    while (1)
+    {
+        while (g_connected && (item = nextRunnableEvent()) == NULL)
+        {
+            pthread_cond_wait(&g_event_queue_cond, &g_event_queue_lock);
+        }
+
+        if (!g_connected)
+        {
+            break;
+        }
+
+        item->running = 1;
+        pthread_mutex_unlock(&g_event_queue_lock);
+
+        // sizes of received parts are added to their folders once all of them are in,
+        // a cancel is run by the listener and does not end the parts
+        if (item->event.Code != PTP_EC_VITA_RequestGetPartOfObject)
+        {
+            flushObjectSizes();
+        }
+
+        processEvent(device, &item->event);
+        pthread_mutex_lock(&g_event_queue_lock);
+        removeEvent(item);
+        free(item);
+        // whatever was waiting on this event may be able to start now
+        pthread_cond_broadcast(&g_event_queue_cond);
+
+        // measuring starts from scratch, so nothing may be halfway through a transfer
+        if (g_calibrate_request && !eventsRunning())
+        {
+            g_calibrate_request = 0;
+            startCalibration(device); // no event can start while the queue is locked
+        }
+
+        pthread_mutex_unlock(&g_event_queue_lock);
+        saveTransferProfile(device);
+        pthread_mutex_lock(&g_event_queue_lock);
+    }
+
+    pthread_mutex_unlock(&g_event_queue_lock);
+    return NULL;
+}
+
+static int startEventWorkers(vita_device_t *device)
+{
+    for (g_event_worker_count = 0; g_event_worker_count < OPENCMA_EVENT_WORKERS; g_event_worker_count++)
+    {
+        if (pthread_create(&g_event_workers[g_event_worker_count], NULL, vitaEventWorker, device) != 0)
+        {
+            LOG(LERROR, "Cannot create event worker thread.\n");
+            break; // make do with the ones we have
+        }
+    }
+
+    return g_event_worker_count > 0 ? 0 : -1;
+}
+
+// waits for the events being run to finish, the ones still queued are dropped
+static void stopEventWorkers(void)
+{
+    int i;
+
+    pthread_mutex_lock(&g_event_queue_lock);
+    g_connected = 0;
+    pthread_cond_broadcast(&g_event_queue_cond);
+    pthread_mutex_unlock(&g_event_queue_lock);
+
+    for (i = 0; i < g_event_worker_count; i++)
+    {
+        pthread_join(g_event_workers[i], NULL);
+    }
+
+    g_event_worker_count = 0;
+}
+
+// reads events and queues them for the workers so that
+// a cancel is seen while the event it cancels is still running
 static void *vitaEventListener(void* args)
 {
     vita_device_t *device = (vita_device_t *)args;
     vita_event_t event;
-    int slot;
+    struct event_queue_item *item;
 
     while (g_connected)
     {
         if (VitaMTP_Read_Event(device, &event) < 0)
         {
             LOG(LERROR, "Error reading event from Vita.\n");
+            pthread_mutex_lock(&g_event_queue_lock);
             g_connected = 0;
+            pthread_cond_broadcast(&g_event_queue_cond);
+            pthread_mutex_unlock(&g_event_queue_lock);
             continue;
         }
 
-        slot = event.Code - PTP_EC_VITA_RequestSendNumOfObject;
+        if (event.Code == PTP_EC_VITA_RequestCancelTask)
+        {
+            processEvent(device, &event);
+            continue;
+        }
 
-        if (slot < 0 || slot > sizeof(g_event_processes)/sizeof(void *))
+        if ((item = malloc(sizeof(struct event_queue_item))) == NULL)
         {
-            slot = sizeof(g_event_processes)/sizeof(void *) - 1;  // last item is pointer to "unimplemented
+            LOG(LERROR, "Out of memory, dropping event 0x%04X.\n", event.Code);
+            continue;
         }
 
-        LOG(LDEBUG, "Event 0x%04X recieved, slot %d with function address %p\n", event.Code, slot, g_event_processes[slot]);
-        g_event_processes[slot](device, &event, event.Param1);
+        item->event = event;
+        item->running = 0;
+        item->next = NULL;
+        classifyEvent(item);
+        pthread_mutex_lock(&g_event_queue_lock);
+
+        if (g_event_queue_tail)
+        {
+            g_event_queue_tail->next = item;
+        }
+        else
+        {
+            g_event_queue_head = item;
+        }
+
+        g_event_queue_tail = item;
+        pthread_cond_broadcast(&g_event_queue_cond);
+        pthread_mutex_unlock(&g_event_queue_lock);
     }
 
     return NULL;
@@ -1123,21 +1849,6 @@ static vita_device_t *connect_usb()
     return device;
 }
 
-static void *broadcast_server(void *args)
-{
-    LOG(LDEBUG, "Starting CMA wireless broadcast...\n");
-    wireless_host_info_t *info = (wireless_host_info_t *)args;
-
-    if (VitaMTP_Broadcast_Host(info, 0) < 0)
-    {
-        LOG(LERROR, "An error occured during broadcast. Exiting.\n");
-        exit(1);
-    }
-
-    LOG(LDEBUG, "Broadcast ended.\n");
-    return NULL;
-}
-
 static int device_registered(const char *deviceid)
 {
     LOG(LDEBUG, "Got connection request from %s\n", deviceid);
@@ -1152,35 +1863,29 @@ static int generate_pin(wireless_vita_info_t *info, int *p_err)
     return pin;
 }
 
+static vita_device_t *g_wireless_device;
+
+static int device_connected(vita_device_t *device)
+{
+    g_wireless_device = device;
+    return 1; // we only serve one Vita at a time
+}
+
 static vita_device_t *connect_wireless()
 {
-    vita_device_t *device;
     wireless_host_info_t info = {"00000000-0000-0000-0000-000000000000", "win", OPENCMA_VERSION_STRING, OPENCMA_REQUEST_PORT};
-    pthread_t broadcast_thread;
 
-    if (pthread_create(&broadcast_thread, NULL, broadcast_server, &info) < 0)
-    {
-        LOG(LERROR, "Cannot create broadcast thread\n");
-        return NULL;
-    }
+    // the broadcast and the connection are served from this thread
+    LOG(LDEBUG, "Starting CMA wireless broadcast...\n");
+    g_wireless_device = NULL;
 
-    for (int i = 1; i <= OPENCMA_CONNECTION_TRIES; i++)
+    if (VitaMTP_Serve_Wireless(&info, 0, 0, device_registered, generate_pin, device_connected) < 0)
     {
-        if ((device = VitaMTP_Get_First_Wireless_Vita(&info, 0, 0, device_registered, generate_pin)) != NULL)
-        {
-            break;
-        }
-        LOG(LINFO, "Error connecting to device. Attempt %d of %d.\n", i, OPENCMA_CONNECTION_TRIES);
+        LOG(LERROR, "An error occured during broadcast.\n");
     }
 
-    VitaMTP_Stop_Broadcast();
-    LOG(LDEBUG, "Waiting for broadcast thread to complete and exit.\n");
-    if (pthread_join(broadcast_thread, NULL) < 0)
-    {
-        LOG(LERROR, "Error joining broadcast thread.\n");
-        return NULL;
-    }
-    return device;
+    LOG(LDEBUG, "Broadcast ended.\n");
+    return g_wireless_device;
 }
 
 static void *handle_commands(void *args)
@@ -1220,6 +1925,20 @@ static void *handle_commands(void *args)
             sem_post(g_refresh_database_request);
             // TODO: For some reason SIGTSTP automatically unlocks the semp.
         }
+        else if (strcmp("calibrate", cmd) == 0)
+        {
+            if (!g_connected)
+            {
+                LOG(LINFO, "No active connection, ignoring request to calibrate.\n");
+                continue;
+            }
+
+            LOG(LINFO, "Transfer speeds will be measured over the next large transfers.\n");
+            // picked up by an event worker once no event is running
+            pthread_mutex_lock(&g_event_queue_lock);
+            g_calibrate_request = 1;
+            pthread_mutex_unlock(&g_event_queue_lock);
+        }
         else
         {
             LOG(LERROR, "Unknown command: %s\n", cmd);
@@ -1235,6 +1954,7 @@ int main(int argc, char **argv)
     srand((unsigned int)time(NULL));
     /* Parse the command line arguments */
     int wireless = 0;
+    int use_store = 0;
 
     // Start with some default values
     g_uuid = strdup("ffffffffffffffff");
@@ -1272,7 +1992,7 @@ int main(int argc, char **argv)
     int c;
     opterr = 0;
 
-    while ((c = getopt(argc, argv, "u:p:v:m:a:k:l:hd")) != -1)
+    while ((c = getopt(argc, argv, "u:p:v:m:a:k:t:l:shd")) != -1)
     {
         switch (c)
         {
@@ -1302,6 +2022,14 @@ int main(int argc, char **argv)
             break;
 #endif
 
+        case 't': // transfer profiles
+            g_profiles_path = optarg;
+            break;
+
+        case 's': // deduplicating store
+            use_store = 1;
+            break;
+
         case 'l': // logging
             g_log_level = atoi(optarg);
 
@@ -1353,6 +2081,13 @@ int main(int argc, char **argv)
         LOG(LINFO, "Cannot find path: %s, will attempt to create when needed\n", g_paths.appsPath);
     }
 
+    if (use_store && initStore(g_paths.appsPath) < 0)
+    {
+        return 1;
+    }
+
+    emptyTrash();
+
     // Show information string
     fprintf(stderr, "%s\nlibVitaMTP Version: %d.%d\nProtocol Max Version: %08d\n",
             OPENCMA_VERSION_STRING, VITAMTP_VERSION_MAJOR, VITAMTP_VERSION_MINOR, VITAMTP_PROTOCOL_MAX_VERSION);
@@ -1398,6 +2133,9 @@ int main(int argc, char **argv)
 
     LOG(LINFO, "Vita connected: id %s\nType in 'help' for list of commands.\n", VitaMTP_Get_Identification(device));
 
+    // Use the block size measured on an earlier connection
+    loadTransferProfile(device);
+
     // Here we will do Vita specific initialization
     vita_info_t vita_info;
     // This will automatically fill pc_info with default information
@@ -1464,6 +2202,11 @@ int main(int argc, char **argv)
     // behavior while OpenCMA is running.
     pthread_t command_thread;
     g_connected = 1;
+
+    if (startEventWorkers(device) < 0)
+    {
+        return 1;
+    }
     
     if (pthread_create(&event_thread, NULL, vitaEventListener, device) != 0)
     {
@@ -1513,18 +2256,21 @@ int main(int argc, char **argv)
             ,g_paths.packagesPath
 #endif
             );
-        destroyDatabase();
-        createDatabase(&g_paths, g_uuid);
+        finishFileWrites();
+        refreshDatabase(&g_paths, g_uuid);
         LOG(LINFO, "Database refreshed.\n");
         LOCK_SEMAPHORE(g_refresh_database_request);  // in case multiple requests were made
     }
 
     LOG(LINFO, "Shutting down...\n");
+    stopEventWorkers();
 
     // End this connection with the Vita
     VitaMTP_SendHostStatus(device, VITA_HOST_STATUS_EndConnection);
 
     // Clean up our mess
+    keepPartFile(NULL, -1);
+    finishFileWrites();
     VitaMTP_Release_Device(device);
     destroyDatabase();
 #ifdef __APPLE__
@@ -29,8 +29,13 @@ struct FTW;
 #define OPENCMA_VERSION_STRING "OpenCMA 2.1 Beta"
 #define OPENCMA_REQUEST_PORT   9309
 #define OPENCMA_CONNECTION_TRIES    10
+#define OPENCMA_EVENT_WORKERS       4
 // Our object ids will start at 1000 to prevent conflict with the master ohfi
 #define OHFI_OFFSET 1000
+// how much of the next file to read while the current one is sent
+#define PREFETCH_SIZE 0x400000
+// kept in the apps path, see loadDirectorySizes()
+#define DIRECTORY_SIZES_FILE ".sizes"
 
 #define LDEBUG       VitaMTP_DEBUG
 #define LVERBOSE     VitaMTP_VERBOSE
@@ -49,6 +54,10 @@ struct cma_object
     char *path; // path of the object
     int num_filters;
     metadata_t *filters;
+    uint64_t head_hash; // hash of the first head_length bytes of a file
+    unsigned int head_length; // 0 until they are hashed
+    size_t pending_size; // not added to the parent folders yet
+    int collapsed; // a folder whose contents are not in the database yet
 };
 
 struct cma_database
@@ -97,7 +106,8 @@ void vitaEventOperateObject(vita_device_t *device, vita_event_t *event, int even
 void vitaEventGetPartOfObject(vita_device_t *device, vita_event_t *event, int eventId);
 void vitaEventSendStorageSize(vita_device_t *device, vita_event_t *event, int eventId);
 void vitaEventCheckExistance(vita_device_t *device, vita_event_t *event, int eventId);
-uint16_t vitaGetAllObjects(vita_device_t *device, int eventId, struct cma_object *parent, uint32_t handle);
+uint16_t vitaGetAllObjects(vita_device_t *device, int eventId, int ohfiParent, const char *parentPath, const char *dir,
+                           uint32_t handle);
 void vitaEventGetTreatObject(vita_device_t *device, vita_event_t *event, int eventId);
 void vitaEventSendCopyConfirmationInfo(vita_device_t *device, vita_event_t *event, int eventId);
 void vitaEventSendObjectMetadataItems(vita_device_t *device, vita_event_t *event, int eventId);
@@ -108,30 +118,65 @@ void vitaEventUnimplementated(vita_device_t *device, vita_event_t *event, int ev
 /* Database functions */
 void createDatabase(struct cma_paths *paths, const char *uuid);
 void destroyDatabase(void);
+void refreshDatabase(struct cma_paths *paths, const char *uuid);
 void lockDatabase(void);
 void unlockDatabase(void);
 struct cma_object *addToDatabase(struct cma_object *root, const char *name, size_t size, const enum DataType type);
 void createFilter(struct cma_object *dirobject, metadata_t *output, const char *name, int type);
 void removeFromDatabase(int ohfi, struct cma_object *start);
-void renameRootEntry(struct cma_object *object, const char *name, const char *newname);
+void renameRootEntry(struct cma_object *object, const char *newname);
 struct cma_object *ohfiToObject(int ohfi);
+struct cma_object *findObject(int ohfi, const char *path);
+void expandObject(struct cma_object *object);
 struct cma_object *pathToObject(char *path, int ohfiParent);
+void addObjectSize(struct cma_object *object, size_t size);
+void flushObjectSizes(void);
+int findSameObject(char *name, uint64_t size, const unsigned char *head, unsigned int head_length);
 int filterObjects(int ohfiParent, metadata_t **p_head);
+void copyMetadata(metadata_t *dest, const metadata_t *src);
+void freeMetadata(metadata_t *meta);
+metadata_t *copyMetadataList(const metadata_t *head);
+void freeMetadataList(metadata_t *head);
 
 /* Utility functions */
 int createNewDirectory(const char *path);
 int createNewFile(const char *name);
 int readFileToBuffer(const char *name, size_t seek, unsigned char **p_data, unsigned int *p_len);
-int writeFileFromBuffer(const char *name, size_t seek, unsigned char *data, size_t len);
+int queueFileWrite(int ohfi, const char *path, uint64_t offset, unsigned char *buffer, const unsigned char *data,
+                   size_t len);
+void finishFileWrites(void);
+int takeFileWriteError(int ohfi);
+void trashEntry(const char *path);
+void emptyTrash(void);
 int deleteEntry(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftw);
 void deleteAll(const char *path);
+int replaceEntry(const char *src, const char *dest);
+char *createIncomingEntry(const char *path, int folder, int *p_fd);
 int move(const char *src, const char *dest);
 int fileExists(const char *path);
+void prefetchFile(const char *path, size_t len);
 int getDiskSpace(const char *path, uint64_t *free, uint64_t *total);
-void addEntriesForDirectory(struct cma_object *current, int parent_ohfi);
-int requestURL(const char *url, unsigned char **p_data, unsigned int *p_len);
-char *strreplace(const char *haystack, const char *find, const char *replace);
+void loadDirectorySizes(const char *file);
+void saveDirectorySizes(const char *file);
+void addEntriesForDirectory(struct cma_object *current, int parent_ohfi, int summarize);
+char *urlToPath(const char *url);
+int openURL(const char *url, uint64_t *p_size);
+int statURL(const char *url, uint64_t *p_size);
+int readTransferProfile(const char *path, const char *id, vita_transfer_profile_t *profile);
+int writeTransferProfile(const char *path, const char *id, const vita_transfer_profile_t *profile);
 capability_info_t *generate_pc_capability_info(void);
 void free_pc_capability_info(capability_info_t *info);
 
+/* Store functions */
+struct store_stream;
+int initStore(const char *root);
+struct store_stream *storeBegin(const char *path);
+void storeData(struct store_stream *stream, uint64_t offset, const unsigned char *data, size_t len);
+void storeDiscard(struct store_stream *stream);
+void storeFile(struct store_stream *stream, int fd, const char *path);
+void storeHold(void);
+void storeRelease(void);
+int unshareFile(const char *path);
+uint64_t hashData(const unsigned char *data, size_t len);
+
 #endif
@@ -96,6 +96,43 @@ dtoh64ap (PTPParams *params, const unsigned char *a)
 #define dtoh64(x)	dtoh64p(params,x)
 
 
+/*
+ * Nearly all names the Vita sends or gets are plain ASCII, which maps
+ * 1:1 between UCS-2 and UTF-8. Convert those directly and only hand
+ * strings with other characters to iconv(3).
+ */
+static inline int
+ptp_unpack_string_ascii(PTPParams *params, const unsigned char* ucs2, uint8_t length, char *out)
+{
+	uint16_t bits = 0;
+	int i;
+
+	/* check first so the loop below has no early exit */
+	for (i=0;i<length;i++)
+		bits |= dtoh16a(&ucs2[2*i]);
+	if (bits & 0xff80)
+		return -1;
+	for (i=0;i<length;i++)
+		out[i] = (char)dtoh16a(&ucs2[2*i]);
+	out[length] = '\0';
+	return 0;
+}
+
+static inline int
+ptp_pack_string_ascii(PTPParams *params, const char *string, size_t convlen, unsigned char* ucs2)
+{
+	unsigned char bits = 0;
+	int i;
+
+	for (i=0;i<convlen;i++)
+		bits |= (unsigned char)string[i];
+	if (bits & 0x80)
+		return -1;
+	for (i=0;i<convlen;i++)
+		htod16a(&ucs2[2*i], (unsigned char)string[i]);
+	return 0;
+}
+
 static inline char*
 ptp_unpack_string(PTPParams *params, unsigned char* data, uint16_t offset, uint8_t *len)
 {
@@ -111,6 +148,9 @@ ptp_unpack_string(PTPParams *params, unsigned char* data, uint16_t offset, uint8
 	if (length == 0)		/* nothing to do? */
 		return(NULL);
 
+	if (ptp_unpack_string_ascii(params, &data[offset+1], length, loclstr) == 0)
+		return(strdup(loclstr));
+
 	/* copy to string[] to ensure correct alignment for iconv(3) */
 	memcpy(string, &data[offset+1], length * sizeof(string[0]));
 	string[length] = 0x0000U;   /* be paranoid!  add a terminator. */
@@ -162,6 +202,14 @@ ptp_pack_string(PTPParams *params, char *string, unsigned char* data, uint16_t o
 	size_t convlen = strlen(string);
 
 	/* Cannot exceed 255 (PTP_MAXSTRLEN) since it is a single byte, duh ... */
+	if (convlen <= PTP_MAXSTRLEN-1 &&
+	    ptp_pack_string_ascii(params, string, convlen, &data[offset+1]) == 0) {
+		/* number of characters including terminating 0 */
+		htod8a(&data[offset],convlen+1);
+		htod16a(&data[offset+convlen*2+1], 0x0000);
+		*len = (uint8_t) convlen+1;
+		return;
+	}
 	memset(ucs2strp, 0, sizeof(ucs2str));  /* XXX: necessary? */
 	/*ptp_debug (params ,"pack_string of %s", string);*/
 #ifdef HAVE_ICONV
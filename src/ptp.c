@@ -33,6 +33,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #ifdef ENABLE_NLS
 #  include <libintl.h>
@@ -129,7 +130,7 @@ ptp_error (PTPParams *params, const char *format, ...)
  * all fields filled in.
  **/
 static uint16_t
-ptp_transaction_new (PTPParams* params, PTPContainer* ptp, 
+ptp_transaction_run (PTPParams* params, PTPContainer* ptp, 
 		uint16_t flags, unsigned int sendlen,
 		PTPDataHandler *handler
 ) {
@@ -151,7 +152,7 @@ ptp_transaction_new (PTPParams* params, PTPContainer* ptp,
 			uint16_t ret;
 			ret = params->senddata_func(params, ptp,
 						    sendlen, handler);
-			if (ret == PTP_ERROR_CANCEL) {
+			if (ret == PTP_ERROR_CANCEL && params->cancelreq_func) {
 				ret = params->cancelreq_func(params, 
 							     params->transaction_id-1);
 				if (ret == PTP_RC_OK)
@@ -165,7 +166,7 @@ ptp_transaction_new (PTPParams* params, PTPContainer* ptp,
 		{
 			uint16_t ret;
 			ret = params->getdata_func(params, ptp, handler);
-			if (ret == PTP_ERROR_CANCEL) {
+			if (ret == PTP_ERROR_CANCEL && params->cancelreq_func) {
 				ret = params->cancelreq_func(params, 
 							     params->transaction_id-1);
 				if (ret == PTP_RC_OK)
@@ -216,6 +217,233 @@ ptp_transaction_new (PTPParams* params, PTPContainer* ptp,
 	return ptp->Code;
 }
 
+/*
+ * Transaction scheduler
+ *
+ * Only one transaction can be on the wire at a time, so callers from
+ * different threads take a ticket in their priority class and wait for
+ * their turn. When the wire becomes free the oldest ticket of the most
+ * urgent class with waiters goes next, so a short control transaction
+ * runs right after the current bulk transaction instead of behind all
+ * queued bulk transfers.
+ */
+struct _PTPScheduler {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	int		busy;			/* a transaction is on the wire */
+	pthread_t	owner;			/* thread running it */
+	unsigned long	next[PTP_TP_NUM];	/* next ticket to hand out */
+	unsigned long	serving[PTP_TP_NUM];	/* next ticket allowed to run */
+};
+
+uint16_t
+ptp_scheduler_init (PTPParams *params) {
+	PTPScheduler	*sched;
+
+	sched = calloc (1, sizeof(PTPScheduler));
+	if (!sched) return PTP_RC_GeneralError;
+	if (pthread_mutex_init (&sched->lock, NULL) != 0) {
+		free (sched);
+		return PTP_RC_GeneralError;
+	}
+	if (pthread_cond_init (&sched->cond, NULL) != 0) {
+		pthread_mutex_destroy (&sched->lock);
+		free (sched);
+		return PTP_RC_GeneralError;
+	}
+	params->scheduler = sched;
+	return PTP_RC_OK;
+}
+
+void
+ptp_scheduler_free (PTPParams *params) {
+	PTPScheduler	*sched = params->scheduler;
+
+	if (!sched) return;
+	pthread_cond_destroy (&sched->cond);
+	pthread_mutex_destroy (&sched->lock);
+	free (sched);
+	params->scheduler = NULL;
+}
+
+static int
+ptp_transaction_priority (PTPParams *params, uint16_t code, uint16_t flags) {
+	int	prio;
+
+	if (params->priority_func) {
+		prio = params->priority_func (params, code, flags);
+		if (prio >= 0 && prio < PTP_TP_NUM)
+			return prio;
+	}
+	return ((flags & PTP_DP_DATA_MASK) == PTP_DP_NODATA) ? PTP_TP_CONTROL : PTP_TP_BULK;
+}
+
+static unsigned long
+ptp_scheduler_ticket (PTPScheduler *sched, int prio) {
+	unsigned long	ticket;
+
+	pthread_mutex_lock (&sched->lock);
+	ticket = sched->next[prio]++;
+	pthread_mutex_unlock (&sched->lock);
+	return ticket;
+}
+
+/* only the owner clears busy, so the answer can't change under it */
+static int
+ptp_scheduler_owned (PTPScheduler *sched) {
+	int	owned;
+
+	pthread_mutex_lock (&sched->lock);
+	owned = sched->busy && pthread_equal (sched->owner, pthread_self ());
+	pthread_mutex_unlock (&sched->lock);
+	return owned;
+}
+
+static void
+ptp_scheduler_acquire (PTPScheduler *sched, int prio, unsigned long ticket) {
+	int	i, wait;
+
+	pthread_mutex_lock (&sched->lock);
+	while (1) {
+		wait = sched->busy || sched->serving[prio] != ticket;
+		for (i=0;!wait && i<prio;i++)
+			wait = sched->next[i] != sched->serving[i];
+		if (!wait)
+			break;
+		pthread_cond_wait (&sched->cond, &sched->lock);
+	}
+	sched->serving[prio]++;
+	sched->busy = 1;
+	sched->owner = pthread_self ();
+	pthread_mutex_unlock (&sched->lock);
+}
+
+static void
+ptp_scheduler_release (PTPScheduler *sched) {
+	pthread_mutex_lock (&sched->lock);
+	sched->busy = 0;
+	pthread_cond_broadcast (&sched->cond);
+	pthread_mutex_unlock (&sched->lock);
+}
+
+static uint16_t
+ptp_transaction_ticket (PTPParams* params, PTPContainer* ptp, 
+		uint16_t flags, unsigned int sendlen,
+		PTPDataHandler *handler, int prio, unsigned long ticket
+) {
+	uint16_t	ret;
+
+	ptp_scheduler_acquire (params->scheduler, prio, ticket);
+	ret = ptp_transaction_run (params, ptp, flags, sendlen, handler);
+	ptp_scheduler_release (params->scheduler);
+	return ret;
+}
+
+/**
+ * ptp_transaction_new:
+ *
+ * Performs a PTP transaction with data coming from or going to a
+ * PTPDataHandler. Safe to call from several threads once
+ * ptp_scheduler_init() has been called, see above for the ordering.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_transaction_new (PTPParams* params, PTPContainer* ptp, 
+		uint16_t flags, unsigned int sendlen,
+		PTPDataHandler *handler
+) {
+	int	prio;
+
+	if ((params==NULL) || (ptp==NULL)) 
+		return PTP_ERROR_BADPARAM;
+	/* data handlers may run transactions of their own */
+	if (!params->scheduler || ptp_scheduler_owned (params->scheduler))
+		return ptp_transaction_run (params, ptp, flags, sendlen, handler);
+	prio = ptp_transaction_priority (params, ptp->Code, flags);
+	return ptp_transaction_ticket (params, ptp, flags, sendlen, handler, prio,
+				       ptp_scheduler_ticket (params->scheduler, prio));
+}
+
+/* asynchronous transactions, each runs on its own thread once its turn comes */
+typedef struct {
+	PTPParams		*params;
+	PTPContainer		ptp;
+	uint16_t		flags;
+	unsigned int		sendlen;
+	PTPDataHandler		*handler;
+	int			prio;
+	unsigned long		ticket;
+	PTPTransactionDone	done;
+	void			*priv;
+} PTPAsyncTransaction;
+
+static void *
+ptp_transaction_thread (void *arg) {
+	PTPAsyncTransaction	*async = arg;
+	uint16_t		ret;
+
+	ret = ptp_transaction_ticket (async->params, &async->ptp, async->flags,
+				      async->sendlen, async->handler, async->prio, async->ticket);
+	if (async->done)
+		async->done (async->params, &async->ptp, ret, async->priv);
+	free (async);
+	return NULL;
+}
+
+/**
+ * ptp_transaction_submit:
+ * params:	PTPParams*
+ * 		PTPContainer* ptp	- request, copied
+ * 		uint16_t flags		- data phase description
+ * 		unsigned int sendlen	- senddata phase data length
+ * 		PTPDataHandler* handler	- data phase handler, must stay valid
+ * 		PTPTransactionDone done	- called with the response when finished
+ * 		void* priv		- passed to done
+ *
+ * Queues a transaction and returns at once. Transactions submitted from
+ * the same thread in the same priority class run in submission order.
+ * Needs ptp_scheduler_init().
+ *
+ * Return values: PTP_RC_OK if the transaction was queued.
+ **/
+uint16_t
+ptp_transaction_submit (PTPParams* params, PTPContainer* ptp,
+		uint16_t flags, unsigned int sendlen, PTPDataHandler *handler,
+		PTPTransactionDone done, void *priv
+) {
+	PTPAsyncTransaction	*async;
+	pthread_attr_t		attr;
+	pthread_t		thread;
+	int			err;
+
+	if ((params==NULL) || (ptp==NULL) || !params->scheduler)
+		return PTP_ERROR_BADPARAM;
+	async = calloc (1, sizeof(PTPAsyncTransaction));
+	if (!async) return PTP_RC_GeneralError;
+	async->params	= params;
+	async->ptp	= *ptp;
+	async->flags	= flags;
+	async->sendlen	= sendlen;
+	async->handler	= handler;
+	async->prio	= ptp_transaction_priority (params, ptp->Code, flags);
+	async->done	= done;
+	async->priv	= priv;
+	/* take the ticket now so the order is the order of submission */
+	async->ticket	= ptp_scheduler_ticket (params->scheduler, async->prio);
+
+	pthread_attr_init (&attr);
+	pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+	err = pthread_create (&thread, &attr, ptp_transaction_thread, async);
+	pthread_attr_destroy (&attr);
+	if (err != 0) {
+		/* the ticket is taken and others may wait for it, so run it here */
+		ptp_debug (params, "PTP: cannot start transaction thread, running it synchronously");
+		ptp_transaction_thread (async);
+	}
+	return PTP_RC_OK;
+}
+
 /* memory data get/put handler */
 typedef struct {
 	unsigned char	*data;
@@ -265,6 +493,7 @@ ptp_init_recv_memory_handler(PTPDataHandler *handler) {
 	if (!priv)
 		return PTP_RC_GeneralError;
 	handler->priv = priv;
+	handler->file = NULL;
 	handler->getfunc = memory_getfunc;
 	handler->putfunc = memory_putfunc;
 	priv->data = NULL;
@@ -285,6 +514,7 @@ ptp_init_send_memory_handler(PTPDataHandler *handler,
 	if (!priv)
 		return PTP_RC_GeneralError;
 	handler->priv = priv;
+	handler->file = NULL;
 	handler->getfunc = memory_getfunc;
 	handler->putfunc = memory_putfunc;
 	priv->data = data;
@@ -325,13 +555,19 @@ fd_getfunc(PTPParams* params, void* private,
 	       unsigned long *gotlen
 ) {
 	PTPFDHandlerPrivate* priv = (PTPFDHandlerPrivate*)private;
+	unsigned long	curread = 0;
 	int		got;
 
-	got = read (priv->fd, data, wantlen);
-	if (got != -1)
-		*gotlen = got;
-	else
-		return PTP_RC_GeneralError;
+	/* callers expect the full wantlen unless the object is truncated */
+	while (curread < wantlen) {
+		got = read (priv->fd, data + curread, wantlen - curread);
+		if (got == -1)
+			return PTP_RC_GeneralError;
+		if (got == 0)
+			break;
+		curread += got;
+	}
+	*gotlen = curread;
 	return PTP_RC_OK;
 }
 
@@ -341,13 +577,17 @@ fd_putfunc(PTPParams* params, void* private,
 	       unsigned long *putlen
 ) {
 	int		written;
+	unsigned long	curwrite = 0;
 	PTPFDHandlerPrivate* priv = (PTPFDHandlerPrivate*)private;
 
-	written = write (priv->fd, data, sendlen);
-	if (written != -1)
-		*putlen = written;
-	else
-		return PTP_RC_GeneralError;
+	/* the transports do not retry short writes, so finish them here */
+	while (curwrite < sendlen) {
+		written = write (priv->fd, data + curwrite, sendlen - curwrite);
+		if (written == -1)
+			return PTP_RC_GeneralError;
+		curwrite += written;
+	}
+	*putlen = curwrite;
 	return PTP_RC_OK;
 }
 
@@ -358,6 +598,7 @@ ptp_init_fd_handler(PTPDataHandler *handler, int fd) {
 	if (!priv)
 		return PTP_RC_GeneralError;
 	handler->priv = priv;
+	handler->file = NULL;
 	handler->getfunc = fd_getfunc;
 	handler->putfunc = fd_putfunc;
 	priv->fd = fd;
@@ -371,6 +612,60 @@ ptp_exit_fd_handler (PTPDataHandler *handler) {
 	return PTP_RC_OK;
 }
 
+/* file data get handler, for transports that cannot send from a file */
+static uint16_t
+file_getfunc(PTPParams* params, void* private,
+	       unsigned long wantlen, unsigned char *data,
+	       unsigned long *gotlen
+) {
+	PTPDataFile	*file = (PTPDataFile*)private;
+	unsigned long	curread = 0;
+	ssize_t		got;
+	uint16_t	ret;
+
+	if (file->prefixlen) {
+		curread = wantlen < file->prefixlen ? wantlen : file->prefixlen;
+		memcpy (data, file->prefix, curread);
+		file->prefix += curread;
+		file->prefixlen -= curread;
+	}
+	while (curread < wantlen) {
+#ifdef _WIN32
+		if (lseek (file->fd, (off_t)file->offset, SEEK_SET) == -1)
+			return PTP_RC_GeneralError;
+		got = read (file->fd, data + curread, wantlen - curread);
+#else
+		got = pread (file->fd, data + curread, wantlen - curread, (off_t)file->offset);
+#endif
+		if (got == -1)
+			return PTP_RC_GeneralError;
+		if (got == 0)
+			break;
+		curread += got;
+		file->offset += got;
+	}
+	*gotlen = curread;
+	if (file->progress && (ret = file->progress (params, file->priv, curread)) != PTP_RC_OK)
+		return ret;
+	return PTP_RC_OK;
+}
+
+/**
+ * ptp_init_file_handler:
+ * handler:	the handler to set up
+ * file:	where the data comes from, owned by the caller
+ *
+ * Sets up handler to send file. Transports that can send straight
+ * from the file use handler->file, the others read it through getfunc.
+ **/
+void
+ptp_init_file_handler (PTPDataHandler *handler, PTPDataFile *file) {
+	handler->getfunc = file_getfunc;
+	handler->putfunc = NULL;
+	handler->priv = file;
+	handler->file = file;
+}
+
 /* Old style transaction, based on memory */
 uint16_t
 ptp_transaction (PTPParams* params, PTPContainer* ptp, 
@@ -552,9 +847,7 @@ ptp_free_params (PTPParams *params) {
 
 	if (params->cameraname) free (params->cameraname);
 	if (params->wifi_profiles) free (params->wifi_profiles);
-	for (i=0;i<params->nrofobjects;i++)
-		ptp_free_object (&params->objects[i]);
-	free (params->objects);
+	ptp_objects_free (params);
 	free (params->events);
 	for (i=0;i<params->nrofcanon_props;i++) {
 		free (params->canon_props[i].data);
@@ -2757,6 +3050,14 @@ ptp_mtp_setobjectreferences (PTPParams* params, uint32_t handle, uint32_t* ohArr
 
 uint16_t
 ptp_mtp_getobjectproplist (PTPParams* params, uint32_t handle, MTPProperties **props, int *nrofprops)
+{
+	/* 0xFFFFFFFFU means - return full tree below the Param1 handle */
+	return ptp_mtp_getobjectproplist_level (params, handle, 0xFFFFFFFFU, props, nrofprops);
+}
+
+/* depth 0 returns only the Param1 handle, 1 its children too, etc. */
+uint16_t
+ptp_mtp_getobjectproplist_level (PTPParams* params, uint32_t handle, uint32_t depth, MTPProperties **props, int *nrofprops)
 {
 	uint16_t ret;
 	PTPContainer ptp;
@@ -2769,7 +3070,7 @@ ptp_mtp_getobjectproplist (PTPParams* params, uint32_t handle, MTPProperties **p
 	ptp.Param2 = 0x00000000U;  /* 0x00000000U should be "all formats" */
 	ptp.Param3 = 0xFFFFFFFFU;  /* 0xFFFFFFFFU should be "all properties" */
 	ptp.Param4 = 0x00000000U;
-	ptp.Param5 = 0xFFFFFFFFU;  /* means - return full tree below the Param1 handle */
+	ptp.Param5 = depth;
 	ptp.Nparam = 5;
 	ret = ptp_transaction(params, &ptp, PTP_DP_GETDATA, 0, &opldata, &oplsize);  
 	if (ret == PTP_RC_OK) *nrofprops = ptp_unpack_OPL(params, opldata, props, oplsize);
@@ -5220,113 +5521,162 @@ ptp_find_object_prop_in_cache(PTPParams *params, uint32_t const handle, uint32_t
 	return NULL;
 }
 
-void
-ptp_remove_object_from_cache(PTPParams *params, uint32_t handle)
-{
-	int i;
-	PTPObject	*ob;
-	uint16_t	ret;
+/* The object cache is a hash table of singly linked chains, keyed by
+ * object handle. Each PTPObject is allocated on its own, so pointers
+ * handed out stay valid until the object is removed, and inserting or
+ * removing is O(1) on average regardless of the number of objects. */
+#define PTP_OBJECT_MIN_BUCKETS	64
 
-	ret = ptp_object_find (params, handle, &ob);
-	if (ret != PTP_RC_OK)
-		return;
-	i = ob-params->objects;
-	/* remove object from object info cache */
+static unsigned int
+_ob_bucket (uint32_t handle, unsigned int nrofbuckets) {
+	/* handles are mostly sequential, mix the bits before masking */
+	handle ^= handle >> 16;
+	handle *= 0x45d9f3b;
+	handle ^= handle >> 16;
+	return handle & (nrofbuckets - 1);
+}
+
+static uint16_t
+_ob_rehash (PTPParams *params, unsigned int nrofbuckets) {
+	PTPObject	**buckets;
+	PTPObject	*ob, *next;
+	unsigned int	i, b;
+
+	buckets = calloc (nrofbuckets, sizeof(PTPObject*));
+	if (!buckets) return PTP_RC_GeneralError;
+	for (i=0;i<params->nrofobjectbuckets;i++) {
+		for (ob = params->objects[i]; ob; ob = next) {
+			next = ob->next;
+			b = _ob_bucket (ob->oid, nrofbuckets);
+			ob->next = buckets[b];
+			buckets[b] = ob;
+		}
+	}
+	free (params->objects);
+	params->objects = buckets;
+	params->nrofobjectbuckets = nrofbuckets;
+	params->objectstats.rehashes++;
+	return PTP_RC_OK;
+}
+
+static void
+_ob_destroy (PTPObject *ob) {
 	ptp_free_object (ob);
+	free (ob->mtpprops);
+	free (ob->children);
+	free (ob);
+}
 
-	if (i < params->nrofobjects-1)
-		memmove (ob,ob+1,(params->nrofobjects-1-i)*sizeof(PTPObject));
-	params->nrofobjects--;
-	/* We use less memory than before so this shouldn't fail */
-	params->objects = realloc(params->objects, sizeof(PTPObject)*params->nrofobjects);
+void
+ptp_objects_free (PTPParams *params) {
+	PTPObject	*ob, *next;
+	unsigned int	i;
+
+	for (i=0;i<params->nrofobjectbuckets;i++) {
+		for (ob = params->objects[i]; ob; ob = next) {
+			next = ob->next;
+			_ob_destroy (ob);
+		}
+	}
+	free (params->objects);
+	params->objects = NULL;
+	params->nrofobjectbuckets = 0;
+	params->nrofobjects = 0;
 }
 
-static int _cmp_ob (const void *a, const void *b) {
-	PTPObject *oa = (PTPObject*)a;
-	PTPObject *ob = (PTPObject*)b;
+void
+ptp_remove_object_from_cache(PTPParams *params, uint32_t handle)
+{
+	PTPObject	**pob, *ob;
 
-	return oa->oid - ob->oid;
+	if (!params->nrofobjectbuckets)
+		return;
+	pob = &params->objects[_ob_bucket (handle, params->nrofobjectbuckets)];
+	for (ob = *pob; ob; pob = &ob->next, ob = ob->next) {
+		if (ob->oid == handle) {
+			/* remove object from object info cache */
+			*pob = ob->next;
+			_ob_destroy (ob);
+			params->nrofobjects--;
+			params->objectstats.removals++;
+			return;
+		}
+	}
 }
-	
+
+/* Kept for API compatibility, the hash table needs no sorting. */
 void
 ptp_objects_sort (PTPParams *params) {
-	qsort (params->objects, params->nrofobjects, sizeof(PTPObject), _cmp_ob);
 }
 
-/* Binary search in objects. Needs "objects" to be a sorted by objectid list!  */
 uint16_t
 ptp_object_find (PTPParams *params, uint32_t handle, PTPObject **retob) {
-	PTPObject	tmpob;
+	PTPObject	*ob;
 
-	tmpob.oid = handle;
-	*retob = bsearch (&tmpob, params->objects, params->nrofobjects, sizeof(tmpob), _cmp_ob);
-	if (!*retob)
+	*retob = NULL;
+	params->objectstats.lookups++;
+	if (!params->nrofobjectbuckets)
 		return PTP_RC_GeneralError;
-	return PTP_RC_OK;
+	for (ob = params->objects[_ob_bucket (handle, params->nrofobjectbuckets)]; ob; ob = ob->next) {
+		if (ob->oid == handle) {
+			params->objectstats.hits++;
+			*retob = ob;
+			return PTP_RC_OK;
+		}
+	}
+	return PTP_RC_GeneralError;
 }
 
-/* Binary search in objects + insert of not found. Needs "objects" to be a sorted by objectid list!  */
 uint16_t
 ptp_object_find_or_insert (PTPParams *params, uint32_t handle, PTPObject **retob) {
-	int 		begin, end, cursor;
-	int		insertat;
-	PTPObject	*newobs;
+	PTPObject	*ob;
+	unsigned int	b;
 
 	if (!handle) return PTP_RC_GeneralError;
-	*retob = NULL;
-	if (!params->nrofobjects) {
-		params->objects = calloc(1,sizeof(PTPObject));
-		params->nrofobjects = 1;
-		params->objects[0].oid = handle;
-		*retob = &params->objects[0];
-		return PTP_RC_OK;
-	}
-	begin = 0;
-	end = params->nrofobjects-1;
-	/*ptp_debug (params, "searching %08x, total=%d", handle, params->nrofobjects);*/
-	while (1) {
-		cursor = (end-begin)/2+begin;
-		/*ptp_debug (params, "ob %d: %08x [%d-%d]", cursor, params->objects[cursor].oid, begin, end);*/
-		if (params->objects[cursor].oid == handle) {
-			*retob = &params->objects[cursor];
-			return PTP_RC_OK;
-		}
-		if (params->objects[cursor].oid < handle)
-			begin = cursor;
-		else
-			end = cursor;
-		if ((end - begin) <= 1)
-			break;
-	}
-	if (params->objects[begin].oid == handle) {
-		*retob = &params->objects[begin];
+	if (ptp_object_find (params, handle, retob) == PTP_RC_OK)
 		return PTP_RC_OK;
+	/* keep the load factor at most 1 */
+	if ((unsigned int)params->nrofobjects >= params->nrofobjectbuckets) {
+		if (_ob_rehash (params, params->nrofobjectbuckets ? params->nrofobjectbuckets*2 : PTP_OBJECT_MIN_BUCKETS) != PTP_RC_OK)
+			return PTP_RC_GeneralError;
 	}
-	if (params->objects[end].oid == handle) {
-		*retob = &params->objects[end];
-		return PTP_RC_OK;
-	}
-	if ((begin == 0) && (handle < params->objects[0].oid)) {
-		insertat=begin;
-	} else {
-		if ((end == params->nrofobjects-1) && (handle > params->objects[end].oid))
-			insertat=end+1;
-		else
-			insertat=begin+1;
-	}
-	/*ptp_debug (params, "inserting oid %x at [%x,%x], begin=%d, end=%d, insertat=%d\n", handle, params->objects[begin].oid, params->objects[end].oid, begin, end, insertat);*/
-	newobs = realloc (params->objects, sizeof(PTPObject)*(params->nrofobjects+1));
-	if (!newobs) return PTP_RC_GeneralError;
-	params->objects = newobs;
-	if (insertat<=params->nrofobjects)
-		memmove (&params->objects[insertat+1],&params->objects[insertat],(params->nrofobjects-insertat)*sizeof(PTPObject));
-	memset(&params->objects[insertat],0,sizeof(PTPObject));
-	params->objects[insertat].oid = handle;
-	*retob = &params->objects[insertat];
+	ob = calloc (1, sizeof(PTPObject));
+	if (!ob) return PTP_RC_GeneralError;
+	ob->oid = handle;
+	b = _ob_bucket (handle, params->nrofobjectbuckets);
+	ob->next = params->objects[b];
+	params->objects[b] = ob;
 	params->nrofobjects++;
+	params->objectstats.inserts++;
+	*retob = ob;
 	return PTP_RC_OK;
 }
 
+/**
+ * ptp_object_cache_stats:
+ * params:	PTPParams*
+ * stats:	PTPObjectCacheStats* to fill in
+ *
+ * Gets usage statistics of the object cache, for tuning and debugging.
+ **/
+void
+ptp_object_cache_stats (PTPParams *params, PTPObjectCacheStats *stats) {
+	PTPObject	*ob;
+	unsigned int	i, chain;
+
+	*stats = params->objectstats;
+	stats->objects = params->nrofobjects;
+	stats->buckets = params->nrofobjectbuckets;
+	stats->longest_chain = 0;
+	for (i=0;i<params->nrofobjectbuckets;i++) {
+		chain = 0;
+		for (ob = params->objects[i]; ob; ob = ob->next)
+			chain++;
+		if (chain > stats->longest_chain)
+			stats->longest_chain = chain;
+	}
+}
+
 uint16_t
 ptp_object_want (PTPParams *params, uint32_t handle, int want, PTPObject **retob) {
 	uint16_t	ret;
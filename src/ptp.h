@@ -2054,10 +2054,31 @@ typedef uint16_t (* PTPDataGetFunc)	(PTPParams* params, void*priv,
 typedef uint16_t (* PTPDataPutFunc)	(PTPParams* params, void*priv,
 					unsigned long sendlen,
 	                                unsigned char *data, unsigned long *putlen);
+typedef uint16_t (* PTPDataProgressFunc)	(PTPParams* params, void*priv,
+					unsigned long sentlen);
+
+/*
+ * Data to send that comes from a file. Transports that can move file
+ * data to the device without copying it (PTP/IP with sendfile()) take
+ * it from here, the others call getfunc. Both advance prefix, prefixlen
+ * and offset as the data goes out.
+ */
+typedef struct _PTPDataFile {
+	const unsigned char	*prefix;	/* sent before the file data */
+	unsigned long		prefixlen;
+	int			fd;
+	uint64_t		offset;		/* of the next byte to send */
+	/* optional, called as data is sent. Anything but PTP_RC_OK
+	 * aborts the data phase with that result. */
+	PTPDataProgressFunc	progress;
+	void			*priv;
+} PTPDataFile;
+
 typedef struct _PTPDataHandler {
 	PTPDataGetFunc		getfunc;
 	PTPDataPutFunc		putfunc;
 	void			*priv;
+	PTPDataFile		*file;	/* NULL unless sending from a file */
 } PTPDataHandler;
 
 /*
@@ -2073,6 +2094,16 @@ typedef uint16_t (* PTPIOGetData)	(PTPParams* params, PTPContainer* ptp,
 	                                 PTPDataHandler *putter);
 typedef uint16_t (* PTPIOCancelReq)	(PTPParams* params, uint32_t transaction_id);
 
+/* transaction scheduling, lower classes run first */
+#define PTP_TP_URGENT	0	/* results, answers to cancels among them, and keepalive */
+#define PTP_TP_CONTROL	1	/* other short requests */
+#define PTP_TP_BULK	2	/* object data */
+#define PTP_TP_NUM	3
+typedef int (* PTPPriorityFunc)	(PTPParams* params, uint16_t code, uint16_t flags);
+typedef void (* PTPTransactionDone)	(PTPParams* params, PTPContainer* resp,
+					 uint16_t ret, void *priv);
+typedef struct _PTPScheduler PTPScheduler;
+
 /* debug functions */
 typedef void (* PTPErrorFunc) (void *data, const char *format, va_list args)
 #if (__GNUC__ >= 3)
@@ -2099,9 +2130,29 @@ struct _PTPObject {
 	uint32_t	canon_flags;
 	MTPProperties	*mtpprops;
 	int		nrofmtpprops;
+
+	/* child handles, valid with PTPOBJECT_DIRECTORY_LOADED */
+	uint32_t	*children;
+	int		nrofchildren;
+
+	/* next object in the same object cache hash bucket */
+	struct _PTPObject	*next;
 };
 typedef struct _PTPObject PTPObject;
 
+/* Object cache statistics, see ptp_object_cache_stats() */
+struct _PTPObjectCacheStats {
+	unsigned int	objects;	/* objects currently cached */
+	unsigned int	buckets;	/* size of the hash table */
+	unsigned int	longest_chain;	/* longest hash bucket chain */
+	unsigned long	lookups;	/* calls to find/find_or_insert */
+	unsigned long	hits;		/* lookups that found the object */
+	unsigned long	inserts;	/* objects added to the cache */
+	unsigned long	removals;	/* objects removed from the cache */
+	unsigned long	rehashes;	/* times the hash table was grown */
+};
+typedef struct _PTPObjectCacheStats PTPObjectCacheStats;
+
 struct _PTPParams {
 	/* device flags */
 	uint32_t	device_flags;
@@ -2135,8 +2186,12 @@ struct _PTPParams {
 	int		split_header_data;
 
 	/* PTP: internal structures used by ptp driver */
-	PTPObject	*objects;
+	/* object cache, hash table of handle -> PTPObject chains. Objects
+	 * are allocated one by one so their addresses stay stable. */
+	PTPObject	**objects;
+	unsigned int	nrofobjectbuckets;
 	int		nrofobjects;
+	PTPObjectCacheStats	objectstats;
 
 	PTPDeviceInfo	deviceinfo;
 
@@ -2164,6 +2219,8 @@ struct _PTPParams {
 
 	/* IO: PTP/IP related data */
 	int		cmdfd, evtfd;
+	struct ptpip_rxbuf	*cmdrx, *evtrx;	/* see wireless.c */
+	struct ptpip_event_pump	*evtpump;	/* reads events, see wireless.c */
 	uint8_t		cameraguid[16];
 	uint32_t	eventpipeid;
 	char		*cameraname;
@@ -2179,6 +2236,19 @@ struct _PTPParams {
 	 */
 	uint8_t		*response_packet;
 	uint16_t	response_packet_size;
+
+	/* IO: block size used for bulk data phases, see device.c */
+	struct vita_transfer_tuner	*tuner;
+
+	/* IO: orders transactions from several threads, see ptp.c.
+	 * priority_func picks the PTP_TP_* class of a transaction,
+	 * if NULL transactions without data are PTP_TP_CONTROL and
+	 * the rest PTP_TP_BULK. */
+	PTPScheduler	*scheduler;
+	PTPPriorityFunc	priority_func;
+
+	/* IO: events the Vita has cancelled, see device.c */
+	struct vita_cancel_list	*cancelled;
 };
 
 /* last, but not least - ptp functions */
@@ -2206,6 +2276,7 @@ uint16_t ptp_ptpip_getdata	(PTPParams* params, PTPContainer* ptp,
 	                         PTPDataHandler *handler);
 uint16_t ptp_ptpip_event_wait	(PTPParams* params, PTPContainer* event);
 uint16_t ptp_ptpip_event_check	(PTPParams* params, PTPContainer* event);
+uint16_t ptp_ptpip_cancelreq	(PTPParams* params, uint32_t transaction_id);
 
 uint16_t ptp_getdeviceinfo	(PTPParams* params, PTPDeviceInfo* deviceinfo);
 
@@ -2213,6 +2284,13 @@ uint16_t ptp_generic_no_data	(PTPParams* params, uint16_t opcode, unsigned int c
 
 uint16_t ptp_opensession	(PTPParams *params, uint32_t session);
 uint16_t ptp_transaction	(PTPParams* params, PTPContainer* ptp, uint16_t flags, unsigned int sendlen, unsigned char **data, unsigned int *recvlen);
+uint16_t ptp_transaction_new	(PTPParams* params, PTPContainer* ptp, uint16_t flags, unsigned int sendlen,
+				 PTPDataHandler *handler);
+void ptp_init_file_handler	(PTPDataHandler *handler, PTPDataFile *file);
+uint16_t ptp_transaction_submit	(PTPParams* params, PTPContainer* ptp, uint16_t flags, unsigned int sendlen,
+				 PTPDataHandler *handler, PTPTransactionDone done, void *priv);
+uint16_t ptp_scheduler_init	(PTPParams* params);
+void ptp_scheduler_free		(PTPParams* params);
 
 /**
  * ptp_closesession:
@@ -2332,6 +2410,7 @@ uint16_t ptp_mtp_setobjectpropvalue (PTPParams* params, uint32_t oid, uint16_t o
 uint16_t ptp_mtp_getobjectreferences (PTPParams* params, uint32_t handle, uint32_t** ohArray, uint32_t* arraylen);
 uint16_t ptp_mtp_setobjectreferences (PTPParams* params, uint32_t handle, uint32_t* ohArray, uint32_t arraylen);
 uint16_t ptp_mtp_getobjectproplist (PTPParams* params, uint32_t handle, MTPProperties **props, int *nrofprops);
+uint16_t ptp_mtp_getobjectproplist_level (PTPParams* params, uint32_t handle, uint32_t depth, MTPProperties **props, int *nrofprops);
 uint16_t ptp_mtp_sendobjectproplist (PTPParams* params, uint32_t* store, uint32_t* parenthandle, uint32_t* handle,
 				     uint16_t objecttype, uint64_t objectsize, MTPProperties *props, int nrofprops);
 uint16_t ptp_mtp_setobjectproplist (PTPParams* params, MTPProperties *props, int nrofprops);
@@ -2826,8 +2905,10 @@ void ptp_remove_object_from_cache(PTPParams *params, uint32_t handle);
 uint16_t ptp_add_object_to_cache(PTPParams *params, uint32_t handle);
 uint16_t ptp_object_want (PTPParams *, uint32_t handle, int want, PTPObject**retob);
 void ptp_objects_sort (PTPParams *);
+void ptp_objects_free (PTPParams *);
 uint16_t ptp_object_find (PTPParams *params, uint32_t handle, PTPObject **retob);
 uint16_t ptp_object_find_or_insert (PTPParams *params, uint32_t handle, PTPObject **retob);
+void ptp_object_cache_stats (PTPParams *params, PTPObjectCacheStats *stats);
 /* ptpip.c */
 void ptp_nikon_getptpipguid (unsigned char* guid);
 
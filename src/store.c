@@ -0,0 +1,776 @@
+//
+//  Deduplicating store
+//  OpenCMA
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#define _GNU_SOURCE
+#ifndef _WIN32
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "opencma.h"
+
+// Backups and saves are mostly the same from one copy to the next, so when the
+// store is turned on every file received under the apps path is hashed and
+// hard linked to a single copy in a hidden directory, named after its content.
+// Files are hashed as they come in, and linked by a thread of the store's own,
+// so the only time one is read back is to compare it to a copy with the same hash.
+// The files themselves stay where they are, so nothing else has to know about
+// the store, except that a stored file is copied before it is written to.
+// Files nothing links to anymore are removed from the store at startup.
+
+#define STORE_DIRECTORY     ".store"
+#define STORE_MIN_SIZE      0x1000      // smaller files are not worth an inode
+#define STORE_BUFFER_SIZE   0x100000    // must be a multiple of 32
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+extern struct cma_paths g_paths;
+
+static char *g_store_path = NULL;
+static pthread_mutex_t g_store_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// 64 bit hash in the manner of XXH64
+#define PRIME64_1 11400714785074694791ULL
+#define PRIME64_2 14029467366897019727ULL
+#define PRIME64_3 1609587929392839161ULL
+#define PRIME64_4 9650029242287828579ULL
+#define PRIME64_5 2870177450012600261ULL
+
+struct store_hash
+{
+    uint64_t v[4];
+    uint64_t total;
+};
+
+struct store_stream
+{
+    struct store_hash hash;
+    unsigned char tail[32]; // hashed once there are 32 bytes
+    size_t tail_len;
+    int broken; // a piece came out of order
+};
+
+#ifndef _WIN32
+struct store_job
+{
+    char *path;
+    uint64_t hash;
+    uint64_t size;
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    int cancelled; // the file is being written to
+    struct store_job *next;
+};
+#endif
+
+// files waiting to be stored, under g_store_lock
+static struct
+{
+    pthread_cond_t cond;
+    pthread_t thread;
+    int running;
+    int held;
+#ifndef _WIN32
+    struct store_job *head;
+    struct store_job *tail;
+    struct store_job *current;
+#endif
+} g_store_jobs = {PTHREAD_COND_INITIALIZER};
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p)
+{
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+           (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static inline uint32_t read32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t hashRound(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t hashMerge(uint64_t acc, uint64_t val)
+{
+    acc ^= hashRound(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+static void hashInit(struct store_hash *hash)
+{
+    hash->v[0] = PRIME64_1 + PRIME64_2;
+    hash->v[1] = PRIME64_2;
+    hash->v[2] = 0;
+    hash->v[3] = -PRIME64_1;
+    hash->total = 0;
+}
+
+// len must be a multiple of 32
+static void hashUpdate(struct store_hash *hash, const unsigned char *data, size_t len)
+{
+    const unsigned char *end = data + len;
+
+    hash->total += len;
+
+    for (; data < end; data += 32)
+    {
+        hash->v[0] = hashRound(hash->v[0], read64(data));
+        hash->v[1] = hashRound(hash->v[1], read64(data + 8));
+        hash->v[2] = hashRound(hash->v[2], read64(data + 16));
+        hash->v[3] = hashRound(hash->v[3], read64(data + 24));
+    }
+}
+
+static uint64_t hashFinal(struct store_hash *hash, const unsigned char *data, size_t len)
+{
+    uint64_t h;
+    size_t stripes = len & ~(size_t)31;
+
+    hashUpdate(hash, data, stripes);
+    data += stripes;
+    len -= stripes;
+
+    if (hash->total >= 32)
+    {
+        h = rotl64(hash->v[0], 1) + rotl64(hash->v[1], 7) + rotl64(hash->v[2], 12) + rotl64(hash->v[3], 18);
+        h = hashMerge(h, hash->v[0]);
+        h = hashMerge(h, hash->v[1]);
+        h = hashMerge(h, hash->v[2]);
+        h = hashMerge(h, hash->v[3]);
+    }
+    else
+    {
+        h = PRIME64_5;
+    }
+
+    h += hash->total + len;
+
+    for (; len >= 8; data += 8, len -= 8)
+    {
+        h ^= hashRound(0, read64(data));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+
+    if (len >= 4)
+    {
+        h ^= (uint64_t)read32(data) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        data += 4;
+        len -= 4;
+    }
+
+    for (; len > 0; data++, len--)
+    {
+        h ^= *data * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+/**
+ * Hashes a buffer with the same hash the store uses for whole files.
+ *
+ * @param data the bytes to hash
+ * @param len how many there are
+ * @return the hash
+ */
+uint64_t hashData(const unsigned char *data, size_t len)
+{
+    struct store_hash hash;
+
+    hashInit(&hash);
+    return hashFinal(&hash, data, len);
+}
+
+#ifndef _WIN32
+// reads until len bytes are in or the file ends
+static ssize_t readFully(int fd, unsigned char *buffer, size_t len)
+{
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < len)
+    {
+        if ((ret = read(fd, buffer + done, len - done)) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return -1;
+        }
+
+        if (ret == 0)
+        {
+            break;
+        }
+
+        done += ret;
+    }
+
+    return done;
+}
+
+// hashes can collide, so a file is only replaced by one with the same bytes
+static int sameContent(const char *a, const char *b, unsigned char *buffer)
+{
+    unsigned char *other = buffer + STORE_BUFFER_SIZE / 2;
+    ssize_t len_a, len_b;
+    int fd_a, fd_b;
+    int same = 0;
+
+    if ((fd_a = open(a, O_RDONLY | O_BINARY)) < 0)
+    {
+        return 0;
+    }
+
+    if ((fd_b = open(b, O_RDONLY | O_BINARY)) < 0)
+    {
+        close(fd_a);
+        return 0;
+    }
+
+    do
+    {
+        len_a = readFully(fd_a, buffer, STORE_BUFFER_SIZE / 2);
+        len_b = readFully(fd_b, other, STORE_BUFFER_SIZE / 2);
+
+        if (len_a < 0 || len_a != len_b || memcmp(buffer, other, len_a) != 0)
+        {
+            break;
+        }
+
+        same = len_a == 0;
+    }
+    while (!same);
+
+    close(fd_a);
+    close(fd_b);
+    return same;
+}
+
+static int isUnderAppsPath(const char *path)
+{
+    size_t len = strlen(g_paths.appsPath);
+
+    return strncmp(path, g_paths.appsPath, len) == 0 && path[len] == '/';
+}
+
+// removes whatever is only in the store
+static void pruneStore(void)
+{
+    char path[PATH_MAX];
+    DIR *dirp, *subdirp;
+    struct dirent *entry, *subentry;
+    struct stat statbuf;
+    unsigned long removed = 0;
+
+    if ((dirp = opendir(g_store_path)) == NULL)
+    {
+        return;
+    }
+
+    while ((entry = readdir(dirp)) != NULL)
+    {
+        snprintf(path, sizeof(path), "%s/%s", g_store_path, entry->d_name);
+
+        if (entry->d_name[0] == '.')
+        {
+            // links and copies left over from being stopped midway
+            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0 && lstat(path, &statbuf) == 0 &&
+                    S_ISREG(statbuf.st_mode))
+            {
+                unlink(path);
+            }
+
+            continue;
+        }
+
+        if ((subdirp = opendir(path)) == NULL)
+        {
+            continue;
+        }
+
+        while ((subentry = readdir(subdirp)) != NULL)
+        {
+            if (subentry->d_name[0] == '.')
+            {
+                continue;
+            }
+
+            snprintf(path, sizeof(path), "%s/%s/%s", g_store_path, entry->d_name, subentry->d_name);
+
+            if (lstat(path, &statbuf) == 0 && S_ISREG(statbuf.st_mode) && statbuf.st_nlink == 1 && unlink(path) == 0)
+            {
+                removed++;
+            }
+        }
+
+        closedir(subdirp);
+    }
+
+    closedir(dirp);
+    LOG(LVERBOSE, "Removed %lu unused files from the store.\n", removed);
+}
+#endif // not _WIN32
+
+/**
+ * Turns on the store, it is kept in a hidden directory under root.
+ *
+ * @param root the apps path, files outside of it are not stored.
+ * @return zero on success
+ */
+int initStore(const char *root)
+{
+#ifdef _WIN32
+    LOG(LERROR, "The deduplicating store is not supported on this platform.\n");
+    return -1;
+#else
+    asprintf(&g_store_path, "%s/%s", root, STORE_DIRECTORY);
+
+    if (createNewDirectory(g_store_path) < 0)
+    {
+        LOG(LERROR, "Cannot create the store at %s.\n", g_store_path);
+        free(g_store_path);
+        g_store_path = NULL;
+        return -1;
+    }
+
+    pruneStore();
+    return 0;
+#endif
+}
+
+/**
+ * Starts hashing a file as it is received, so it does not have to be read
+ * back to be stored.
+ *
+ * @param path where the file will be
+ * @return the hash so far, or NULL if the file is not going to be stored
+ */
+struct store_stream *storeBegin(const char *path)
+{
+    struct store_stream *stream;
+
+    if (g_store_path == NULL || !isUnderAppsPath(path) || (stream = calloc(1, sizeof(*stream))) == NULL)
+    {
+        return NULL;
+    }
+
+    hashInit(&stream->hash);
+    return stream;
+}
+
+/**
+ * Hashes the next piece of a file. The pieces have to come in order,
+ * otherwise the file is not stored.
+ *
+ * @param stream from storeBegin, may be NULL
+ * @param offset where the piece goes in the file
+ * @param data the piece
+ * @param len how long it is
+ */
+void storeData(struct store_stream *stream, uint64_t offset, const unsigned char *data, size_t len)
+{
+    size_t fill;
+
+    if (stream == NULL || stream->broken)
+    {
+        return;
+    }
+
+    if (offset != stream->hash.total + stream->tail_len)
+    {
+        stream->broken = 1;
+        return;
+    }
+
+    if (stream->tail_len > 0)
+    {
+        fill = len < 32 - stream->tail_len ? len : 32 - stream->tail_len;
+        memcpy(stream->tail + stream->tail_len, data, fill);
+        stream->tail_len += fill;
+        data += fill;
+        len -= fill;
+
+        if (stream->tail_len < 32)
+        {
+            return;
+        }
+
+        hashUpdate(&stream->hash, stream->tail, 32);
+        stream->tail_len = 0;
+    }
+
+    fill = len & ~(size_t)31;
+    hashUpdate(&stream->hash, data, fill);
+    memcpy(stream->tail, data + fill, len - fill);
+    stream->tail_len = len - fill;
+}
+
+/**
+ * Drops the hash of a file that is not going to be stored.
+ *
+ * @param stream from storeBegin, may be NULL
+ */
+void storeDiscard(struct store_stream *stream)
+{
+    free(stream);
+}
+
+#ifndef _WIN32
+// call with the lock held
+static int isUnchanged(const struct store_job *job)
+{
+    struct stat statbuf;
+
+    return !job->cancelled && lstat(job->path, &statbuf) == 0 && statbuf.st_dev == job->dev &&
+           statbuf.st_ino == job->ino && statbuf.st_nlink == 1 && statbuf.st_size == job->size &&
+           statbuf.st_mtime == job->mtime;
+}
+
+static void storeJob(struct store_job *job)
+{
+    char stored[PATH_MAX];
+    char temp[PATH_MAX];
+    unsigned char *buffer;
+    int len;
+    int err;
+    int same;
+
+    len = snprintf(stored, sizeof(stored), "%s/%02x", g_store_path, (unsigned int)(job->hash >> 56));
+    mkdir(stored, S_IRWXU);
+    snprintf(stored + len, sizeof(stored) - len, "/%016llx-%llx", (unsigned long long)job->hash,
+             (unsigned long long)job->size);
+    pthread_mutex_lock(&g_store_lock);
+
+    if (!isUnchanged(job))
+    {
+        pthread_mutex_unlock(&g_store_lock);
+        return;
+    }
+
+    if (link(job->path, stored) == 0)
+    {
+        pthread_mutex_unlock(&g_store_lock);
+        LOG(LDEBUG, "Stored %s as %s.\n", job->path, stored);
+        return;
+    }
+
+    err = errno;
+    pthread_mutex_unlock(&g_store_lock);
+
+    // hashes can collide, so the file is compared to the stored copy first
+    if (err != EEXIST || (buffer = malloc(STORE_BUFFER_SIZE)) == NULL)
+    {
+        return;
+    }
+
+    same = sameContent(job->path, stored, buffer);
+    free(buffer);
+
+    if (!same)
+    {
+        return;
+    }
+
+    // the link is made in the store, only this thread swaps one in at a time
+    snprintf(temp, sizeof(temp), "%s/.link", g_store_path);
+    pthread_mutex_lock(&g_store_lock);
+
+    // it may have been moved or written to while it was compared
+    if (isUnchanged(job))
+    {
+        unlink(temp);
+
+        if (link(stored, temp) == 0 && rename(temp, job->path) == 0)
+        {
+            LOG(LDEBUG, "%s is already stored as %s.\n", job->path, stored);
+        }
+        else
+        {
+            unlink(temp);
+        }
+    }
+
+    pthread_mutex_unlock(&g_store_lock);
+}
+
+static void *storeWorker(void *args)
+{
+    struct store_job *job;
+
+    pthread_mutex_lock(&g_store_lock);
+
+    for (;;)
+    {
+        if ((job = g_store_jobs.head) == NULL || g_store_jobs.held > 0)
+        {
+            pthread_cond_wait(&g_store_jobs.cond, &g_store_lock);
+            continue;
+        }
+
+        if ((g_store_jobs.head = job->next) == NULL)
+        {
+            g_store_jobs.tail = NULL;
+        }
+
+        g_store_jobs.current = job;
+        pthread_mutex_unlock(&g_store_lock);
+        storeJob(job);
+        pthread_mutex_lock(&g_store_lock);
+        g_store_jobs.current = NULL;
+        free(job->path);
+        free(job);
+    }
+
+    return NULL;
+}
+#endif // not _WIN32
+
+/**
+ * Stores a file that was just received: it is linked to the stored copy of
+ * the same content, or added to the store if there is none yet. This is done
+ * in the background, the file is only read again if there is a copy to
+ * compare it to, and is left alone if it changes in the meantime.
+ *
+ * @param stream from storeBegin with all of the file hashed, freed here,
+ *  may be NULL
+ * @param fd the file, still open
+ * @param path where the file is once the transfer it is part of is done
+ */
+void storeFile(struct store_stream *stream, int fd, const char *path)
+{
+#ifndef _WIN32
+    struct store_job *job;
+    struct stat statbuf;
+
+    // already stored files have more than one link
+    if (stream == NULL || stream->broken || fstat(fd, &statbuf) < 0 || !S_ISREG(statbuf.st_mode) ||
+            statbuf.st_nlink != 1 || statbuf.st_size < STORE_MIN_SIZE ||
+            (uint64_t)statbuf.st_size != stream->hash.total + stream->tail_len ||
+            (job = malloc(sizeof(*job))) == NULL)
+    {
+        free(stream);
+        return;
+    }
+
+    job->path = strdup(path);
+    job->size = statbuf.st_size;
+    job->hash = hashFinal(&stream->hash, stream->tail, stream->tail_len);
+    job->dev = statbuf.st_dev;
+    job->ino = statbuf.st_ino;
+    job->mtime = statbuf.st_mtime;
+    job->cancelled = 0;
+    job->next = NULL;
+    free(stream);
+    pthread_mutex_lock(&g_store_lock);
+
+    if (!g_store_jobs.running)
+    {
+        if (pthread_create(&g_store_jobs.thread, NULL, storeWorker, NULL) != 0)
+        {
+            pthread_mutex_unlock(&g_store_lock);
+            LOG(LERROR, "Cannot start the store thread.\n");
+            free(job->path);
+            free(job);
+            return;
+        }
+
+        pthread_detach(g_store_jobs.thread);
+        g_store_jobs.running = 1;
+    }
+
+    if (g_store_jobs.tail == NULL)
+    {
+        g_store_jobs.head = job;
+    }
+    else
+    {
+        g_store_jobs.tail->next = job;
+    }
+
+    g_store_jobs.tail = job;
+    pthread_cond_signal(&g_store_jobs.cond);
+    pthread_mutex_unlock(&g_store_lock);
+#else
+    free(stream);
+#endif
+}
+
+/**
+ * Keeps the store from touching files until storeRelease, for while
+ * received files are not where storeFile was told they would be yet.
+ */
+void storeHold(void)
+{
+    pthread_mutex_lock(&g_store_lock);
+    g_store_jobs.held++;
+    pthread_mutex_unlock(&g_store_lock);
+}
+
+/**
+ * Lets the store go on after storeHold.
+ */
+void storeRelease(void)
+{
+    pthread_mutex_lock(&g_store_lock);
+
+    if (--g_store_jobs.held == 0)
+    {
+        pthread_cond_signal(&g_store_jobs.cond);
+    }
+
+    pthread_mutex_unlock(&g_store_lock);
+}
+
+/**
+ * Gives a stored file a copy of its own so that writing to it does not
+ * change every other file with the same content. A file that is waiting to
+ * be stored is not stored anymore.
+ *
+ * @param path the file
+ * @return zero if the file can be written to
+ */
+int unshareFile(const char *path)
+{
+#ifndef _WIN32
+    char *temp;
+    unsigned char *buffer;
+    struct store_job *job;
+    struct stat statbuf;
+    ssize_t len = 0;
+    int in, out;
+    int ret = 0;
+
+    if (g_store_path == NULL)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&g_store_lock);
+
+    for (job = g_store_jobs.head; job != NULL; job = job->next)
+    {
+        if (strcmp(job->path, path) == 0)
+        {
+            job->cancelled = 1;
+        }
+    }
+
+    if (g_store_jobs.current != NULL && strcmp(g_store_jobs.current->path, path) == 0)
+    {
+        g_store_jobs.current->cancelled = 1;
+    }
+
+    pthread_mutex_unlock(&g_store_lock);
+
+    if (lstat(path, &statbuf) < 0 || !S_ISREG(statbuf.st_mode) || statbuf.st_nlink == 1)
+    {
+        return 0;
+    }
+
+    if ((buffer = malloc(STORE_BUFFER_SIZE)) == NULL)
+    {
+        return -1;
+    }
+
+    // the copy is made in the store, so no name next to the file is taken
+    asprintf(&temp, "%s/.copy-XXXXXX", g_store_path);
+
+    if ((in = open(path, O_RDONLY | O_BINARY)) < 0)
+    {
+        free(temp);
+        free(buffer);
+        return -1;
+    }
+
+    if ((out = mkstemp(temp)) < 0)
+    {
+        close(in);
+        free(temp);
+        free(buffer);
+        return -1;
+    }
+
+    if (fchmod(out, statbuf.st_mode & 0777) < 0)
+    {
+        ret = -1;
+    }
+
+    while (ret == 0 && (len = readFully(in, buffer, STORE_BUFFER_SIZE)) > 0)
+    {
+        if (write(out, buffer, len) != len)
+        {
+            ret = -1;
+        }
+    }
+
+    if (len < 0 || close(out) < 0)
+    {
+        ret = -1;
+    }
+
+    close(in);
+
+    if (ret == 0 && rename(temp, path) < 0)
+    {
+        ret = -1;
+    }
+
+    if (ret < 0)
+    {
+        LOG(LERROR, "Cannot copy %s out of the store.\n", path);
+        unlink(temp);
+    }
+
+    free(temp);
+    free(buffer);
+    return ret;
+#else
+    return 0;
+#endif
+}
@@ -60,6 +60,9 @@ struct vita_device
         int intep;
         int callback_active;
         int timeout;
+        unsigned long block_size;
+        unsigned char *write_buffer; // kept between transfers
+        unsigned long write_buffer_size;
         uint64_t current_transfer_total;
         uint64_t current_transfer_complete;
         VitaMTP_progressfunc_t current_transfer_callback;
@@ -72,6 +75,12 @@ static libusb_context *g_usb_context;
 extern int g_VitaMTP_logmask;
 
 void VitaMTP_hex_dump(const unsigned char *data, unsigned int size, unsigned int num);
+int vita_tuner_init(PTPParams *params, const uint32_t *candidates, int num);
+void vita_tuner_free(PTPParams *params);
+int vita_scheduler_init(PTPParams *params);
+void vita_scheduler_free(PTPParams *params);
+uint32_t vita_tuner_begin(PTPParams *params);
+void vita_tuner_end(PTPParams *params, uint64_t bytes);
 
 #define USB_BULK_READ libusb_bulk_transfer
 #define USB_BULK_WRITE libusb_bulk_transfer
@@ -134,7 +143,17 @@ void VitaMTP_hex_dump(const unsigned char *data, unsigned int size, unsigned int
  */
 #define CONTEXT_BLOCK_SIZE_1    0x3e00
 #define CONTEXT_BLOCK_SIZE_2  0x200
-#define CONTEXT_BLOCK_SIZE    CONTEXT_BLOCK_SIZE_1+CONTEXT_BLOCK_SIZE_2
+#define CONTEXT_BLOCK_SIZE    (CONTEXT_BLOCK_SIZE_1+CONTEXT_BLOCK_SIZE_2)
+
+/*
+ * Block sizes that VitaMTP_Calibrate_Transfers() will try. The first one
+ * is the default. They are all multiples of the high speed packet size.
+ */
+static const uint32_t g_usb_block_sizes[] =
+{
+    CONTEXT_BLOCK_SIZE, 0x8000, 0x10000, 0x20000, 0x40000
+};
+
 static short
 ptp_read_func(
     unsigned long size, PTPDataHandler *handler,void *data,
@@ -152,7 +171,7 @@ ptp_read_func(
     int expect_terminator_byte = 0;
 
     // This is the largest block we'll need to read in.
-    bytes = malloc(CONTEXT_BLOCK_SIZE);
+    bytes = malloc(size < ptp_usb->block_size ? size : ptp_usb->block_size);
 
     while (curread < size)
     {
@@ -160,11 +179,14 @@ ptp_read_func(
         VitaMTP_Log(VitaMTP_DEBUG, "Remaining size to read: 0x%04lx bytes\n", size - curread);
 
         // check equal to condition here
-        if (size - curread < CONTEXT_BLOCK_SIZE)
+        if (size - curread < ptp_usb->block_size)
         {
             // this is the last packet
             toread = size - curread;
         }
+        else if (ptp_usb->block_size != CONTEXT_BLOCK_SIZE)
+            // tuned profiles read whole blocks
+            toread = ptp_usb->block_size;
         else if (curread == 0)
             // we are first packet, but not last packet
             toread = CONTEXT_BLOCK_SIZE_1;
@@ -208,7 +230,10 @@ ptp_read_func(
         int putfunc_ret = handler->putfunc(NULL, handler->priv, xread, bytes, &written);
 
         if (putfunc_ret != PTP_RC_OK)
+        {
+            free(bytes);
             return putfunc_ret;
+        }
 
         ptp_usb->current_transfer_complete += xread;
         curread += xread;
@@ -283,14 +308,24 @@ ptp_write_func(
     unsigned long curwrite = 0;
     unsigned char *bytes;
 
-    // This is the largest block we'll need to read in.
-    bytes = malloc(CONTEXT_BLOCK_SIZE);
-
-    if (!bytes)
+    // This is the largest block we'll need to read in. The buffer is
+    // reused by every transfer and only grows when the tuner picks a
+    // larger block size.
+    if (ptp_usb->write_buffer_size < ptp_usb->block_size)
     {
-        return PTP_ERROR_IO;
+        free(ptp_usb->write_buffer);
+        ptp_usb->write_buffer_size = 0;
+
+        if ((ptp_usb->write_buffer = malloc(ptp_usb->block_size)) == NULL)
+        {
+            return PTP_ERROR_IO;
+        }
+
+        ptp_usb->write_buffer_size = ptp_usb->block_size;
     }
 
+    bytes = ptp_usb->write_buffer;
+
     while (curwrite < size)
     {
         unsigned long usbwritten = 0;
@@ -298,9 +333,9 @@ ptp_write_func(
 
         towrite = size-curwrite;
 
-        if (towrite > CONTEXT_BLOCK_SIZE)
+        if (towrite > ptp_usb->block_size)
         {
-            towrite = CONTEXT_BLOCK_SIZE;
+            towrite = ptp_usb->block_size;
         }
         else
         {
@@ -314,7 +349,9 @@ ptp_write_func(
         int getfunc_ret = handler->getfunc(NULL, handler->priv,towrite,bytes,&towrite);
 
         if (getfunc_ret != PTP_RC_OK)
+        {
             return getfunc_ret;
+        }
 
         while (usbwritten < towrite)
         {
@@ -369,8 +406,6 @@ ptp_write_func(
             break;
     }
 
-    free(bytes);
-
     if (written)
     {
         *written = curwrite;
@@ -453,6 +488,7 @@ ptp_init_recv_memory_handler(PTPDataHandler *handler)
     PTPMemHandlerPrivate *priv;
     priv = malloc(sizeof(PTPMemHandlerPrivate));
     handler->priv = priv;
+    handler->file = NULL;
     handler->getfunc = memory_getfunc;
     handler->putfunc = memory_putfunc;
     priv->data = NULL;
@@ -476,6 +512,7 @@ ptp_init_send_memory_handler(PTPDataHandler *handler,
         return PTP_RC_GeneralError;
 
     handler->priv = priv;
+    handler->file = NULL;
     handler->getfunc = memory_getfunc;
     handler->putfunc = memory_putfunc;
     priv->data = data;
@@ -573,10 +610,10 @@ ptp_usb_sendreq(PTPParams *params, PTPContainer *req)
     return ret;
 }
 
-uint16_t
-ptp_usb_senddata(PTPParams *params, PTPContainer *ptp,
-                 unsigned long size, PTPDataHandler *handler
-                )
+static uint16_t
+ptp_usb_senddata_blocks(PTPParams *params, PTPContainer *ptp,
+                        unsigned long size, PTPDataHandler *handler
+                       )
 {
     uint16_t ret;
     int wlen, datawlen;
@@ -656,6 +693,23 @@ ptp_usb_senddata(PTPParams *params, PTPContainer *ptp,
     return ret;
 }
 
+uint16_t
+ptp_usb_senddata(PTPParams *params, PTPContainer *ptp,
+                 unsigned long size, PTPDataHandler *handler
+                )
+{
+    struct vita_usb *ptp_usb = (struct vita_usb *) params->data;
+    uint16_t ret;
+
+    ptp_usb->block_size = vita_tuner_begin(params);
+    ret = ptp_usb_senddata_blocks(params, ptp, size, handler);
+
+    if (ret == PTP_RC_OK)
+        vita_tuner_end(params, size);
+
+    return ret;
+}
+
 static uint16_t ptp_usb_getpacket(PTPParams *params,
                                   PTPUSBBulkContainer *packet, unsigned long *rlen)
 {
@@ -689,8 +743,8 @@ static uint16_t ptp_usb_getpacket(PTPParams *params,
     return ret;
 }
 
-uint16_t
-ptp_usb_getdata(PTPParams *params, PTPContainer *ptp, PTPDataHandler *handler)
+static uint16_t
+ptp_usb_getdata_blocks(PTPParams *params, PTPContainer *ptp, PTPDataHandler *handler)
 {
     uint16_t ret;
     PTPUSBBulkContainer usbdata;
@@ -863,6 +917,22 @@ ptp_usb_getdata(PTPParams *params, PTPContainer *ptp, PTPDataHandler *handler)
     return ret;
 }
 
+uint16_t
+ptp_usb_getdata(PTPParams *params, PTPContainer *ptp, PTPDataHandler *handler)
+{
+    struct vita_usb *ptp_usb = (struct vita_usb *) params->data;
+    uint64_t complete = ptp_usb->current_transfer_complete;
+    uint16_t ret;
+
+    ptp_usb->block_size = vita_tuner_begin(params);
+    ret = ptp_usb_getdata_blocks(params, ptp, handler);
+
+    if (ret == PTP_RC_OK)
+        vita_tuner_end(params, ptp_usb->current_transfer_complete - complete);
+
+    return ret;
+}
+
 uint16_t
 ptp_usb_getresp(PTPParams *params, PTPContainer *resp)
 {
@@ -1166,6 +1236,7 @@ static int configure_usb_device(vita_raw_device_t *raw_device, vita_device_t *de
     params->data=&dev->usb_device;
     params->transaction_id=0;
     dev->usb_device.timeout = USB_TIMEOUT_DEFAULT;
+    dev->usb_device.block_size = CONTEXT_BLOCK_SIZE;
 
     if (libusb_open((libusb_device *)raw_device->data, &dev->usb_device.handle) != LIBUSB_SUCCESS)
     {
@@ -1254,9 +1325,26 @@ VITAMTP_EXPORT vita_device_t *VitaMTP_Open_USB_Vita(vita_raw_device_t *raw_devic
 
 #endif
 
+    if (vita_tuner_init(current_params, g_usb_block_sizes, sizeof(g_usb_block_sizes)/sizeof(uint32_t)) < 0)
+    {
+        free(current_params);
+        free(dev);
+        return NULL;
+    }
+
+    if (vita_scheduler_init(current_params) < 0)
+    {
+        vita_tuner_free(current_params);
+        free(current_params);
+        free(dev);
+        return NULL;
+    }
+
     if (configure_usb_device(raw_device, dev, current_params) < 0)
     {
         VitaMTP_Log(VitaMTP_ERROR, "Cannot configure USB device.\n");
+        vita_scheduler_free(current_params);
+        vita_tuner_free(current_params);
         free(current_params);
         free(dev);
         return NULL;
@@ -1283,11 +1371,14 @@ VITAMTP_EXPORT void VitaMTP_Release_USB_Device(vita_device_t *device)
     }
 
     libusb_close(ptp_usb->handle);
+    free(ptp_usb->write_buffer);
 #ifdef HAVE_ICONV
     // Free iconv() converters...
     iconv_close(params->cd_locale_to_ucs2);
     iconv_close(params->cd_ucs2_to_locale);
 #endif
+    vita_scheduler_free(params);
+    vita_tuner_free(params);
     ptp_free_params(params);
     free(params);
     free(device);
@@ -23,16 +23,22 @@
 #else
 #include <dirent.h>
 #include <ftw.h>
-#include <sys/stat.h>
+#include <sys/resource.h>
 #include <sys/statvfs.h>
 #endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include <sys/stat.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "opencma.h"
@@ -41,6 +47,10 @@
 extern int asprintf(char **ret, const char *format, ...);
 #endif
 
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
 extern struct cma_paths g_paths;
 
 // Windows FS commands
@@ -155,36 +165,6 @@ int readFileToBuffer(const char *name, size_t seek, unsigned char **p_data, unsi
     return 0;
 }
 
-int writeFileFromBuffer(const char *name, size_t seek, unsigned char *data, size_t len)
-{
-    LARGE_INTEGER offset = { .QuadPart = seek };
-    HANDLE hFile = CreateFile(name, GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-    
-    if (hFile == INVALID_HANDLE_VALUE)
-    {
-        LOG(LERROR, "Cannot open %s for writing.\n", name);
-        return -1;
-    }
-    
-    if (SetFilePointer(hFile, offset.LowPart, &offset.HighPart, FILE_BEGIN) == INVALID_SET_FILE_POINTER && GetLastError() != NO_ERROR)
-    {
-        LOG(LERROR, "Cannot seek to %Iu.\n", seek);
-        CloseHandle(hFile);
-        return -1;
-    }
-    
-    DWORD written;
-    if (!WriteFile(hFile, data, len, &written, NULL) || written < len)
-    {
-        LOG(LERROR, "Write short of %Iu bytes.\n", len);
-        CloseHandle(hFile);
-        return -1;
-    }
-    
-    CloseHandle(hFile);
-    return 0;
-}
-
 void deleteAll(const char *path)
 {
     char pathCpy[MAX_PATH];
@@ -217,6 +197,11 @@ int fileExists(const char *path)
     return dwAttrib != INVALID_FILE_ATTRIBUTES;
 }
 
+void prefetchFile(const char *path, size_t len)
+{
+    // the cache manager reads ahead on its own
+}
+
 int getDiskSpace(const char *path, uint64_t *free, uint64_t *total)
 {
     DWORD SectorsPerCluster;
@@ -235,7 +220,16 @@ int getDiskSpace(const char *path, uint64_t *free, uint64_t *total)
     return 0;
 }
 
-void addEntriesForDirectory(struct cma_object *current, int parent_ohfi)
+// folder sizes are not cached on Windows, summarize is ignored
+void loadDirectorySizes(const char *file)
+{
+}
+
+void saveDirectorySizes(const char *file)
+{
+}
+
+void addEntriesForDirectory(struct cma_object *current, int parent_ohfi, int summarize)
 {
     lockDatabase();
     struct cma_object *last = current;
@@ -274,7 +268,7 @@ void addEntriesForDirectory(struct cma_object *current, int parent_ohfi)
         
         if (current->metadata.dataType & Folder)
         {
-            addEntriesForDirectory(current, current->metadata.ohfi);
+            addEntriesForDirectory(current, current->metadata.ohfi, 0);
         }
         
         totalSize += current->metadata.size;
@@ -393,34 +387,6 @@ int readFileToBuffer(const char *name, size_t seek, unsigned char **p_data, unsi
     return 0;
 }
 
-int writeFileFromBuffer(const char *name, size_t seek, unsigned char *data, size_t len)
-{
-    FILE *file = fopen(name, "a+");
-
-    if (file == NULL)
-    {
-        LOG(LERROR, "Cannot open %s for writing.\n", name);
-        return -1;
-    }
-
-    if (fseek(file, seek, SEEK_SET) < 0)
-    {
-        LOG(LERROR, "Cannot seek to %zu.\n", seek);
-        fclose(file);
-        return -1;
-    }
-
-    if (fwrite(data, sizeof(char), len, file) < len)
-    {
-        LOG(LERROR, "Write short of %zu bytes.\n", len);
-        fclose(file);
-        return -1;
-    }
-
-    fclose(file);
-    return 0;
-}
-
 int deleteEntry(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftw)
 {
     return remove(fpath);
@@ -442,6 +408,22 @@ int fileExists(const char *path)
     return access(path, F_OK) == 0;
 }
 
+// starts reading the beginning of a file into the page cache in the background
+void prefetchFile(const char *path, size_t len)
+{
+#ifdef POSIX_FADV_WILLNEED
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+    {
+        return;
+    }
+
+    posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED);
+    close(fd);
+#endif
+}
+
 int getDiskSpace(const char *path, uint64_t *free, uint64_t *total)
 {
     struct statvfs stat;
@@ -457,7 +439,278 @@ int getDiskSpace(const char *path, uint64_t *free, uint64_t *total)
     return 0;
 }
 
-void addEntriesForDirectory(struct cma_object *current, int parent_ohfi)
+// Folders in the app categories hold thousands of files that are only needed
+// when one is sent, so they can be added without their contents. Their sizes
+// are kept in a file between runs so they don't have to be added up again
+// each time. A folder's entry has its own size plus that of the files right
+// in it, and a whole tree is taken from the file if none of its folders were
+// modified since.
+struct dir_size
+{
+    char *path;
+    long long mtime;
+    uint64_t size;
+};
+
+static struct
+{
+    struct dir_size *old; // read from the file, sorted by path
+    int num_old;
+    struct dir_size *new; // what is written back
+    int num_new;
+    int max_new;
+} g_dir_sizes;
+
+// in nanoseconds, a folder can change more than once in a second
+static long long modifiedTime(const struct stat *st)
+{
+#ifdef __APPLE__
+    return st->st_mtimespec.tv_sec * 1000000000LL + st->st_mtimespec.tv_nsec;
+#else
+    return st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+#endif
+}
+
+static int compareDirSizes(const void *a, const void *b)
+{
+    return strcmp(((const struct dir_size *)a)->path, ((const struct dir_size *)b)->path);
+}
+
+static void freeDirSizes(struct dir_size *sizes, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        free(sizes[i].path);
+    }
+
+    free(sizes);
+}
+
+static void addDirSize(char *path, long long mtime, uint64_t size)
+{
+    struct dir_size *sizes;
+
+    if (g_dir_sizes.num_new == g_dir_sizes.max_new)
+    {
+        if ((sizes = realloc(g_dir_sizes.new, (g_dir_sizes.max_new + 256) * sizeof(struct dir_size))) == NULL)
+        {
+            free(path);
+            return; // it's only a cache
+        }
+
+        g_dir_sizes.new = sizes;
+        g_dir_sizes.max_new += 256;
+    }
+
+    g_dir_sizes.new[g_dir_sizes.num_new].path = path;
+    g_dir_sizes.new[g_dir_sizes.num_new].mtime = mtime;
+    g_dir_sizes.new[g_dir_sizes.num_new].size = size;
+    g_dir_sizes.num_new++;
+}
+
+// index of the first old entry that is not less than path
+static int findDirSize(const char *path)
+{
+    int low = 0;
+    int high = g_dir_sizes.num_old;
+    int mid;
+
+    while (low < high)
+    {
+        mid = (low + high) / 2;
+
+        if (strcmp(g_dir_sizes.old[mid].path, path) < 0)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+// adds up the size of a folder the same way addEntriesForDirectory() does
+static uint64_t scanDirectorySize(const char *path, const struct stat *dirstat)
+{
+    char fullpath[PATH_MAX];
+    DIR *dirp;
+    struct dirent *entry;
+    struct stat statbuf;
+    uint64_t size = 0;
+    uint64_t total = 0;
+
+    if ((dirp = opendir(path)) == NULL)
+    {
+        return dirstat->st_size;
+    }
+
+    while ((entry = readdir(dirp)) != NULL)
+    {
+        if (entry->d_name[0] == '.')
+        {
+            continue; // ignore hidden folders and ., ..
+        }
+
+        snprintf(fullpath, sizeof(fullpath), "%s/%s", path, entry->d_name);
+
+        if (stat(fullpath, &statbuf) != 0)
+        {
+            continue;
+        }
+
+        if (S_ISDIR(statbuf.st_mode))
+        {
+            total += scanDirectorySize(fullpath, &statbuf);
+        }
+        else
+        {
+            size += statbuf.st_size;
+        }
+    }
+
+    closedir(dirp);
+    size += dirstat->st_size;
+    addDirSize(strdup(path), modifiedTime(dirstat), size);
+    return size + total;
+}
+
+static uint64_t directorySize(const char *path, const struct stat *dirstat)
+{
+    struct stat statbuf;
+    char *prefix;
+    size_t len;
+    uint64_t total;
+    int first, i, end;
+
+    first = findDirSize(path);
+
+    if (first == g_dir_sizes.num_old || strcmp(g_dir_sizes.old[first].path, path) != 0 ||
+            g_dir_sizes.old[first].mtime != modifiedTime(dirstat))
+    {
+        return scanDirectorySize(path, dirstat);
+    }
+
+    // the folders under it come right after everything that sorts before "path/"
+    asprintf(&prefix, "%s/", path);
+    len = strlen(prefix);
+    total = g_dir_sizes.old[first].size;
+
+    for (end = i = findDirSize(prefix); end < g_dir_sizes.num_old; end++)
+    {
+        if (strncmp(g_dir_sizes.old[end].path, prefix, len) != 0)
+        {
+            break;
+        }
+
+        if (stat(g_dir_sizes.old[end].path, &statbuf) != 0 || modifiedTime(&statbuf) != g_dir_sizes.old[end].mtime)
+        {
+            free(prefix);
+            return scanDirectorySize(path, dirstat);
+        }
+
+        total += g_dir_sizes.old[end].size;
+    }
+
+    free(prefix);
+    addDirSize(strdup(path), modifiedTime(dirstat), g_dir_sizes.old[first].size);
+
+    for (; i < end; i++)
+    {
+        addDirSize(strdup(g_dir_sizes.old[i].path), g_dir_sizes.old[i].mtime, g_dir_sizes.old[i].size);
+    }
+
+    return total;
+}
+
+/**
+ * Reads the folder sizes saved by saveDirectorySizes(), call before
+ * adding entries with summarize set.
+ *
+ * @param file where they are kept
+ */
+void loadDirectorySizes(const char *file)
+{
+    FILE *fp;
+    char line[PATH_MAX + 64];
+    long long mtime;
+    unsigned long long size;
+    int pos;
+
+    freeDirSizes(g_dir_sizes.old, g_dir_sizes.num_old);
+    memset(&g_dir_sizes, 0, sizeof(g_dir_sizes));
+
+    if ((fp = fopen(file, "r")) == NULL)
+    {
+        return;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        line[strcspn(line, "\n")] = '\0';
+
+        if (sscanf(line, "%lld %llu %n", &mtime, &size, &pos) == 2 && line[pos] != '\0')
+        {
+            addDirSize(strdup(line + pos), mtime, size);
+        }
+    }
+
+    fclose(fp);
+    g_dir_sizes.old = g_dir_sizes.new;
+    g_dir_sizes.num_old = g_dir_sizes.num_new;
+    g_dir_sizes.new = NULL;
+    g_dir_sizes.num_new = 0;
+    g_dir_sizes.max_new = 0;
+    qsort(g_dir_sizes.old, g_dir_sizes.num_old, sizeof(struct dir_size), compareDirSizes);
+}
+
+/**
+ * Writes the sizes of the folders that were added since loadDirectorySizes().
+ *
+ * @param file where they are kept
+ */
+void saveDirectorySizes(const char *file)
+{
+    FILE *fp;
+    char *temp;
+    int ok;
+    int i;
+
+    asprintf(&temp, "%s.tmp", file);
+
+    if ((fp = fopen(temp, "w")) == NULL)
+    {
+        LOG(LERROR, "Cannot write folder sizes to %s.\n", temp);
+    }
+    else
+    {
+        for (i = 0; i < g_dir_sizes.num_new; i++)
+        {
+            fprintf(fp, "%lld %llu %s\n", g_dir_sizes.new[i].mtime, (unsigned long long)g_dir_sizes.new[i].size,
+                    g_dir_sizes.new[i].path);
+        }
+
+        ok = fclose(fp) == 0;
+
+        if (!ok || rename(temp, file) < 0)
+        {
+            LOG(LERROR, "Cannot write folder sizes to %s.\n", file);
+            unlink(temp);
+        }
+    }
+
+    free(temp);
+    freeDirSizes(g_dir_sizes.old, g_dir_sizes.num_old);
+    freeDirSizes(g_dir_sizes.new, g_dir_sizes.num_new);
+    memset(&g_dir_sizes, 0, sizeof(g_dir_sizes));
+}
+
+// with summarize set, folders are added without what is in them, see expandObject()
+void addEntriesForDirectory(struct cma_object *current, int parent_ohfi, int summarize)
 {
     lockDatabase();
     struct cma_object *last = current;
@@ -493,11 +746,19 @@ void addEntriesForDirectory(struct cma_object *current, int parent_ohfi)
             continue;
         }
         
-        current = addToDatabase(last, entry->d_name, statbuf.st_size, S_ISDIR(statbuf.st_mode) ? Folder : File);
+        if (summarize && S_ISDIR(statbuf.st_mode))
+        {
+            current = addToDatabase(last, entry->d_name, directorySize(fullpath, &statbuf), Folder);
+            current->collapsed = 1;
+        }
+        else
+        {
+            current = addToDatabase(last, entry->d_name, statbuf.st_size, S_ISDIR(statbuf.st_mode) ? Folder : File);
+        }
         
-        if (current->metadata.dataType & Folder)
+        if ((current->metadata.dataType & Folder) && !current->collapsed)
         {
-            addEntriesForDirectory(current, current->metadata.ohfi);
+            addEntriesForDirectory(current, current->metadata.ohfi, 0);
         }
         
         totalSize += current->metadata.size;
@@ -511,53 +772,833 @@ void addEntriesForDirectory(struct cma_object *current, int parent_ohfi)
 }
 #endif // not _WIN32
 
-int requestURL(const char *url, unsigned char **p_data, unsigned int *p_len)
+// Parts received from the Vita are written out on their own thread, so the next
+// part can come in while the last one is still going to disk. The Vita sends
+// a file's parts one after the other, so only one file is kept open.
+#define WRITE_BEHIND_LIMIT      0x4000000 // bytes queued before receiving waits
+#define WRITE_BEHIND_RESERVE    0x4000000 // disk space reserved ahead of the writes
+
+struct file_write
 {
-    char *name;
+    int ohfi;
+    char *path;
+    uint64_t offset;
+    unsigned char *buffer; // freed once written
+    const unsigned char *data;
     size_t len;
-    url = strrchr(url, '/');
+    struct file_write *next;
+};
 
-    if (url == NULL)
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int running;
+    int stop;
+    struct file_write *head;
+    struct file_write *tail;
+    size_t queued; // bytes queued or being written
+    int *failed; // OHFIs of files a write failed for, until they are asked for
+    int num_failed;
+    // only touched by the writer thread
+    int ohfi;
+    char *path;
+    int fd;
+    uint64_t reserved;
+    struct store_stream *stream; // hash of what was written, while it is in order
+} g_writer = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+// call with the lock held
+static void addFailedWrite(int ohfi)
+{
+    int *failed;
+    int i;
+
+    for (i = 0; i < g_writer.num_failed; i++)
     {
-        LOG(LERROR, "URL is malformed.\n");
-        return -1;
+        if (g_writer.failed[i] == ohfi)
+        {
+            return;
+        }
     }
 
-    url++; // get request name
-    len = strcspn(url, "?");
-
-    if (asprintf(&name, "%s/%.*s", g_paths.urlPath, (int)len, url) < 0)
+    if ((failed = realloc(g_writer.failed, (g_writer.num_failed + 1) * sizeof(int))) == NULL)
     {
-        LOG(LERROR, "Out of memory\n");
-        return -1;
+        LOG(LERROR, "Out of memory, cannot remember that OHFI %d failed.\n", ohfi);
+        return;
     }
 
-    int ret = readFileToBuffer(name, 0, p_data, p_len);
-    LOG(LDEBUG, "Reading of %s returned %d.\n", name, ret);
-    free(name);
-    return ret;
+    failed[g_writer.num_failed++] = ohfi;
+    g_writer.failed = failed;
 }
 
-char *strreplace(const char *haystack, const char *find, const char *replace)
+static void closeWriteFile(void)
 {
-    char *newstr;
-    char *found = strstr(haystack, find);
-    ptrdiff_t off;
+    struct stat st;
+    int ret = 0;
+
+    if (g_writer.path == NULL)
+    {
+        return;
+    }
+
+#ifdef FALLOC_FL_KEEP_SIZE
 
-    if (found == NULL)   // not found
+    // give back what was reserved past the end
+    if (g_writer.reserved > 0 && (fstat(g_writer.fd, &st) < 0 || ftruncate(g_writer.fd, st.st_size) < 0))
+    {
+        ret = -1;
+    }
+
+#endif
+#ifdef _WIN32
+    if (_commit(g_writer.fd) < 0)
+#else
+    // the file is complete, this is the only time it is synced
+    if (fsync(g_writer.fd) < 0)
+#endif
     {
-        return strdup(haystack);
+        ret = -1;
     }
 
-    off = found - haystack;
+    if (ret == 0)
+    {
+        storeFile(g_writer.stream, g_writer.fd, g_writer.path);
+    }
+    else
+    {
+        storeDiscard(g_writer.stream);
+    }
 
-    if (asprintf(&newstr, "%.*s%s%s", (int)off, haystack, replace, haystack + off + strlen(find)) < 0)
+    if (close(g_writer.fd) < 0)
     {
-        LOG(LERROR, "Out of memory\n");
-        newstr = NULL;
+        ret = -1;
     }
 
-    return newstr;
+    if (ret < 0)
+    {
+        LOG(LERROR, "Cannot finish writing file %s.\n", g_writer.path);
+        pthread_mutex_lock(&g_writer.lock);
+        addFailedWrite(g_writer.ohfi);
+        pthread_mutex_unlock(&g_writer.lock);
+    }
+
+    free(g_writer.path);
+    g_writer.path = NULL;
+    g_writer.stream = NULL;
+    g_writer.reserved = 0;
+}
+
+static int writeFilePart(struct file_write *part)
+{
+    size_t written;
+    ssize_t ret;
+
+    if (g_writer.path == NULL || g_writer.ohfi != part->ohfi || strcmp(g_writer.path, part->path) != 0)
+    {
+        closeWriteFile();
+
+        if (unshareFile(part->path) < 0 || (g_writer.fd = open(part->path, O_WRONLY | O_CREAT | O_BINARY, 0777)) < 0)
+        {
+            return -1;
+        }
+
+        g_writer.ohfi = part->ohfi;
+        g_writer.path = strdup(part->path);
+        g_writer.stream = storeBegin(part->path);
+    }
+
+#ifdef FALLOC_FL_KEEP_SIZE
+
+    // reserve in large steps so the file ends up in few extents
+    if (part->offset + part->len > g_writer.reserved)
+    {
+        if (fallocate(g_writer.fd, FALLOC_FL_KEEP_SIZE, part->offset, part->len + WRITE_BEHIND_RESERVE) == 0)
+        {
+            g_writer.reserved = part->offset + part->len + WRITE_BEHIND_RESERVE;
+        }
+    }
+
+#endif
+
+    for (written = 0; written < part->len; written += ret)
+    {
+#ifdef _WIN32
+        if (lseek(g_writer.fd, (off_t)(part->offset + written), SEEK_SET) == -1)
+        {
+            return -1;
+        }
+
+        ret = write(g_writer.fd, part->data + written, part->len - written);
+#else
+        ret = pwrite(g_writer.fd, part->data + written, part->len - written, (off_t)(part->offset + written));
+#endif
+
+        if (ret <= 0)
+        {
+            return -1;
+        }
+    }
+
+    storeData(g_writer.stream, part->offset, part->data, part->len);
+    return 0;
+}
+
+static void *fileWriter(void *args)
+{
+    struct file_write *part;
+    int ret;
+
+    pthread_mutex_lock(&g_writer.lock);
+
+    while (g_writer.head != NULL || !g_writer.stop)
+    {
+        if ((part = g_writer.head) == NULL)
+        {
+            pthread_cond_wait(&g_writer.cond, &g_writer.lock);
+            continue;
+        }
+
+        if ((g_writer.head = part->next) == NULL)
+        {
+            g_writer.tail = NULL;
+        }
+
+        pthread_mutex_unlock(&g_writer.lock);
+        ret = writeFilePart(part);
+        pthread_mutex_lock(&g_writer.lock);
+
+        if (ret < 0)
+        {
+            LOG(LERROR, "Cannot write to file %s.\n", part->path);
+            addFailedWrite(part->ohfi);
+        }
+
+        g_writer.queued -= part->len;
+        pthread_cond_broadcast(&g_writer.cond);
+        free(part->buffer);
+        free(part->path);
+        free(part);
+    }
+
+    pthread_mutex_unlock(&g_writer.lock);
+    closeWriteFile();
+    return NULL;
+}
+
+/**
+ * Writes len bytes of data to path at offset once the writes queued before it are done.
+ * buffer is freed after that, even if queuing fails.
+ */
+int queueFileWrite(int ohfi, const char *path, uint64_t offset, unsigned char *buffer, const unsigned char *data,
+                   size_t len)
+{
+    struct file_write *part = malloc(sizeof(struct file_write));
+
+    if (part == NULL)
+    {
+        free(buffer);
+        return -1;
+    }
+
+    part->ohfi = ohfi;
+    part->path = strdup(path);
+    part->offset = offset;
+    part->buffer = buffer;
+    part->data = data;
+    part->len = len;
+    part->next = NULL;
+    pthread_mutex_lock(&g_writer.lock);
+
+    while (g_writer.stop)   // wait for a finish to be done
+    {
+        pthread_cond_wait(&g_writer.cond, &g_writer.lock);
+    }
+
+    if (!g_writer.running)
+    {
+        if (pthread_create(&g_writer.thread, NULL, fileWriter, NULL) != 0)
+        {
+            pthread_mutex_unlock(&g_writer.lock);
+            LOG(LERROR, "Cannot start file writer.\n");
+            free(part->path);
+            free(part);
+            free(buffer);
+            return -1;
+        }
+
+        g_writer.running = 1;
+    }
+
+    // bound the memory held by parts not yet on disk
+    while (g_writer.queued > 0 && g_writer.queued + len > WRITE_BEHIND_LIMIT)
+    {
+        pthread_cond_wait(&g_writer.cond, &g_writer.lock);
+    }
+
+    if (g_writer.tail == NULL)
+    {
+        g_writer.head = part;
+    }
+    else
+    {
+        g_writer.tail->next = part;
+    }
+
+    g_writer.tail = part;
+    g_writer.queued += len;
+    pthread_cond_broadcast(&g_writer.cond);
+    pthread_mutex_unlock(&g_writer.lock);
+    return 0;
+}
+
+/**
+ * Writes out everything queued and syncs and closes the file. Has to be
+ * called before the files being written are read, moved or deleted.
+ */
+void finishFileWrites(void)
+{
+    pthread_mutex_lock(&g_writer.lock);
+
+    while (g_writer.stop)
+    {
+        pthread_cond_wait(&g_writer.cond, &g_writer.lock);
+    }
+
+    if (!g_writer.running)
+    {
+        pthread_mutex_unlock(&g_writer.lock);
+        return;
+    }
+
+    g_writer.stop = 1;
+    pthread_cond_broadcast(&g_writer.cond);
+    pthread_mutex_unlock(&g_writer.lock);
+    pthread_join(g_writer.thread, NULL);
+    pthread_mutex_lock(&g_writer.lock);
+    g_writer.running = 0;
+    g_writer.stop = 0;
+    pthread_cond_broadcast(&g_writer.cond);
+    pthread_mutex_unlock(&g_writer.lock);
+}
+
+/**
+ * Tells whether a queued write to the file of an OHFI failed since this
+ * was last asked about it. Writes still queued are not waited for.
+ *
+ * @param ohfi the object
+ * @return nonzero if a write failed
+ */
+int takeFileWriteError(int ohfi)
+{
+    int found = 0;
+    int i;
+
+    pthread_mutex_lock(&g_writer.lock);
+
+    for (i = 0; i < g_writer.num_failed; i++)
+    {
+        if (g_writer.failed[i] == ohfi)
+        {
+            g_writer.failed[i] = g_writer.failed[--g_writer.num_failed];
+            found = 1;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&g_writer.lock);
+    return found;
+}
+
+// Deleted objects are moved into a hidden directory next to the rest of their
+// category in one rename, so the Vita gets its answer right away, and are
+// removed from there on a thread of their own. Whatever is still in there
+// after OpenCMA was stopped is removed the next time it starts.
+#define TRASH_DIRECTORY     ".trash"
+#define TRASH_NICE          10  // how much less CPU and disk time the thread gets
+
+struct trash_entry
+{
+    char *path;
+    struct trash_entry *next;
+};
+
+static struct
+{
+    pthread_mutex_t lock;
+    int running;
+    unsigned int count; // makes the names in the trash and incoming folders unique
+    struct trash_entry *head;
+    struct trash_entry *tail;
+} g_trash = {PTHREAD_MUTEX_INITIALIZER};
+
+static void *trashRemover(void *args)
+{
+    struct trash_entry *entry;
+
+#ifdef __linux__
+    // on Linux the priority is per thread
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), TRASH_NICE);
+#endif
+    pthread_mutex_lock(&g_trash.lock);
+
+    while ((entry = g_trash.head) != NULL)
+    {
+        if ((g_trash.head = entry->next) == NULL)
+        {
+            g_trash.tail = NULL;
+        }
+
+        pthread_mutex_unlock(&g_trash.lock);
+        deleteAll(entry->path);
+        LOG(LDEBUG, "Removed %s.\n", entry->path);
+        free(entry->path);
+        free(entry);
+        pthread_mutex_lock(&g_trash.lock);
+    }
+
+    g_trash.running = 0;
+    pthread_mutex_unlock(&g_trash.lock);
+    return NULL;
+}
+
+// takes ownership of path
+static void queueTrash(char *path)
+{
+    struct trash_entry *entry;
+    pthread_t thread;
+
+    if ((entry = malloc(sizeof(struct trash_entry))) == NULL)
+    {
+        deleteAll(path);
+        free(path);
+        return;
+    }
+
+    entry->path = path;
+    entry->next = NULL;
+    pthread_mutex_lock(&g_trash.lock);
+
+    if (g_trash.tail)
+    {
+        g_trash.tail->next = entry;
+    }
+    else
+    {
+        g_trash.head = entry;
+    }
+
+    g_trash.tail = entry;
+
+    if (!g_trash.running)
+    {
+        if (pthread_create(&thread, NULL, trashRemover, NULL) != 0)
+        {
+            pthread_mutex_unlock(&g_trash.lock);
+            LOG(LERROR, "Cannot create thread to remove deleted objects, removing them now.\n");
+            trashRemover(NULL);
+            return;
+        }
+
+        pthread_detach(thread);
+        g_trash.running = 1;
+    }
+
+    pthread_mutex_unlock(&g_trash.lock);
+}
+
+// name in the category folder path is in, which is on the same file system, or NULL
+// if path is not under one of ours
+static char *categoryDirectory(const char *path, const char *name)
+{
+    const char *bases[] = {g_paths.photosPath, g_paths.videosPath, g_paths.musicPath, g_paths.appsPath,
+#ifndef NO_PACKAGE_INSTALLER
+                           g_paths.packagesPath,
+#endif
+                          };
+    char *dir;
+    size_t len;
+    int i;
+
+    for (i = 0; i < sizeof(bases) / sizeof(bases[0]); i++)
+    {
+        len = bases[i] == NULL ? 0 : strlen(bases[i]);
+
+        if (len > 0 && strncmp(path, bases[i], len) == 0 && (path[len] == '/' || path[len] == '\\'))
+        {
+            asprintf(&dir, "%s/%s", bases[i], name);
+            return dir;
+        }
+    }
+
+    return NULL;
+}
+
+// moves path into the trash without removing it yet, returns its name there
+static char *moveToTrash(const char *path)
+{
+    char *trash;
+    char *dest;
+    unsigned int count;
+
+    if ((trash = categoryDirectory(path, TRASH_DIRECTORY)) == NULL)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&g_trash.lock);
+    count = g_trash.count++;
+    pthread_mutex_unlock(&g_trash.lock);
+    createNewDirectory(trash);
+    asprintf(&dest, "%s/%lx-%x", trash, (unsigned long)time(NULL), count);
+    free(trash);
+
+    if (move(path, dest) < 0)
+    {
+        free(dest);
+        return NULL;
+    }
+
+    return dest;
+}
+
+/**
+ * Deletes a file or a folder and everything in it. It is gone from path
+ * when this returns, but its space is given back in the background.
+ *
+ * @param path what to delete
+ */
+void trashEntry(const char *path)
+{
+    char *dest;
+
+    if ((dest = moveToTrash(path)) != NULL)
+    {
+        queueTrash(dest);
+        return;
+    }
+
+    // not somewhere we can move it away from
+    deleteAll(path);
+}
+
+// moves src to dest, whatever was at dest is only deleted once src is in its place
+int replaceEntry(const char *src, const char *dest)
+{
+    char *old;
+
+    if (!fileExists(dest))
+    {
+        return move(src, dest);
+    }
+
+#ifndef _WIN32
+
+    // a file replaces a file in one step
+    if (move(src, dest) == 0)
+    {
+        return 0;
+    }
+
+#endif
+
+    if ((old = moveToTrash(dest)) == NULL)
+    {
+        return -1;
+    }
+
+    if (move(src, dest) < 0)
+    {
+        move(old, dest);
+        free(old);
+        return -1;
+    }
+
+    queueTrash(old);
+    return 0;
+}
+
+// Objects are received under a name of their own in a hidden folder of their
+// category and moved into place with replaceEntry() once they are complete, so
+// an object is never half there and nothing that was there before is touched.
+#define INCOMING_DIRECTORY  ".incoming"
+
+/**
+ * Creates an empty file or folder to receive an object into.
+ *
+ * @param path where the object will be once it is complete
+ * @param folder nonzero to create a folder
+ * @param p_fd for a file, filled with the file opened for writing
+ * @return the path created, to be freed, or NULL on error
+ */
+char *createIncomingEntry(const char *path, int folder, int *p_fd)
+{
+    char *incoming;
+    char *dest;
+    unsigned int count;
+    int ret;
+
+    if ((incoming = categoryDirectory(path, INCOMING_DIRECTORY)) == NULL)
+    {
+        LOG(LERROR, "%s is not in a folder we share.\n", path);
+        return NULL;
+    }
+
+    createNewDirectory(incoming);
+
+    do
+    {
+        pthread_mutex_lock(&g_trash.lock);
+        count = g_trash.count++;
+        pthread_mutex_unlock(&g_trash.lock);
+        asprintf(&dest, "%s/%lx-%x", incoming, (unsigned long)time(NULL), count);
+
+        // only ever something we created ourselves
+        if (folder)
+        {
+#ifdef _WIN32
+            ret = CreateDirectory(dest, NULL) ? 0 : -1;
+            errno = ret < 0 && GetLastError() == ERROR_ALREADY_EXISTS ? EEXIST : errno;
+#else
+            ret = mkdir(dest, S_IRWXU);
+#endif
+        }
+        else
+        {
+            ret = *p_fd = open(dest, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0777);
+        }
+
+        if (ret < 0)
+        {
+            free(dest);
+            dest = NULL;
+        }
+    }
+    while (dest == NULL && errno == EEXIST);
+
+    free(incoming);
+    return dest;
+}
+
+/**
+ * Removes what was left in the trash and half received the last time
+ * OpenCMA ran, call once the paths are known.
+ */
+void emptyTrash(void)
+{
+    const char *bases[] = {g_paths.photosPath, g_paths.videosPath, g_paths.musicPath, g_paths.appsPath,
+#ifndef NO_PACKAGE_INSTALLER
+                           g_paths.packagesPath,
+#endif
+                          };
+    char *trash;
+    int i;
+
+    for (i = 0; i < sizeof(bases) / sizeof(bases[0]); i++)
+    {
+        if (bases[i] == NULL)
+        {
+            continue;
+        }
+
+        asprintf(&trash, "%s/%s", bases[i], TRASH_DIRECTORY);
+
+        if (fileExists(trash))
+        {
+            LOG(LVERBOSE, "Removing deleted objects left in %s.\n", trash);
+            queueTrash(trash);
+        }
+        else
+        {
+            free(trash);
+        }
+
+        asprintf(&trash, "%s/%s", bases[i], INCOMING_DIRECTORY);
+
+        if (fileExists(trash))
+        {
+            LOG(LVERBOSE, "Removing objects not completely received in %s.\n", trash);
+            queueTrash(trash);
+        }
+        else
+        {
+            free(trash);
+        }
+    }
+}
+
+// the local file a URL is mapped to, it is named after the last part of the URL
+char *urlToPath(const char *url)
+{
+    char *name;
+    size_t len;
+    url = strrchr(url, '/');
+
+    if (url == NULL)
+    {
+        LOG(LERROR, "URL is malformed.\n");
+        return NULL;
+    }
+
+    url++; // get request name
+    len = strcspn(url, "?");
+
+    if (asprintf(&name, "%s/%.*s", g_paths.urlPath, (int)len, url) < 0)
+    {
+        LOG(LERROR, "Out of memory\n");
+        return NULL;
+    }
+
+    return name;
+}
+
+/**
+ * Opens the local file a URL is mapped to.
+ *
+ * @param url the URL the Vita asked for
+ * @param p_size where the size of the file is stored
+ * @return a descriptor to read the file from or -1 if there is no such file
+ */
+int openURL(const char *url, uint64_t *p_size)
+{
+    struct stat statbuf;
+    char *name;
+    int fd;
+
+    if ((name = urlToPath(url)) == NULL)
+    {
+        return -1;
+    }
+
+    if ((fd = open(name, O_RDONLY | O_BINARY)) >= 0 && (fstat(fd, &statbuf) < 0 || !S_ISREG(statbuf.st_mode)))
+    {
+        close(fd);
+        fd = -1;
+    }
+
+    LOG(LDEBUG, "Opening %s returned %d.\n", name, fd);
+    free(name);
+
+    if (fd >= 0)
+    {
+        *p_size = statbuf.st_size;
+    }
+
+    return fd;
+}
+
+/**
+ * Gets the size of the local file a URL is mapped to without reading it.
+ *
+ * @param url the URL the Vita asked for
+ * @param p_size where the size of the file is stored
+ * @return zero if there is such a file
+ */
+int statURL(const char *url, uint64_t *p_size)
+{
+    struct stat statbuf;
+    char *name;
+    int ret;
+
+    if ((name = urlToPath(url)) == NULL)
+    {
+        return -1;
+    }
+
+    ret = stat(name, &statbuf) == 0 && S_ISREG(statbuf.st_mode) ? 0 : -1;
+    LOG(LDEBUG, "Checking %s returned %d.\n", name, ret);
+    free(name);
+
+    if (ret == 0)
+    {
+        *p_size = statbuf.st_size;
+    }
+
+    return ret;
+}
+
+/*
+ * Transfer profiles are stored one per line as "<id> <block size> <throughput>"
+ * where id is the transport and identification of the device.
+ */
+int readTransferProfile(const char *path, const char *id, vita_transfer_profile_t *profile)
+{
+    FILE *file = fopen(path, "r");
+    char line[256];
+    char name[128];
+    unsigned int block_size, throughput;
+
+    if (file == NULL)
+    {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        if (sscanf(line, "%127s %u %u", name, &block_size, &throughput) == 3 && strcmp(name, id) == 0)
+        {
+            profile->block_size = block_size;
+            profile->throughput = throughput;
+            fclose(file);
+            return 0;
+        }
+    }
+
+    fclose(file);
+    return -1;
+}
+
+int writeTransferProfile(const char *path, const char *id, const vita_transfer_profile_t *profile)
+{
+    FILE *file;
+    FILE *tmp;
+    char *tmppath;
+    char line[256];
+    char name[128];
+
+    if (asprintf(&tmppath, "%s.tmp", path) < 0)
+    {
+        LOG(LERROR, "Out of memory\n");
+        return -1;
+    }
+
+    if ((tmp = fopen(tmppath, "w")) == NULL)
+    {
+        LOG(LERROR, "Cannot open %s for writing.\n", tmppath);
+        free(tmppath);
+        return -1;
+    }
+
+    // keep the profiles of other devices
+    if ((file = fopen(path, "r")) != NULL)
+    {
+        while (fgets(line, sizeof(line), file) != NULL)
+        {
+            if (sscanf(line, "%127s", name) == 1 && strcmp(name, id) != 0)
+            {
+                fputs(line, tmp);
+            }
+        }
+
+        fclose(file);
+    }
+
+    fprintf(tmp, "%s %u %u\n", id, profile->block_size, profile->throughput);
+#ifdef _WIN32
+    remove(path); // MoveFile() does not replace files
+#endif
+
+    if (fclose(tmp) != 0 || move(tmppath, path) < 0)
+    {
+        LOG(LERROR, "Cannot write transfer profile to %s.\n", path);
+        remove(tmppath);
+        free(tmppath);
+        return -1;
+    }
+
+    free(tmppath);
+    return 0;
 }
 
 capability_info_t *generate_pc_capability_info(void)
@@ -17,9 +17,14 @@
 //  along with this program.  If not, see <http://www.gnu.org/licenses/>.
 //
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "ptp.h"
+#include "device-flags.h"
 #define _EXPORTING
 #include "vitamtp.h"
 
@@ -473,6 +478,37 @@ VITAMTP_EXPORT uint16_t VitaMTP_SendPartOfObjectInit(vita_device_t *device, uint
     return ret;
 }
 
+struct vita_part_data
+{
+    unsigned char size[sizeof(uint64_t)];
+    unsigned long sent;
+    const unsigned char *data;
+    uint64_t len;
+};
+
+// the size and the data go out as one data phase without being copied together
+static uint16_t VitaMTP_Part_Getfunc(PTPParams *params, void *priv, unsigned long wantlen, unsigned char *data,
+                                     unsigned long *gotlen)
+{
+    struct vita_part_data *part = (struct vita_part_data *)priv;
+    unsigned long curread = 0;
+    unsigned long len;
+
+    if (part->sent < sizeof(part->size))
+    {
+        curread = sizeof(part->size) - part->sent < wantlen ? sizeof(part->size) - part->sent : wantlen;
+        memcpy(data, part->size + part->sent, curread);
+        part->sent += curread;
+    }
+
+    len = part->len - (part->sent - sizeof(part->size));
+    len = len < wantlen - curread ? len : wantlen - curread;
+    memcpy(data + curread, part->data + (part->sent - sizeof(part->size)), len);
+    part->sent += len;
+    *gotlen = curread + len;
+    return PTP_RC_OK;
+}
+
 /**
  * Sends a part of the object. You should first call
  * VitaMTP_SendPartOfObjectInit() to find out what to send.
@@ -481,23 +517,26 @@ VITAMTP_EXPORT uint16_t VitaMTP_SendPartOfObjectInit(vita_device_t *device, uint
  * @param event_id the unique ID sent by the Vita with the event.
  * @param object_data an array containing the data to send.
  * @param object_len the size of that data to send.
- *  Currently, this cannot be larger than sizeof(uint32_t)
+ *  It goes out in one data phase with its 8 byte size in front, so
+ *  together they cannot be larger than UINT32_MAX.
  * @return the PTP result code that the Vita returns.
  * @see VitaMTP_SendPartOfObjectInit()
  */
 VITAMTP_EXPORT uint16_t VitaMTP_SendPartOfObject(vita_device_t *device, uint32_t event_id, unsigned char *object_data,
                                   uint64_t object_len)
 {
-    unsigned char *data;
-    unsigned long len = object_len + sizeof(uint64_t);
-    data = malloc(len);
-    ((uint64_t *)data)[0] = object_len;
-    memcpy(data + sizeof(uint64_t), object_data, object_len);
+    struct vita_part_data part = {{0}, 0, object_data, object_len};
+    PTPDataHandler handler = {VitaMTP_Part_Getfunc, NULL, &part, NULL};
+    PTPContainer ptp;
 
-    uint16_t ret = VitaMTP_SendData(device, event_id, PTP_OC_VITA_SendPartOfObject, data,
-                                    (int)len); // TODO: Support huge part of file
-    free(data);
-    return ret;
+    memcpy(part.size, &object_len, sizeof(uint64_t));
+    PTP_CNT_INIT(ptp);
+    ptp.Code = PTP_OC_VITA_SendPartOfObject;
+    ptp.Nparam = 1;
+    ptp.Param1 = event_id;
+
+    return ptp_transaction_new(VitaMTP_Get_PTP_Params(device), &ptp, PTP_DP_SENDDATA,
+                               (unsigned int)(object_len + sizeof(uint64_t)), &handler);
 }
 
 /**
@@ -535,14 +574,68 @@ VITAMTP_EXPORT uint16_t VitaMTP_OperateObject(vita_device_t *device, uint32_t ev
 VITAMTP_EXPORT uint16_t VitaMTP_GetPartOfObject(vita_device_t *device, uint32_t event_id, send_part_init_t *init, unsigned char **data)
 {
     unsigned char *_data = NULL;
-    uint16_t ret = VitaMTP_GetData(device, event_id, PTP_OC_VITA_GetPartOfObject, (unsigned char **)&_data, NULL);
-    memcpy(init, _data, sizeof(send_part_init_t));
+    uint16_t ret = VitaMTP_GetPartOfObjectBuffer(device, event_id, init, &_data);
+
+    if (ret != PTP_RC_OK)
+    {
+        return ret;
+    }
+
     *data = malloc(init->size);
     memcpy(*data, _data + sizeof(send_part_init_t), init->size);
     free(_data);
     return ret;
 }
 
+/**
+ * Gets a part of the object from the device, leaving the data in the
+ * buffer it was received in instead of copying it out.
+ *
+ * @param device a pointer to the device.
+ * @param event_id the unique ID sent by the Vita with the event.
+ * @param init a send_part_init_t struct to fill with object's info.
+ * @param p_buffer set to the received buffer (dynamically allocated).
+ *  The data starts sizeof(send_part_init_t) bytes into it.
+ * @return the PTP result code that the Vita returns.
+ * @see VitaMTP_GetPartOfObject()
+ */
+VITAMTP_EXPORT uint16_t VitaMTP_GetPartOfObjectBuffer(vita_device_t *device, uint32_t event_id, send_part_init_t *init,
+        unsigned char **p_buffer)
+{
+    unsigned int len = 0;
+    uint16_t ret;
+
+    *p_buffer = NULL;
+    ret = VitaMTP_GetData(device, event_id, PTP_OC_VITA_GetPartOfObject, p_buffer, &len);
+
+    if (ret != PTP_RC_OK)
+    {
+        free(*p_buffer);
+        *p_buffer = NULL;
+        return ret;
+    }
+
+    if (len < sizeof(send_part_init_t))
+    {
+        VitaMTP_Log(VitaMTP_ERROR, "part of object is too short\n");
+        free(*p_buffer);
+        *p_buffer = NULL;
+        return PTP_RC_GeneralError;
+    }
+
+    memcpy(init, *p_buffer, sizeof(send_part_init_t));
+
+    if (init->size > len - sizeof(send_part_init_t))
+    {
+        VitaMTP_Log(VitaMTP_ERROR, "part of object is missing data\n");
+        free(*p_buffer);
+        *p_buffer = NULL;
+        return PTP_RC_GeneralError;
+    }
+
+    return ret;
+}
+
 /**
  * Sends the size of the current storage device on the PC.
  *
@@ -650,16 +743,28 @@ VITAMTP_EXPORT uint16_t VitaMTP_SendObjectMetadataItems(vita_device_t *device, u
     return ret;
 }
 
+void vita_cancel_event(PTPParams *params, uint32_t event_id);
+
 /**
- * Not currently implemented, in the future, should be able to
- * cancel the event specified.
+ * Cancels the event specified. Streaming transfers started for the
+ * event stop within one block and return PTP_ERROR_CANCEL.
+ * This does not talk to the Vita, so it is safe to call while a
+ * transfer for the event is running on another thread.
  *
  * @param device a pointer to the device.
  * @param cancel_event_id the unique ID to the event to cancel.
+ * @see VitaMTP_Is_Task_Cancelled()
  */
 VITAMTP_EXPORT uint16_t VitaMTP_CancelTask(vita_device_t *device, uint32_t cancel_event_id)
 {
-    // NOT IMPLEMENTED
+    PTPParams *params = VitaMTP_Get_PTP_Params(device);
+
+    if (params->cancelled == NULL)
+    {
+        return PTP_RC_OperationNotSupported;
+    }
+
+    vita_cancel_event(params, cancel_event_id);
     return PTP_RC_OK;
 }
 
@@ -683,20 +788,350 @@ VITAMTP_EXPORT uint16_t VitaMTP_KeepAlive(vita_device_t *device, uint32_t event_
     return ptp_transaction(params, &ptp, PTP_DP_NODATA, 0, NULL, 0);
 }
 /**
- * Sends a MTP object to the device. Size of the object and other
- * information is found in the metadata.
+ * Passes data phase reads and writes on to the user's callbacks.
+ */
+struct vita_object_callback
+{
+    vita_object_read_callback_t read;
+    vita_object_write_callback_t write;
+    void *priv;
+    vita_device_t *device;
+    uint32_t event_id; // cancellation token, checked before every block
+};
+
+static uint16_t VitaMTP_Object_Getfunc(PTPParams *params, void *priv, unsigned long wantlen, unsigned char *data,
+                                       unsigned long *gotlen)
+{
+    struct vita_object_callback *callback = (struct vita_object_callback *)priv;
+
+    if (VitaMTP_Is_Task_Cancelled(callback->device, callback->event_id))
+    {
+        VitaMTP_Log(VitaMTP_INFO, "event %d cancelled, aborting transfer\n", callback->event_id);
+        return PTP_ERROR_CANCEL;
+    }
+
+    if (callback->read(callback->priv, data, wantlen, gotlen) != 0)
+    {
+        VitaMTP_Log(VitaMTP_ERROR, "read callback failed, aborting transfer\n");
+        return PTP_RC_GeneralError;
+    }
+
+    return PTP_RC_OK;
+}
+
+static uint16_t VitaMTP_Object_Putfunc(PTPParams *params, void *priv, unsigned long sendlen, unsigned char *data,
+                                       unsigned long *putlen)
+{
+    struct vita_object_callback *callback = (struct vita_object_callback *)priv;
+
+    if (VitaMTP_Is_Task_Cancelled(callback->device, callback->event_id))
+    {
+        VitaMTP_Log(VitaMTP_INFO, "event %d cancelled, aborting transfer\n", callback->event_id);
+        return PTP_ERROR_CANCEL;
+    }
+
+    if (callback->write(callback->priv, data, sendlen) != 0)
+    {
+        VitaMTP_Log(VitaMTP_ERROR, "write callback failed, aborting transfer\n");
+        return PTP_RC_GeneralError;
+    }
+
+    *putlen = sendlen;
+    return PTP_RC_OK;
+}
+
+static uint16_t VitaMTP_Object_Progress(PTPParams *params, void *priv, unsigned long sentlen)
+{
+    struct vita_object_callback *callback = (struct vita_object_callback *)priv;
+
+    if (VitaMTP_Is_Task_Cancelled(callback->device, callback->event_id))
+    {
+        VitaMTP_Log(VitaMTP_INFO, "event %d cancelled, aborting transfer\n", callback->event_id);
+        return PTP_ERROR_CANCEL;
+    }
+
+    return PTP_RC_OK;
+}
+
+#define VITA_READAHEAD_BUFFERS 4
+#define VITA_READAHEAD_BUFSIZE 0x100000
+
+/**
+ * Reads a file on its own thread ahead of the transport, so the disk
+ * and the link are busy at the same time. The thread is only started
+ * once the transport asks for data through getfunc, transports that
+ * send straight from the file never start it.
+ */
+struct vita_readahead
+{
+    PTPDataFile *file;
+    uint64_t remaining; // not yet read from the file
+    int started;
+    int stop;
+    int error;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned char *buffers[VITA_READAHEAD_BUFFERS];
+    unsigned long lengths[VITA_READAHEAD_BUFFERS];
+    int head; // buffer being sent
+    int count; // buffers filled and not yet sent
+    unsigned long pos; // in the head buffer
+};
+
+static void *VitaMTP_ReadAhead_Thread(void *args)
+{
+    struct vita_readahead *ra = (struct vita_readahead *)args;
+    uint64_t offset = ra->file->offset;
+    unsigned long len;
+    unsigned long curread;
+    ssize_t got = 0;
+    int slot;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(ra->file->fd, (off_t)offset, (off_t)ra->remaining, POSIX_FADV_SEQUENTIAL);
+#endif
+    pthread_mutex_lock(&ra->lock);
+
+    while (!ra->stop && ra->remaining > 0)
+    {
+        if (ra->count == VITA_READAHEAD_BUFFERS)
+        {
+            pthread_cond_wait(&ra->cond, &ra->lock);
+            continue;
+        }
+
+        // the sender does not touch this buffer until count covers it
+        slot = (ra->head + ra->count) % VITA_READAHEAD_BUFFERS;
+        len = ra->remaining < VITA_READAHEAD_BUFSIZE ? (unsigned long)ra->remaining : VITA_READAHEAD_BUFSIZE;
+        pthread_mutex_unlock(&ra->lock);
+
+        for (curread = 0; curread < len; curread += got)
+        {
+#ifdef _WIN32
+            if (lseek(ra->file->fd, (off_t)(offset + curread), SEEK_SET) == -1)
+            {
+                got = -1;
+                break;
+            }
+
+            got = read(ra->file->fd, ra->buffers[slot] + curread, len - curread);
+#else
+            got = pread(ra->file->fd, ra->buffers[slot] + curread, len - curread, (off_t)(offset + curread));
+#endif
+
+            if (got <= 0)
+            {
+                break;
+            }
+        }
+
+        pthread_mutex_lock(&ra->lock);
+
+        if (got < 0)
+        {
+            VitaMTP_Log(VitaMTP_ERROR, "error reading file at offset %llu\n", (unsigned long long)(offset + curread));
+            ra->error = 1;
+            break;
+        }
+
+        if (curread > 0)
+        {
+            ra->lengths[slot] = curread;
+            ra->count++;
+        }
+
+        // a short file sends what it has, like a plain read would
+        ra->remaining = curread < len ? 0 : ra->remaining - len;
+        offset += curread;
+        pthread_cond_broadcast(&ra->cond);
+    }
+
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+    return NULL;
+}
+
+static int VitaMTP_ReadAhead_Start(struct vita_readahead *ra)
+{
+    int i;
+
+    for (i = 0; i < VITA_READAHEAD_BUFFERS; i++)
+    {
+        if ((ra->buffers[i] = malloc(VITA_READAHEAD_BUFSIZE)) == NULL)
+        {
+            return -1;
+        }
+    }
+
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+
+    if (pthread_create(&ra->thread, NULL, VitaMTP_ReadAhead_Thread, ra) != 0)
+    {
+        pthread_cond_destroy(&ra->cond);
+        pthread_mutex_destroy(&ra->lock);
+        return -1;
+    }
+
+    ra->started = 1;
+    return 0;
+}
+
+static uint16_t VitaMTP_ReadAhead_Getfunc(PTPParams *params, void *priv, unsigned long wantlen, unsigned char *data,
+        unsigned long *gotlen)
+{
+    struct vita_readahead *ra = (struct vita_readahead *)priv;
+    PTPDataFile *file = ra->file;
+    unsigned long curread = 0;
+    unsigned long len;
+    unsigned char *buffer;
+    int error = 0;
+
+    if (file->prefixlen)
+    {
+        curread = wantlen < file->prefixlen ? wantlen : file->prefixlen;
+        memcpy(data, file->prefix, curread);
+        file->prefix += curread;
+        file->prefixlen -= curread;
+    }
+
+    if (curread < wantlen && !ra->started && VitaMTP_ReadAhead_Start(ra) < 0)
+    {
+        VitaMTP_Log(VitaMTP_ERROR, "cannot start reading ahead\n");
+        return PTP_RC_GeneralError;
+    }
+
+    while (curread < wantlen)
+    {
+        pthread_mutex_lock(&ra->lock);
+
+        while (ra->count == 0 && !ra->error && ra->remaining > 0)
+        {
+            pthread_cond_wait(&ra->cond, &ra->lock);
+        }
+
+        if (ra->count == 0)
+        {
+            error = ra->error;
+            pthread_mutex_unlock(&ra->lock);
+            break;
+        }
+
+        buffer = ra->buffers[ra->head] + ra->pos;
+        len = ra->lengths[ra->head] - ra->pos;
+        pthread_mutex_unlock(&ra->lock);
+
+        // copied unlocked, the reader never touches a filled buffer
+        len = len < wantlen - curread ? len : wantlen - curread;
+        memcpy(data + curread, buffer, len);
+        curread += len;
+        file->offset += len;
+
+        pthread_mutex_lock(&ra->lock);
+        ra->pos += len;
+
+        if (ra->pos == ra->lengths[ra->head])
+        {
+            ra->pos = 0;
+            ra->head = (ra->head + 1) % VITA_READAHEAD_BUFFERS;
+            ra->count--;
+            pthread_cond_broadcast(&ra->cond);
+        }
+
+        pthread_mutex_unlock(&ra->lock);
+    }
+
+    if (error)
+    {
+        return PTP_RC_GeneralError;
+    }
+
+    *gotlen = curread;
+    return file->progress ? file->progress(params, file->priv, curread) : PTP_RC_OK;
+}
+
+/**
+ * Sets up handler to send len bytes of file with read ahead. Call
+ * VitaMTP_ReadAhead_Stop() once the data phase is over.
+ */
+static void VitaMTP_ReadAhead_Init(struct vita_readahead *ra, PTPDataHandler *handler, PTPDataFile *file, uint64_t len)
+{
+    memset(ra, 0, sizeof(struct vita_readahead));
+    ra->file = file;
+    ra->remaining = len;
+    ptp_init_file_handler(handler, file);
+    handler->getfunc = VitaMTP_ReadAhead_Getfunc;
+    handler->priv = ra;
+}
+
+static void VitaMTP_ReadAhead_Stop(struct vita_readahead *ra)
+{
+    int i;
+
+    if (ra->started)
+    {
+        pthread_mutex_lock(&ra->lock);
+        ra->stop = 1;
+        pthread_cond_broadcast(&ra->cond);
+        pthread_mutex_unlock(&ra->lock);
+        pthread_join(ra->thread, NULL);
+        pthread_cond_destroy(&ra->cond);
+        pthread_mutex_destroy(&ra->lock);
+    }
+
+    for (i = 0; i < VITA_READAHEAD_BUFFERS; i++)
+    {
+        free(ra->buffers[i]);
+    }
+}
+
+static int VitaMTP_FD_Read(void *priv, unsigned char *data, unsigned long wantlen, unsigned long *gotlen)
+{
+    int fd = *(int *)priv;
+    ssize_t ret;
+
+    for (*gotlen = 0; *gotlen < wantlen; *gotlen += ret)
+    {
+        if ((ret = read(fd, data + *gotlen, wantlen - *gotlen)) <= 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int VitaMTP_FD_Write(void *priv, const unsigned char *data, unsigned long len)
+{
+    int fd = *(int *)priv;
+    ssize_t ret;
+    unsigned long written;
+
+    for (written = 0; written < len; written += ret)
+    {
+        if ((ret = write(fd, data + written, len - written)) <= 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Sends the object info for a MTP object and reserves a handle
+ * for it on the device.
  *
  * @param device a pointer to the device.
  * @param p_parenthandle a pointer to the parent handle.
  * @param p_handle a pointer to the handle.
  * @param meta the metadata to describe the object.
- * @param data the object data to send.
  */
-VITAMTP_EXPORT uint16_t VitaMTP_SendObject(vita_device_t *device, uint32_t *p_parenthandle, uint32_t *p_handle, metadata_t *meta,
-                            unsigned char *data)
+static uint16_t VitaMTP_SendObjectInfo(vita_device_t *device, uint32_t *p_parenthandle, uint32_t *p_handle,
+                                       metadata_t *meta)
 {
     uint32_t store = VITA_STORAGE_ID;
-    uint16_t ret;
     PTPObjectInfo objectinfo;
     memset(&objectinfo, 0x0, sizeof(PTPObjectInfo));
 
@@ -708,7 +1143,6 @@ VITAMTP_EXPORT uint16_t VitaMTP_SendObject(vita_device_t *device, uint32_t *p_pa
     {
         objectinfo.ObjectFormat = PTP_OFC_Association; // 0x3001
         objectinfo.AssociationType = PTP_AT_GenericFolder;
-        ret = ptp_sendobjectinfo(VitaMTP_Get_PTP_Params(device), &store, p_parenthandle, p_handle, &objectinfo);
     }
     else if (meta->dataType & File)
     {
@@ -724,88 +1158,511 @@ VITAMTP_EXPORT uint16_t VitaMTP_SendObject(vita_device_t *device, uint32_t *p_pa
         objectinfo.ObjectCompressedSize = (uint32_t)meta->size;
         objectinfo.CaptureDate = meta->dateTimeCreated;
         objectinfo.ModificationDate = meta->dateTimeCreated;
-        ret = ptp_sendobjectinfo(VitaMTP_Get_PTP_Params(device), &store, p_parenthandle, p_handle, &objectinfo);
-
-        if (ret != PTP_RC_OK)
-        {
-            return ret;
-        }
-
-        ret = ptp_sendobject(VitaMTP_Get_PTP_Params(device), data, (uint32_t)meta->size);
     }
     else
     {
         // unsupported
-        ret = PTP_RC_OperationNotSupported;
+        return PTP_RC_OperationNotSupported;
     }
 
-    return ret;
+    return ptp_sendobjectinfo(VitaMTP_Get_PTP_Params(device), &store, p_parenthandle, p_handle, &objectinfo);
 }
 
 /**
- * Gets a PTP object from the device along with metadata.
- * If object is a handle, *p_data will be a uint32_t array
- * of handles in the directory and *p_len will be the number
- * of handles. If object is a file, *p_data will be a
- * unsigned char* containing the data and *p_len will be
- * the size of the data.
- * meta will contain minimal information. Only name,
- * dataType, size (if file), and handle will be filled.
+ * Sends a MTP object to the device. Size of the object and other
+ * information is found in the metadata.
  *
  * @param device a pointer to the device.
- * @param handle the PTP handle of the object to get.
- * @param meta information about the object, will be incomplete.
- * @param p_data dynamically allocated data.
- * @param p_len size of the data.
+ * @param p_parenthandle a pointer to the parent handle.
+ * @param p_handle a pointer to the handle.
+ * @param meta the metadata to describe the object.
+ * @param data the object data to send.
+ * @see VitaMTP_SendObjectFromCallback()
  */
-VITAMTP_EXPORT uint16_t VitaMTP_GetObject(vita_device_t *device, uint32_t handle, metadata_t *meta, void **p_data,
-                           unsigned int *p_len)
+VITAMTP_EXPORT uint16_t VitaMTP_SendObject(vita_device_t *device, uint32_t *p_parenthandle, uint32_t *p_handle, metadata_t *meta,
+                            unsigned char *data)
 {
-    PTPPropertyValue value;
     uint16_t ret;
 
-    if ((ret = ptp_mtp_getobjectpropvalue(VitaMTP_Get_PTP_Params(device), handle, PTP_OPC_ObjectFormat, &value,
-                                          PTP_DTC_UINT16)) != PTP_RC_OK)
+    if ((ret = VitaMTP_SendObjectInfo(device, p_parenthandle, p_handle, meta)) != PTP_RC_OK || !(meta->dataType & File))
     {
         return ret;
     }
 
-    meta->dataType = value.u16 == PTP_OFC_Association ? Folder : File;
+    return ptp_sendobject(VitaMTP_Get_PTP_Params(device), data, (uint32_t)meta->size);
+}
 
-    if ((ret = ptp_mtp_getobjectpropvalue(VitaMTP_Get_PTP_Params(device), handle, PTP_OPC_ObjectFileName, &value,
-                                          PTP_DTC_STR)) != PTP_RC_OK)
+/**
+ * Sends a MTP object to the device, reading the data in blocks as
+ * it is sent instead of from a buffer holding the whole object.
+ * Size of the object and other information is found in the metadata.
+ *
+ * @param device a pointer to the device.
+ * @param p_parenthandle a pointer to the parent handle.
+ * @param p_handle a pointer to the handle.
+ * @param meta the metadata to describe the object.
+ * @param read_func called for each block to send. Not used for folders.
+ * @param priv passed to read_func.
+ * @param event_id the event the object is sent for. If it is cancelled
+ *  with VitaMTP_CancelTask() the transfer stops with PTP_ERROR_CANCEL.
+ * @return the PTP result code that the Vita returns.
+ */
+VITAMTP_EXPORT uint16_t VitaMTP_SendObjectFromCallback(vita_device_t *device, uint32_t *p_parenthandle, uint32_t *p_handle,
+        metadata_t *meta, vita_object_read_callback_t read_func, void *priv, uint32_t event_id)
+{
+    struct vita_object_callback callback = {read_func, NULL, priv, device, event_id};
+    PTPDataHandler handler = {VitaMTP_Object_Getfunc, NULL, &callback};
+    uint16_t ret;
+
+    if ((ret = VitaMTP_SendObjectInfo(device, p_parenthandle, p_handle, meta)) != PTP_RC_OK || !(meta->dataType & File))
     {
         return ret;
     }
 
-    meta->name = value.str;
+    return ptp_sendobject_from_handler(VitaMTP_Get_PTP_Params(device), &handler, (uint32_t)meta->size);
+}
 
-    // TODO: Make use of date modified and object format
-    //ptp_mtp_getobjectpropvalue ((PTPParams*)device->params, handle, PTP_OPC_DateModified, &value, PTP_DTC_STR);
-    if (meta->dataType & Folder)
+/**
+ * Sends a MTP object to the device, reading the data from a file
+ * descriptor as it is sent. If fd is a regular file, the data is sent
+ * from its current offset and wireless devices get it without it being
+ * copied through user space. The offset of fd is left where it was.
+ * Size of the object and other information is found in the metadata.
+ *
+ * @param device a pointer to the device.
+ * @param p_parenthandle a pointer to the parent handle.
+ * @param p_handle a pointer to the handle.
+ * @param meta the metadata to describe the object.
+ * @param fd file descriptor to read() the data from. Not used for folders.
+ * @param event_id the event the object is sent for, see
+ *  VitaMTP_SendObjectFromCallback().
+ * @return the PTP result code that the Vita returns.
+ */
+VITAMTP_EXPORT uint16_t VitaMTP_SendObjectFromFD(vita_device_t *device, uint32_t *p_parenthandle, uint32_t *p_handle,
+        metadata_t *meta, int fd, uint32_t event_id)
+{
+    struct vita_object_callback callback = {NULL, NULL, NULL, device, event_id};
+    PTPDataFile file = {NULL, 0, fd, 0, VitaMTP_Object_Progress, &callback};
+    PTPDataHandler handler;
+    struct vita_readahead ra;
+    off_t offset;
+    uint16_t ret;
+
+    // pipes and the like are read as they come
+    if ((offset = lseek(fd, 0, SEEK_CUR)) == (off_t)-1)
+    {
+        return VitaMTP_SendObjectFromCallback(device, p_parenthandle, p_handle, meta, VitaMTP_FD_Read, &fd, event_id);
+    }
+
+    if ((ret = VitaMTP_SendObjectInfo(device, p_parenthandle, p_handle, meta)) != PTP_RC_OK || !(meta->dataType & File))
+    {
+        return ret;
+    }
+
+    file.offset = (uint64_t)offset;
+    VitaMTP_ReadAhead_Init(&ra, &handler, &file, meta->size);
+    ret = ptp_sendobject_from_handler(VitaMTP_Get_PTP_Params(device), &handler, (uint32_t)meta->size);
+    VitaMTP_ReadAhead_Stop(&ra);
+    return ret;
+}
+
+/**
+ * Sends a part of the object straight from a file, without reading it
+ * into memory first. Wireless devices get the data without it being
+ * copied through user space. You should first call
+ * VitaMTP_SendPartOfObjectInit() to find out what to send.
+ *
+ * @param device a pointer to the device.
+ * @param event_id the unique ID sent by the Vita with the event.
+ * @param fd a regular file to send the data from.
+ * @param offset where in the file the part starts.
+ * @param len the size of the part, the file must be at least
+ *  offset + len bytes long.
+ * @return the PTP result code that the Vita returns.
+ * @see VitaMTP_SendPartOfObject()
+ */
+VITAMTP_EXPORT uint16_t VitaMTP_SendPartOfObjectFromFD(vita_device_t *device, uint32_t event_id, int fd, uint64_t offset,
+        uint64_t len)
+{
+    struct vita_object_callback callback = {NULL, NULL, NULL, device, event_id};
+    unsigned char size[sizeof(uint64_t)];
+    PTPDataFile file = {size, sizeof(size), fd, offset, VitaMTP_Object_Progress, &callback};
+    PTPDataHandler handler;
+    struct vita_readahead ra;
+    PTPContainer ptp;
+    uint16_t ret;
+
+    memcpy(size, &len, sizeof(uint64_t));
+
+    // small parts are read straight into the transport's buffer, a read
+    // ahead thread only pays off for the large ones
+    if (len > VITA_READAHEAD_BUFFERS * VITA_READAHEAD_BUFSIZE)
+    {
+        VitaMTP_ReadAhead_Init(&ra, &handler, &file, len);
+    }
+    else
+    {
+        memset(&ra, 0, sizeof(struct vita_readahead));
+        ptp_init_file_handler(&handler, &file);
+    }
+
+    PTP_CNT_INIT(ptp);
+    ptp.Code = PTP_OC_VITA_SendPartOfObject;
+    ptp.Nparam = 1;
+    ptp.Param1 = event_id;
+
+    ret = ptp_transaction_new(VitaMTP_Get_PTP_Params(device), &ptp, PTP_DP_SENDDATA, (unsigned int)(len + sizeof(uint64_t)),
+                              &handler);
+    VitaMTP_ReadAhead_Stop(&ra);
+    return ret;
+}
+
+/**
+ * Sends the HTTP content from a URL request straight from a file,
+ * without reading it into memory first.
+ * This should be called immediately after VitaMTP_GetUrl().
+ *
+ * @param device a pointer to the device.
+ * @param event_id the unique ID sent by the Vita with the event.
+ * @param fd a regular file with the content, read from the start.
+ * @param len the size of the content.
+ * @return the PTP result code that the Vita returns.
+ * @see VitaMTP_SendHttpObjectFromURL()
+ */
+VITAMTP_EXPORT uint16_t VitaMTP_SendHttpObjectFromURLFD(vita_device_t *device, uint32_t event_id, int fd, uint64_t len)
+{
+    struct vita_object_callback callback = {NULL, NULL, NULL, device, event_id};
+    unsigned char size[sizeof(uint64_t)];
+    PTPDataFile file = {size, sizeof(size), fd, 0, VitaMTP_Object_Progress, &callback};
+    PTPDataHandler handler;
+    struct vita_readahead ra;
+    PTPContainer ptp;
+    uint16_t ret;
+
+    memcpy(size, &len, sizeof(uint64_t));
+
+    if (len > VITA_READAHEAD_BUFFERS * VITA_READAHEAD_BUFSIZE)
+    {
+        VitaMTP_ReadAhead_Init(&ra, &handler, &file, len);
+    }
+    else
+    {
+        memset(&ra, 0, sizeof(struct vita_readahead));
+        ptp_init_file_handler(&handler, &file);
+    }
+
+    PTP_CNT_INIT(ptp);
+    ptp.Code = PTP_OC_VITA_SendHttpObjectFromURL;
+    ptp.Nparam = 1;
+    ptp.Param1 = event_id;
+
+    ret = ptp_transaction_new(VitaMTP_Get_PTP_Params(device), &ptp, PTP_DP_SENDDATA, (unsigned int)(len + sizeof(uint64_t)),
+                              &handler);
+    VitaMTP_ReadAhead_Stop(&ra);
+    return ret;
+}
+
+/**
+ * Fills an object's metadata from a list of its MTP properties.
+ * Returns -1 if the list is missing any needed property.
+ */
+static int VitaMTP_ObjectInfoFromProps(MTPProperties *props, int nprops, uint32_t handle, metadata_t *meta)
+{
+    MTPProperties *format = NULL;
+    MTPProperties *name = NULL;
+    MTPProperties *size = NULL;
+    int i;
+
+    for (i = 0; i < nprops; i++)
     {
-        uint32_t store = VITA_STORAGE_ID;
-        PTPObjectHandles handles;
+        if (props[i].ObjectHandle != handle)
+        {
+            continue;
+        }
 
-        if ((ret = ptp_getobjecthandles(VitaMTP_Get_PTP_Params(device), store, 0, handle, &handles)) != PTP_RC_OK)
+        switch (props[i].property)
         {
-            return ret;
+            case PTP_OPC_ObjectFormat:
+                format = &props[i];
+                break;
+
+            case PTP_OPC_ObjectFileName:
+                name = &props[i];
+                break;
+
+            case PTP_OPC_ObjectSize:
+                size = &props[i];
+                break;
         }
+    }
 
-        *(uint32_t **)p_data = handles.Handler;
-        *p_len = handles.n;
+    if (format == NULL || name == NULL || name->propval.str == NULL)
+    {
+        return -1;
     }
-    else if (meta->dataType & File)
+
+    meta->dataType = format->propval.u16 == PTP_OFC_Association ? Folder : File;
+
+    if (meta->dataType & File)
+    {
+        if (size == NULL)
+        {
+            return -1;
+        }
+
+        meta->size = size->datatype == PTP_DTC_UINT32 ? size->propval.u32 : size->propval.u64;
+    }
+
+    meta->name = strdup(name->propval.str);
+    meta->handle = handle;
+    return 0;
+}
+
+/**
+ * Finds the cached parent of an object cached by
+ * VitaMTP_PrefetchObjectTree(), NULL for the root or if unknown.
+ */
+static PTPObject *VitaMTP_GetCachedParent(PTPParams *params, PTPObject *ob, uint32_t root)
+{
+    MTPProperties *prop;
+    PTPObject *parent;
+
+    if (ob->oid == root ||
+            (prop = ptp_find_object_prop_in_cache(params, ob->oid, PTP_OPC_ParentObject)) == NULL ||
+            ptp_object_find(params, prop->propval.u32, &parent) != PTP_RC_OK)
+    {
+        return NULL;
+    }
+
+    return parent;
+}
+
+/**
+ * Fetches the names, formats and sizes of an object and everything
+ * below it in one GetObjPropList transaction and keeps them in the
+ * object cache. VitaMTP_GetObjectInfo(), VitaMTP_GetObjectHandles()
+ * and VitaMTP_CheckExistance() will then answer from the cache
+ * instead of asking the device for every property of every object.
+ * If the device refuses, nothing is cached and the calls keep
+ * working as before, so it is safe to ignore the result.
+ * Call VitaMTP_ReleaseObjectTree() when done with the objects.
+ *
+ * @param device a pointer to the device.
+ * @param handle the PTP handle of the root object.
+ * @return the PTP result code that the Vita returns.
+ * @see VitaMTP_ReleaseObjectTree()
+ */
+// whether a request failed because the device does not do it, rather than
+// because of the object it was for or something going wrong on the way
+static int VitaMTP_Is_Unsupported(uint16_t ret)
+{
+    switch (ret)
+    {
+    case PTP_RC_OperationNotSupported:
+    case PTP_RC_ParameterNotSupported:
+    case PTP_RC_SpecificationByFormatUnsupported:
+    case PTP_RC_MTP_Specification_By_Group_Unsupported:
+    case PTP_RC_MTP_Specification_By_Depth_Unsupported:
+        return 1;
+
+    default:
+        return 0;
+    }
+}
+
+VITAMTP_EXPORT uint16_t VitaMTP_PrefetchObjectTree(vita_device_t *device, uint32_t handle)
+{
+    PTPParams *params = VitaMTP_Get_PTP_Params(device);
+    MTPProperties *props = NULL;
+    PTPObject *ob;
+    PTPObject *parent;
+    int nprops = 0;
+    int i, j;
+    unsigned int b;
+    uint16_t ret;
+
+    if (params->device_flags & DEVICE_FLAG_BROKEN_MTPGETOBJPROPLIST_ALL)
+    {
+        return PTP_RC_OperationNotSupported;
+    }
+
+    if ((ret = ptp_mtp_getobjectproplist(params, handle, &props, &nprops)) != PTP_RC_OK)
+    {
+        // don't try again this session if the device cannot do it at all
+        if (VitaMTP_Is_Unsupported(ret))
+        {
+            VitaMTP_Log(VitaMTP_INFO, "device refused object property list, fetching properties one by one\n");
+            params->device_flags |= DEVICE_FLAG_BROKEN_MTPGETOBJPROPLIST_ALL;
+        }
+        else
+        {
+            VitaMTP_Log(VitaMTP_DEBUG, "cannot get object property list of 0x%08x: 0x%04x\n", handle, ret);
+        }
+
+        return ret;
+    }
+
+    ptp_objects_free(params);
+
+    // props is sorted by handle, give each object its own run of it
+    // PTPOBJECT_DIRECTORY_LOADED marks objects whose children are all cached
+    for (i = 0; i < nprops; i = j)
+    {
+        for (j = i + 1; j < nprops && props[j].ObjectHandle == props[i].ObjectHandle; j++);
+
+        if (ptp_object_find_or_insert(params, props[i].ObjectHandle, &ob) != PTP_RC_OK ||
+                (ob->mtpprops = malloc((j - i) * sizeof(MTPProperties))) == NULL)
+        {
+            ptp_objects_free(params);
+
+            for (; i < nprops; i++)
+            {
+                ptp_destroy_object_prop(&props[i]);
+            }
+
+            free(props);
+            return PTP_RC_GeneralError;
+        }
+
+        memcpy(ob->mtpprops, props + i, (j - i) * sizeof(MTPProperties));
+        ob->nrofmtpprops = j - i;
+        ob->flags |= PTPOBJECT_MTPPROPLIST_LOADED | PTPOBJECT_DIRECTORY_LOADED;
+    }
+
+    free(props); // property values now belong to the cached objects
+
+    // link children to their folders, counting them first
+    for (b = 0; b < params->nrofobjectbuckets; b++)
+    {
+        for (ob = params->objects[b]; ob != NULL; ob = ob->next)
+        {
+            if ((parent = VitaMTP_GetCachedParent(params, ob, handle)) != NULL)
+            {
+                parent->nrofchildren++;
+            }
+        }
+    }
+
+    for (b = 0; b < params->nrofobjectbuckets; b++)
+    {
+        for (ob = params->objects[b]; ob != NULL; ob = ob->next)
+        {
+            if (ob->nrofchildren > 0 && (ob->children = malloc(ob->nrofchildren * sizeof(uint32_t))) == NULL)
+            {
+                ptp_objects_free(params);
+                return PTP_RC_GeneralError;
+            }
+
+            ob->nrofchildren = 0;
+        }
+    }
+
+    for (b = 0; b < params->nrofobjectbuckets; b++)
+    {
+        for (ob = params->objects[b]; ob != NULL; ob = ob->next)
+        {
+            if ((parent = VitaMTP_GetCachedParent(params, ob, handle)) != NULL)
+            {
+                parent->children[parent->nrofchildren++] = ob->oid;
+            }
+        }
+    }
+
+    VitaMTP_Log(VitaMTP_DEBUG, "cached properties of %d objects below handle 0x%08X\n", params->nrofobjects, handle);
+    return PTP_RC_OK;
+}
+
+/**
+ * Drops the object properties cached by VitaMTP_PrefetchObjectTree().
+ *
+ * @param device a pointer to the device.
+ * @see VitaMTP_PrefetchObjectTree()
+ */
+VITAMTP_EXPORT void VitaMTP_ReleaseObjectTree(vita_device_t *device)
+{
+    ptp_objects_free(VitaMTP_Get_PTP_Params(device));
+}
+
+/**
+ * Gets information about a PTP object on the device.
+ * meta will contain minimal information. Only name,
+ * dataType, size (if file), and handle will be filled.
+ *
+ * @param device a pointer to the device.
+ * @param handle the PTP handle of the object to get.
+ * @param meta information about the object, will be incomplete.
+ * @return the PTP result code that the Vita returns.
+ * @see VitaMTP_GetObjectHandles()
+ * @see VitaMTP_GetObjectToCallback()
+ * @see VitaMTP_PrefetchObjectTree()
+ */
+VITAMTP_EXPORT uint16_t VitaMTP_GetObjectInfo(vita_device_t *device, uint32_t handle, metadata_t *meta)
+{
+    PTPParams *params = VitaMTP_Get_PTP_Params(device);
+    PTPPropertyValue value;
+    MTPProperties *props = NULL;
+    PTPObject *ob;
+    int nprops = 0;
+    uint16_t ret;
+
+    // answer from VitaMTP_PrefetchObjectTree()'s cache if we can
+    if (ptp_object_find(params, handle, &ob) == PTP_RC_OK &&
+            VitaMTP_ObjectInfoFromProps(ob->mtpprops, ob->nrofmtpprops, handle, meta) == 0)
+    {
+        return PTP_RC_OK;
+    }
+
+    // otherwise get all properties in one round trip if the device allows it
+    if (!(params->device_flags & DEVICE_FLAG_BROKEN_MTPGETOBJPROPLIST))
+    {
+        if ((ret = ptp_mtp_getobjectproplist_level(params, handle, 0, &props, &nprops)) != PTP_RC_OK)
+        {
+            if (VitaMTP_Is_Unsupported(ret))
+            {
+                VitaMTP_Log(VitaMTP_INFO, "device refused object property list, fetching properties one by one\n");
+                params->device_flags |= DEVICE_FLAG_BROKEN_MTPGETOBJPROPLIST;
+            }
+        }
+        else if (VitaMTP_ObjectInfoFromProps(props, nprops, handle, meta) == 0)
+        {
+            ptp_destroy_object_prop_list(props, nprops);
+            return PTP_RC_OK;
+        }
+        else
+        {
+            ptp_destroy_object_prop_list(props, nprops);
+        }
+    }
+
+    if ((ret = ptp_mtp_getobjectpropvalue(VitaMTP_Get_PTP_Params(device), handle, PTP_OPC_ObjectFormat, &value,
+                                          PTP_DTC_UINT16)) != PTP_RC_OK)
+    {
+        return ret;
+    }
+
+    meta->dataType = value.u16 == PTP_OFC_Association ? Folder : File;
+
+    if ((ret = ptp_mtp_getobjectpropvalue(VitaMTP_Get_PTP_Params(device), handle, PTP_OPC_ObjectFileName, &value,
+                                          PTP_DTC_STR)) != PTP_RC_OK)
+    {
+        return ret;
+    }
+
+    meta->name = value.str;
+
+    // TODO: Make use of date modified and object format
+    //ptp_mtp_getobjectpropvalue ((PTPParams*)device->params, handle, PTP_OPC_DateModified, &value, PTP_DTC_STR);
+    if (meta->dataType & File)
     {
         if ((ret = ptp_mtp_getobjectpropvalue(VitaMTP_Get_PTP_Params(device), handle, PTP_OPC_ObjectSize, &value,
                                               PTP_DTC_UINT64)) != PTP_RC_OK)
         {
+            free(meta->name);
+            meta->name = NULL;
             return ret;
         }
 
         meta->size = value.u64;
-        ret = ptp_getobject(VitaMTP_Get_PTP_Params(device), handle, (unsigned char **)p_data);
-        *p_len = (unsigned int)meta->size;
     }
 
     meta->handle = handle;
@@ -813,33 +1670,147 @@ VITAMTP_EXPORT uint16_t VitaMTP_GetObject(vita_device_t *device, uint32_t handle
 }
 
 /**
- * Gets the name, size, and a small part of the object specified.
- * At most 0x400 bytes will be read to determine what kind of
- * object is about to be recieved.
+ * Gets the handles of the objects in a folder on the device.
  *
  * @param device a pointer to the device.
- * @param existance pointer to where results will be stored.
+ * @param handle the PTP handle of the folder.
+ * @param p_handles dynamically allocated array of handles.
+ * @param p_len number of handles.
+ * @return the PTP result code that the Vita returns.
+ * @see VitaMTP_PrefetchObjectTree()
  */
-VITAMTP_EXPORT uint16_t VitaMTP_CheckExistance(vita_device_t *device, uint32_t handle, existance_object_t *existance)
+VITAMTP_EXPORT uint16_t VitaMTP_GetObjectHandles(vita_device_t *device, uint32_t handle, uint32_t **p_handles,
+        unsigned int *p_len)
 {
-    PTPPropertyValue value;
+    uint32_t store = VITA_STORAGE_ID;
+    PTPObjectHandles handles;
+    PTPObject *ob;
     uint16_t ret;
 
-    if ((ret = ptp_mtp_getobjectpropvalue(VitaMTP_Get_PTP_Params(device), handle, PTP_OPC_ObjectSize, &value,
-                                          PTP_DTC_UINT64)) != PTP_RC_OK)
+    if (ptp_object_find(VitaMTP_Get_PTP_Params(device), handle, &ob) == PTP_RC_OK &&
+            (ob->flags & PTPOBJECT_DIRECTORY_LOADED))
+    {
+        // allocate at least one so an empty folder isn't out of memory
+        *p_len = ob->nrofchildren;
+        *p_handles = malloc((ob->nrofchildren + 1) * sizeof(uint32_t));
+
+        if (*p_handles == NULL)
+        {
+            return PTP_RC_GeneralError;
+        }
+
+        memcpy(*p_handles, ob->children, ob->nrofchildren * sizeof(uint32_t));
+        return PTP_RC_OK;
+    }
+
+    if ((ret = ptp_getobjecthandles(VitaMTP_Get_PTP_Params(device), store, 0, handle, &handles)) != PTP_RC_OK)
     {
         return ret;
     }
 
-    existance->size = value.u64;
+    *p_handles = handles.Handler;
+    *p_len = handles.n;
+    return ret;
+}
 
-    if ((ret = ptp_mtp_getobjectpropvalue(VitaMTP_Get_PTP_Params(device), handle, PTP_OPC_ObjectFileName, &value,
-                                          PTP_DTC_STR)) != PTP_RC_OK)
+/**
+ * Gets the data of a file object on the device, passing it to
+ * a callback in blocks as it is received instead of to a
+ * buffer holding the whole object.
+ *
+ * @param device a pointer to the device.
+ * @param handle the PTP handle of the object to get.
+ * @param write_func called for each block received.
+ * @param priv passed to write_func.
+ * @param event_id the event the object is received for. If it is
+ *  cancelled with VitaMTP_CancelTask() the transfer stops with
+ *  PTP_ERROR_CANCEL.
+ * @return the PTP result code that the Vita returns.
+ * @see VitaMTP_GetObjectInfo()
+ */
+VITAMTP_EXPORT uint16_t VitaMTP_GetObjectToCallback(vita_device_t *device, uint32_t handle,
+        vita_object_write_callback_t write_func, void *priv, uint32_t event_id)
+{
+    struct vita_object_callback callback = {NULL, write_func, priv, device, event_id};
+    PTPDataHandler handler = {NULL, VitaMTP_Object_Putfunc, &callback};
+
+    return ptp_getobject_to_handler(VitaMTP_Get_PTP_Params(device), handle, &handler);
+}
+
+/**
+ * Gets the data of a file object on the device, writing it to
+ * a file descriptor as it is received.
+ *
+ * @param device a pointer to the device.
+ * @param handle the PTP handle of the object to get.
+ * @param fd file descriptor to write() the data to.
+ * @param event_id the event the object is received for, see
+ *  VitaMTP_GetObjectToCallback().
+ * @return the PTP result code that the Vita returns.
+ * @see VitaMTP_GetObjectInfo()
+ */
+VITAMTP_EXPORT uint16_t VitaMTP_GetObjectToFD(vita_device_t *device, uint32_t handle, int fd, uint32_t event_id)
+{
+    return VitaMTP_GetObjectToCallback(device, handle, VitaMTP_FD_Write, &fd, event_id);
+}
+
+/**
+ * Gets a PTP object from the device along with metadata.
+ * If object is a handle, *p_data will be a uint32_t array
+ * of handles in the directory and *p_len will be the number
+ * of handles. If object is a file, *p_data will be a
+ * unsigned char* containing the data and *p_len will be
+ * the size of the data.
+ * meta will contain minimal information. Only name,
+ * dataType, size (if file), and handle will be filled.
+ *
+ * @param device a pointer to the device.
+ * @param handle the PTP handle of the object to get.
+ * @param meta information about the object, will be incomplete.
+ * @param p_data dynamically allocated data.
+ * @param p_len size of the data.
+ * @see VitaMTP_GetObjectToCallback()
+ */
+VITAMTP_EXPORT uint16_t VitaMTP_GetObject(vita_device_t *device, uint32_t handle, metadata_t *meta, void **p_data,
+                           unsigned int *p_len)
+{
+    uint16_t ret;
+
+    if ((ret = VitaMTP_GetObjectInfo(device, handle, meta)) != PTP_RC_OK)
+    {
+        return ret;
+    }
+
+    if (meta->dataType & Folder)
+    {
+        return VitaMTP_GetObjectHandles(device, handle, (uint32_t **)p_data, p_len);
+    }
+
+    ret = ptp_getobject(VitaMTP_Get_PTP_Params(device), handle, (unsigned char **)p_data);
+    *p_len = (unsigned int)meta->size;
+    return ret;
+}
+
+/**
+ * Gets the name, size, and a small part of the object specified.
+ * At most 0x400 bytes will be read to determine what kind of
+ * object is about to be recieved.
+ *
+ * @param device a pointer to the device.
+ * @param existance pointer to where results will be stored.
+ */
+VITAMTP_EXPORT uint16_t VitaMTP_CheckExistance(vita_device_t *device, uint32_t handle, existance_object_t *existance)
+{
+    metadata_t meta;
+    uint16_t ret;
+
+    if ((ret = VitaMTP_GetObjectInfo(device, handle, &meta)) != PTP_RC_OK)
     {
         return ret;
     }
 
-    existance->name = value.str;
+    existance->size = meta.dataType & File ? meta.size : 0;
+    existance->name = meta.name;
     unsigned char *data;
 
     if ((ret = ptp_getpartialobject(VitaMTP_Get_PTP_Params(device), handle, 0, sizeof(existance->data), &data,
@@ -459,6 +459,22 @@ struct wireless_vita_info
     const char *name;
 };
 
+/**
+ * Bulk transfer profile
+ *
+ * Describes how data phases are split into transport
+ * blocks. Profiles are measured by VitaMTP_Calibrate_Transfers()
+ * and are meant to be saved by the host per device and transport.
+ *
+ * @see VitaMTP_Get_Transfer_Profile()
+ * @see VitaMTP_Set_Transfer_Profile()
+ */
+struct vita_transfer_profile
+{
+    uint32_t block_size; ///< Size of a single USB bulk read/write or PTP/IP data packet
+    uint32_t throughput; ///< Measured throughput in bytes per second, 0 if unknown
+};
+
 /**
  * These make referring to the structs easier.
  */
@@ -481,8 +497,23 @@ typedef struct copy_confirmation_info copy_confirmation_info_t;
 typedef struct capability_info capability_info_t;
 typedef struct wireless_host_info wireless_host_info_t;
 typedef struct wireless_vita_info wireless_vita_info_t;
+typedef struct vita_transfer_profile vita_transfer_profile_t;
 typedef int (*device_registered_callback_t)(const char *deviceid);
 typedef int (*register_device_callback_t)(wireless_vita_info_t *info, int *p_err);
+typedef int (*device_connected_callback_t)(vita_device_t *device);
+
+/**
+ * Callbacks for streaming object data
+ *
+ * The read callback fills data with at most wantlen bytes and stores
+ * how many it filled in gotlen. The write callback must consume all len
+ * bytes. Both return zero on success, anything else aborts the transfer.
+ *
+ * @see VitaMTP_SendObjectFromCallback()
+ * @see VitaMTP_GetObjectToCallback()
+ */
+typedef int (*vita_object_read_callback_t)(void *priv, unsigned char *data, unsigned long wantlen, unsigned long *gotlen);
+typedef int (*vita_object_write_callback_t)(void *priv, const unsigned char *data, unsigned long len);
 
 /**
  * This is the USB information for the Vita.
@@ -508,6 +539,9 @@ typedef int (*register_device_callback_t)(wireless_vita_info_t *info, int *p_err
 #ifndef PTP_RC_OK
 #define PTP_RC_OK 0x2001
 #endif
+#ifndef PTP_ERROR_CANCEL
+#define PTP_ERROR_CANCEL 0x02FB // returned by transfers of a cancelled event
+#endif
 #define PTP_EC_VITA_RequestSendNumOfObject 0xC104
 #define PTP_EC_VITA_RequestSendObjectMetadata 0xC105
 #define PTP_EC_VITA_RequestSendObject 0xC107
@@ -714,12 +748,17 @@ typedef int (*register_device_callback_t)(wireless_vita_info_t *info, int *p_err
  */
 VITAMTP_EXPORT void VitaMTP_Release_Device(vita_device_t *device);
 VITAMTP_EXPORT int VitaMTP_Read_Event(vita_device_t *device, vita_event_t *event);
+VITAMTP_EXPORT int VitaMTP_Get_Event_FD(vita_device_t *device);
 VITAMTP_EXPORT const char *VitaMTP_Get_Identification(vita_device_t *device);
 VITAMTP_EXPORT enum vita_device_type VitaMTP_Get_Device_Type(vita_device_t *device);
 VITAMTP_EXPORT uint16_t VitaMTP_SendData(vita_device_t *device, uint32_t event_id, uint32_t code, unsigned char *data,
                           unsigned int len);
 VITAMTP_EXPORT uint16_t VitaMTP_GetData(vita_device_t *device, uint32_t event_id, uint32_t code, unsigned char **p_data,
                          unsigned int *p_len);
+VITAMTP_EXPORT int VitaMTP_Calibrate_Transfers(vita_device_t *device);
+VITAMTP_EXPORT int VitaMTP_Get_Transfer_Profile(vita_device_t *device, vita_transfer_profile_t *profile);
+VITAMTP_EXPORT int VitaMTP_Set_Transfer_Profile(vita_device_t *device, const vita_transfer_profile_t *profile);
+VITAMTP_EXPORT int VitaMTP_Is_Task_Cancelled(vita_device_t *device, uint32_t event_id);
 
 /**
  * Function for USB devices
@@ -738,6 +777,9 @@ VITAMTP_EXPORT void VitaMTP_Stop_Broadcast(void);
 VITAMTP_EXPORT void VitaMTP_Release_Wireless_Device(vita_device_t *device);
 VITAMTP_EXPORT vita_device_t *VitaMTP_Get_First_Wireless_Vita(wireless_host_info_t *info, unsigned int host_addr, int timeout,
         device_registered_callback_t is_registered, register_device_callback_t create_register_pin);
+VITAMTP_EXPORT int VitaMTP_Serve_Wireless(wireless_host_info_t *info, unsigned int host_addr, int timeout,
+        device_registered_callback_t is_registered, register_device_callback_t create_register_pin,
+        device_connected_callback_t device_connected);
 VITAMTP_EXPORT int VitaMTP_Get_Device_IP(vita_device_t *device);
 
 /**
@@ -755,6 +797,7 @@ VITAMTP_EXPORT uint16_t VitaMTP_ReportResultWithParam(vita_device_t *device, uin
 VITAMTP_EXPORT uint16_t VitaMTP_SendInitiatorInfo(vita_device_t *device, initiator_info_t *info);
 VITAMTP_EXPORT uint16_t VitaMTP_GetUrl(vita_device_t *device, uint32_t event_id, char **url);
 VITAMTP_EXPORT uint16_t VitaMTP_SendHttpObjectFromURL(vita_device_t *device, uint32_t event_id, void *data, unsigned int len);
+VITAMTP_EXPORT uint16_t VitaMTP_SendHttpObjectFromURLFD(vita_device_t *device, uint32_t event_id, int fd, uint64_t len);
 VITAMTP_EXPORT uint16_t VitaMTP_SendNPAccountInfo(vita_device_t *device, uint32_t event_id, unsigned char *data,
                                    unsigned int len); // unused?
 VITAMTP_EXPORT uint16_t VitaMTP_GetSettingInfo(vita_device_t *device, uint32_t event_id, settings_info_t **p_info);
@@ -764,9 +807,13 @@ VITAMTP_EXPORT uint16_t VitaMTP_SendHostStatus(vita_device_t *device, uint32_t s
 VITAMTP_EXPORT uint16_t VitaMTP_SendPartOfObjectInit(vita_device_t *device, uint32_t event_id, send_part_init_t *init);
 VITAMTP_EXPORT uint16_t VitaMTP_SendPartOfObject(vita_device_t *device, uint32_t event_id, unsigned char *object_data,
                                   uint64_t object_len);
+VITAMTP_EXPORT uint16_t VitaMTP_SendPartOfObjectFromFD(vita_device_t *device, uint32_t event_id, int fd, uint64_t offset,
+        uint64_t len);
 VITAMTP_EXPORT uint16_t VitaMTP_OperateObject(vita_device_t *device, uint32_t event_id, operate_object_t *op_object);
 VITAMTP_EXPORT uint16_t VitaMTP_GetPartOfObject(vita_device_t *device, uint32_t event_id, send_part_init_t *init,
                                  unsigned char **data);
+VITAMTP_EXPORT uint16_t VitaMTP_GetPartOfObjectBuffer(vita_device_t *device, uint32_t event_id, send_part_init_t *init,
+        unsigned char **p_buffer);
 VITAMTP_EXPORT uint16_t VitaMTP_SendStorageSize(vita_device_t *device, uint32_t event_id, uint64_t storage_size,
                                  uint64_t available_size);
 VITAMTP_EXPORT uint16_t VitaMTP_GetTreatObject(vita_device_t *device, uint32_t event_id, treat_object_t *treat);
@@ -779,8 +826,20 @@ VITAMTP_EXPORT uint16_t VitaMTP_CancelTask(vita_device_t *device, uint32_t cance
 VITAMTP_EXPORT uint16_t VitaMTP_KeepAlive(vita_device_t *device, uint32_t event_id);
 VITAMTP_EXPORT uint16_t VitaMTP_SendObject(vita_device_t *device, uint32_t *parenthandle, uint32_t *p_handle, metadata_t *p_meta,
                             unsigned char *data);
+VITAMTP_EXPORT uint16_t VitaMTP_SendObjectFromCallback(vita_device_t *device, uint32_t *p_parenthandle, uint32_t *p_handle,
+        metadata_t *meta, vita_object_read_callback_t read_func, void *priv, uint32_t event_id);
+VITAMTP_EXPORT uint16_t VitaMTP_SendObjectFromFD(vita_device_t *device, uint32_t *p_parenthandle, uint32_t *p_handle,
+        metadata_t *meta, int fd, uint32_t event_id);
 VITAMTP_EXPORT uint16_t VitaMTP_GetObject(vita_device_t *device, uint32_t handle, metadata_t *meta, void **p_data,
                            unsigned int *p_len);
+VITAMTP_EXPORT uint16_t VitaMTP_GetObjectInfo(vita_device_t *device, uint32_t handle, metadata_t *meta);
+VITAMTP_EXPORT uint16_t VitaMTP_GetObjectHandles(vita_device_t *device, uint32_t handle, uint32_t **p_handles,
+        unsigned int *p_len);
+VITAMTP_EXPORT uint16_t VitaMTP_GetObjectToCallback(vita_device_t *device, uint32_t handle,
+        vita_object_write_callback_t write_func, void *priv, uint32_t event_id);
+VITAMTP_EXPORT uint16_t VitaMTP_GetObjectToFD(vita_device_t *device, uint32_t handle, int fd, uint32_t event_id);
+VITAMTP_EXPORT uint16_t VitaMTP_PrefetchObjectTree(vita_device_t *device, uint32_t handle);
+VITAMTP_EXPORT void VitaMTP_ReleaseObjectTree(vita_device_t *device);
 VITAMTP_EXPORT uint16_t VitaMTP_CheckExistance(vita_device_t *device, uint32_t handle, existance_object_t *existance);
 VITAMTP_EXPORT uint16_t VitaMTP_GetVitaCapabilityInfo(vita_device_t *device, capability_info_t **p_info);
 VITAMTP_EXPORT uint16_t VitaMTP_SendPCCapabilityInfo(vita_device_t *device, capability_info_t *info);
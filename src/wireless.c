@@ -27,11 +27,19 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#define PTPIP_HAVE_SENDFILE
 #endif
 #include <fcntl.h>
 #include <iconv.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -50,7 +58,13 @@ typedef int socklen_t;
 #define SOCK_EWOULDBLOCK WSAEWOULDBLOCK
 #define PF_LOCAL PF_INET
 #define sleep(x) (Sleep((x)*1000))
+#define poll WSAPoll
 extern int asprintf(char **ret, const char *format, ...);
+struct iovec
+{
+    void *iov_base;
+    size_t iov_len;
+};
 #else
 typedef int socket_t;
 #define INVALID_SOCKET -1
@@ -81,6 +95,12 @@ extern int g_VitaMTP_logmask;
 static socket_t g_broadcast_command_fds[] = {-1, -1};
 
 void VitaMTP_hex_dump(const unsigned char *data, unsigned int size, unsigned int num);
+int vita_tuner_init(PTPParams *params, const uint32_t *candidates, int num);
+void vita_tuner_free(PTPParams *params);
+int vita_scheduler_init(PTPParams *params);
+void vita_scheduler_free(PTPParams *params);
+uint32_t vita_tuner_begin(PTPParams *params);
+void vita_tuner_end(PTPParams *params, uint64_t bytes);
 
 // the code below is taken from gphoto2
 /* ptpip.c
@@ -194,110 +214,217 @@ ptp_ptpip_sendreq(PTPParams *params, PTPContainer *req)
     return PTP_RC_OK;
 }
 
+/*
+ * Every connection reads the socket through one of these. recv() is
+ * called with as much room as is left in the buffer and packets are
+ * parsed where they landed, so small packets do not need a syscall of
+ * their own and payloads are never copied into a buffer of their own.
+ */
+struct ptpip_rxbuf
+{
+    int fd;
+    unsigned char *buf;
+    unsigned long size;
+    unsigned long start; // first unread byte
+    unsigned long end; // one past the last byte read from the socket
+};
+
+#define PTPIP_CMD_RXBUF_SIZE    0x40000
+#define PTPIP_EVT_RXBUF_SIZE    0x1000
+
+static struct ptpip_rxbuf *
+ptp_ptpip_rxbuf_new(unsigned long size)
+{
+    struct ptpip_rxbuf *rx;
+
+    if ((rx = malloc(sizeof(struct ptpip_rxbuf))) == NULL)
+    {
+        return NULL;
+    }
+
+    if ((rx->buf = malloc(size)) == NULL)
+    {
+        free(rx);
+        return NULL;
+    }
+
+    rx->fd = -1;
+    rx->size = size;
+    rx->start = rx->end = 0;
+    return rx;
+}
+
+static void
+ptp_ptpip_rxbuf_free(PTPParams *params)
+{
+    if (params->cmdrx)
+    {
+        free(params->cmdrx->buf);
+        free(params->cmdrx);
+        params->cmdrx = NULL;
+    }
+
+    if (params->evtrx)
+    {
+        free(params->evtrx->buf);
+        free(params->evtrx);
+        params->evtrx = NULL;
+    }
+}
+
+static int
+ptp_ptpip_rxbuf_init(PTPParams *params)
+{
+    params->cmdrx = ptp_ptpip_rxbuf_new(PTPIP_CMD_RXBUF_SIZE);
+    params->evtrx = ptp_ptpip_rxbuf_new(PTPIP_EVT_RXBUF_SIZE);
+
+    if (params->cmdrx == NULL || params->evtrx == NULL)
+    {
+        VitaMTP_Log(VitaMTP_ERROR, "ptpip: cannot allocate receive buffers\n");
+        ptp_ptpip_rxbuf_free(params);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Makes sure at least want (<= rx->size) unread bytes are in the buffer */
 static uint16_t
-ptp_ptpip_generic_read(PTPParams *params, int fd, PTPIPHeader *hdr, unsigned char **data)
+ptp_ptpip_rx_fill(struct ptpip_rxbuf *rx, unsigned long want)
 {
     ssize_t ret;
-    int len, curread;
-    unsigned char *xhdr;
 
-    xhdr = (unsigned char *)hdr;
-    curread = 0;
-    len = sizeof(PTPIPHeader);
+    if (rx->start == rx->end)
+        rx->start = rx->end = 0;
 
-    while (curread < len)
+    while (rx->end - rx->start < want)
     {
-        ret = recv((socket_t)fd, xhdr + curread, len - curread, 0);
+        if (rx->size - rx->start < want)
+        {
+            memmove(rx->buf, rx->buf + rx->start, rx->end - rx->start);
+            rx->end -= rx->start;
+            rx->start = 0;
+        }
+
+        ret = recv((socket_t)rx->fd, rx->buf + rx->end, rx->size - rx->end, 0);
 
         if (ret == -1)
         {
-            perror("read PTPIPHeader");
+            perror("ptpip/rx_fill");
             return PTP_RC_GeneralError;
         }
 
-        VitaMTP_Log(VitaMTP_DEBUG, "ptpip/generic_read\n");
-
-        if (MASK_SET(g_VitaMTP_logmask, VitaMTP_DEBUG))
+        if (ret == 0)
         {
-            VitaMTP_hex_dump(xhdr+curread, (unsigned int)ret, 16);
+            VitaMTP_Log(VitaMTP_ERROR, "ptpip/rx_fill: end of stream with %lu bytes buffered\n", rx->end - rx->start);
+            return PTP_RC_GeneralError;
         }
 
-        curread += ret;
+        VitaMTP_Log(VitaMTP_DEBUG, "ptpip/rx_fill: read %zd bytes\n", ret);
 
-        if (ret == 0)
+        if (MASK_SET(g_VitaMTP_logmask, VitaMTP_DEBUG))
         {
-            VitaMTP_Log(VitaMTP_ERROR, "ptpip: End of stream after reading %zd bytes of ptpipheader\n", ret);
-            return PTP_RC_GeneralError;
+            VitaMTP_hex_dump(rx->buf + rx->end, (unsigned int)ret, 16);
         }
+
+        rx->end += ret;
     }
 
-    len = dtoh32(hdr->length) - sizeof(PTPIPHeader);
+    return PTP_RC_OK;
+}
+
+/* Throws away the next len bytes of the stream */
+static uint16_t
+ptp_ptpip_rx_skip(struct ptpip_rxbuf *rx, unsigned long len)
+{
+    unsigned long avail;
+    uint16_t ret;
 
-    if (len < 0)
+    while (len > 0)
     {
-        VitaMTP_Log(VitaMTP_ERROR, "ptpip/generic_read: len < 0, %d?\n", len);
-        return PTP_RC_GeneralError;
-    }
+        if ((ret = ptp_ptpip_rx_fill(rx, 1)) != PTP_RC_OK)
+            return ret;
 
-    *data = malloc(len);
+        avail = rx->end - rx->start;
 
-    if (!*data)
-    {
-        VitaMTP_Log(VitaMTP_ERROR, "ptpip/generic_read: malloc failed.\n");
-        return PTP_RC_GeneralError;
-    }
+        if (avail > len)
+            avail = len;
 
-    curread = 0;
+        rx->start += avail;
+        len -= avail;
+    }
 
-    while (curread < len)
-    {
-        ret = recv((socket_t)fd, (*data)+curread, len-curread, 0);
+    return PTP_RC_OK;
+}
 
-        if (ret == -1)
-        {
-            VitaMTP_Log(VitaMTP_ERROR, "ptpip/generic_read: error in reading PTPIP data\n");
-            free(*data);
-            *data = NULL;
-            return PTP_RC_GeneralError;
-        }
-        else
-        {
-            VitaMTP_Log(VitaMTP_DEBUG, "ptpip/generic_read\n");
+static uint16_t
+ptp_ptpip_read_header(PTPParams *params, struct ptpip_rxbuf *rx, PTPIPHeader *hdr)
+{
+    uint16_t ret;
 
-            if (MASK_SET(g_VitaMTP_logmask, VitaMTP_DEBUG))
-            {
-                VitaMTP_hex_dump(((*data)+curread), (unsigned int)ret, 16);
-            }
-        }
+    if ((ret = ptp_ptpip_rx_fill(rx, sizeof(PTPIPHeader))) != PTP_RC_OK)
+        return ret;
 
-        if (ret == 0)
-            break;
+    memcpy(hdr, rx->buf + rx->start, sizeof(PTPIPHeader));
+    rx->start += sizeof(PTPIPHeader);
 
-        curread += ret;
+    if (dtoh32(hdr->length) < sizeof(PTPIPHeader))
+    {
+        VitaMTP_Log(VitaMTP_ERROR, "ptpip/read_header: bad packet length %d\n", dtoh32(hdr->length));
+        return PTP_RC_GeneralError;
     }
 
-    if (curread != len)
+    return PTP_RC_OK;
+}
+
+/*
+ * Returns the payload of the packet whose header was just read. The
+ * payload is left in the receive buffer, so it stays valid only until
+ * the next read on the same connection and must not be freed.
+ */
+static uint16_t
+ptp_ptpip_read_payload(PTPParams *params, struct ptpip_rxbuf *rx, PTPIPHeader *hdr, unsigned char **data)
+{
+    unsigned long len = dtoh32(hdr->length) - sizeof(PTPIPHeader);
+    uint16_t ret;
+
+    if (len > rx->size)
     {
-        VitaMTP_Log(VitaMTP_ERROR, "ptpip/generic_read: read PTPIP data, ret %zd vs len %d\n", ret, len);
-        free(*data);
-        *data = NULL;
+        VitaMTP_Log(VitaMTP_ERROR, "ptpip/read_payload: packet of %lu bytes does not fit the buffer\n", len);
+        ptp_ptpip_rx_skip(rx, len);
         return PTP_RC_GeneralError;
     }
 
+    if ((ret = ptp_ptpip_rx_fill(rx, len)) != PTP_RC_OK)
+        return ret;
+
+    *data = rx->buf + rx->start;
+    rx->start += len;
     return PTP_RC_OK;
 }
 
+static uint16_t
+ptp_ptpip_generic_read(PTPParams *params, struct ptpip_rxbuf *rx, PTPIPHeader *hdr, unsigned char **data)
+{
+    uint16_t ret;
+
+    if ((ret = ptp_ptpip_read_header(params, rx, hdr)) != PTP_RC_OK)
+        return ret;
+
+    return ptp_ptpip_read_payload(params, rx, hdr, data);
+}
+
 static uint16_t
 ptp_ptpip_cmd_read(PTPParams *params, PTPIPHeader *hdr, unsigned char **data)
 {
     //ptp_ptpip_check_event (params);
-    return ptp_ptpip_generic_read(params, params->cmdfd, hdr, data);
+    return ptp_ptpip_generic_read(params, params->cmdrx, hdr, data);
 }
 
 static uint16_t
 ptp_ptpip_evt_read(PTPParams *params, PTPIPHeader *hdr, unsigned char **data)
 {
-    return ptp_ptpip_generic_read(params, params->evtfd, hdr, data);
+    return ptp_ptpip_generic_read(params, params->evtrx, hdr, data);
 }
 
 #define ptpip_startdata_transid     0
@@ -306,7 +433,190 @@ ptp_ptpip_evt_read(PTPParams *params, PTPIPHeader *hdr, unsigned char **data)
 #define ptpip_data_transid      0
 #define ptpip_data_payload      4
 
+#define ptpip_resp_code     0
+#define ptpip_resp_transid  2
+#define ptpip_resp_param1   6
+#define ptpip_resp_param2   10
+#define ptpip_resp_param3   14
+#define ptpip_resp_param4   18
+#define ptpip_resp_param5   22
+
 #define WRITE_BLOCKSIZE 32756
+
+/*
+ * Data packet payload sizes that VitaMTP_Calibrate_Transfers() will try.
+ * The first one is the default. Each one plus the 12 byte packet header
+ * adds up to a power of two.
+ */
+static const uint32_t g_ptpip_block_sizes[] =
+{
+    WRITE_BLOCKSIZE, 0x10000-12, 0x20000-12, 0x40000-12, 0x80000-12, 0x100000-12
+};
+
+/*
+ * Sends every buffer in iov in order, coping with short writes. The
+ * entries of iov are used up as they are sent.
+ */
+static uint16_t
+ptp_ptpip_sendv(socket_t fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t ret;
+
+    while (iovcnt > 0)
+    {
+        if (iov->iov_len == 0)
+        {
+            iov++;
+            iovcnt--;
+            continue;
+        }
+
+#ifdef _WIN32
+        ret = send(fd, iov->iov_base, (int)iov->iov_len, 0);
+#else
+        struct msghdr msg;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ret = sendmsg(fd, &msg, 0);
+
+        if (ret == -1 && errno == EINTR)
+            continue;
+#endif
+
+        if (ret == -1)
+        {
+            perror("write in senddata failed");
+            return PTP_RC_GeneralError;
+        }
+
+        while (ret > 0)
+        {
+            if ((size_t)ret < iov->iov_len)
+            {
+                iov->iov_base = (unsigned char *)iov->iov_base + ret;
+                iov->iov_len -= ret;
+                break;
+            }
+
+            ret -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+    }
+
+    return PTP_RC_OK;
+}
+
+/*
+ * While the socket is corked only full segments go out, so the packet
+ * headers and payloads of a data phase share segments. Uncorking
+ * flushes what is left.
+ */
+static void
+ptp_ptpip_cork(socket_t fd, int on)
+{
+#ifdef TCP_CORK
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+#endif
+}
+
+#ifdef PTPIP_HAVE_SENDFILE
+/*
+ * Data phase for a PTPDataFile. Packet headers and the prefix are sent
+ * with sendmsg() while the socket is corked, the file data is moved by
+ * sendfile() straight from the page cache.
+ */
+static uint16_t
+ptp_ptpip_senddata_file(PTPParams *params, PTPContainer *ptp, unsigned char *request, unsigned long requestlen,
+                        unsigned long size, PTPDataFile *file)
+{
+    unsigned long   curwrite, towrite;
+    unsigned long   blocksize;
+    uint16_t    ret;
+
+    blocksize = vita_tuner_begin(params);
+    ptp_ptpip_cork((socket_t)params->cmdfd, 1);
+    curwrite = 0;
+
+    while (curwrite < size)
+    {
+        unsigned long   type, prelen, filelen;
+        unsigned char   packet[12];
+        struct iovec    iov[3];
+        int     iovcnt = 0;
+        off_t       offset;
+        ssize_t     sent;
+
+        towrite = size - curwrite;
+
+        if (towrite > blocksize)
+        {
+            towrite = blocksize;
+            type    = PTPIP_DATA_PACKET;
+        }
+        else
+        {
+            type    = PTPIP_END_DATA_PACKET;
+        }
+
+        if (curwrite == 0)
+        {
+            iov[iovcnt].iov_base = request;
+            iov[iovcnt++].iov_len = requestlen;
+        }
+
+        prelen = towrite < file->prefixlen ? towrite : file->prefixlen;
+        htod32a(&packet[ptpip_type], (uint32_t)type);
+        htod32a(&packet[ptpip_len], (uint32_t)(towrite + sizeof(packet)));
+        htod32a(&packet[ptpip_data_transid+8], ptp->Transaction_ID);
+        iov[iovcnt].iov_base = packet;
+        iov[iovcnt++].iov_len = sizeof(packet);
+        iov[iovcnt].iov_base = (unsigned char *)file->prefix;
+        iov[iovcnt++].iov_len = prelen;
+
+        if ((ret = ptp_ptpip_sendv((socket_t)params->cmdfd, iov, iovcnt)) != PTP_RC_OK)
+            goto out;
+
+        file->prefix += prelen;
+        file->prefixlen -= prelen;
+        offset = (off_t)file->offset;
+
+        for (filelen = towrite - prelen; filelen > 0; filelen -= sent)
+        {
+            sent = sendfile(params->cmdfd, file->fd, &offset, filelen);
+
+            if (sent == -1 && errno == EINTR)
+            {
+                sent = 0;
+                continue;
+            }
+
+            if (sent <= 0)
+            {
+                // a short file cannot be made up for once the header is out
+                perror("sendfile in senddata failed");
+                ret = PTP_RC_GeneralError;
+                goto out;
+            }
+        }
+
+        file->offset = (uint64_t)offset;
+        curwrite += towrite;
+
+        if (file->progress && (ret = file->progress(params, file->priv, towrite)) != PTP_RC_OK)
+            goto out;
+    }
+
+    ret = PTP_RC_OK;
+    vita_tuner_end(params, size);
+out:
+    ptp_ptpip_cork((socket_t)params->cmdfd, 0);
+    return ret;
+}
+#endif
+
 uint16_t
 ptp_ptpip_senddata(PTPParams *params, PTPContainer *ptp,
                    unsigned long size, PTPDataHandler *handler
@@ -315,6 +625,7 @@ ptp_ptpip_senddata(PTPParams *params, PTPContainer *ptp,
     unsigned char   request[0x14];
     ssize_t ret;
     unsigned long       curwrite, towrite;
+    unsigned long       blocksize;
     unsigned char  *xdata;
 
     htod32a(&request[ptpip_type],PTPIP_START_DATA_PACKET);
@@ -329,34 +640,41 @@ ptp_ptpip_senddata(PTPParams *params, PTPContainer *ptp,
         VitaMTP_hex_dump(request, sizeof(request), 16);
     }
 
-    ret = send((socket_t)params->cmdfd, request, sizeof(request), 0);
-
-    if (ret == -1)
-        perror("sendreq/write to cmdfd");
-
-    if (ret != sizeof(request))
+    if (size == 0)
     {
-        VitaMTP_Log(VitaMTP_ERROR, "ptpip/senddata: ptp_ptpip_senddata() len=%d but ret=%zd\n", (int)sizeof(request), ret);
-        return PTP_RC_GeneralError;
+        struct iovec    iov = {request, sizeof(request)};
+
+        return ptp_ptpip_sendv((socket_t)params->cmdfd, &iov, 1);
     }
 
-    xdata = malloc(WRITE_BLOCKSIZE+8+4);
+#ifdef PTPIP_HAVE_SENDFILE
+
+    if (handler->file)
+        return ptp_ptpip_senddata_file(params, ptp, request, sizeof(request), size, handler->file);
+
+#endif
+    blocksize = vita_tuner_begin(params);
+    xdata = malloc(blocksize);
 
     if (!xdata) return PTP_RC_GeneralError;
 
+    ptp_ptpip_cork((socket_t)params->cmdfd, 1);
     curwrite = 0;
 
     while (curwrite < size)
     {
-        unsigned long type, written, towrite2, xtowrite;
+        unsigned long type, xtowrite;
+        unsigned char   packet[12];
+        struct iovec    iov[3];
+        int     iovcnt = 0;
 
         //ptp_ptpip_check_event (params);
 
         towrite = size - curwrite;
 
-        if (towrite > WRITE_BLOCKSIZE)
+        if (towrite > blocksize)
         {
-            towrite = WRITE_BLOCKSIZE;
+            towrite = blocksize;
             type    = PTPIP_DATA_PACKET;
         }
         else
@@ -364,67 +682,134 @@ ptp_ptpip_senddata(PTPParams *params, PTPContainer *ptp,
             type    = PTPIP_END_DATA_PACKET;
         }
 
-        ret = handler->getfunc(params, handler->priv, towrite, &xdata[ptpip_data_payload+8], &xtowrite);
+        ret = handler->getfunc(params, handler->priv, towrite, xdata, &xtowrite);
 
-        if (ret == -1)
+        if (ret != PTP_RC_OK || xtowrite != towrite)
         {
             perror("getfunc in senddata failed");
+            ptp_ptpip_cork((socket_t)params->cmdfd, 0);
             free(xdata);
-            return PTP_RC_GeneralError;
+            return ret == PTP_ERROR_CANCEL ? PTP_ERROR_CANCEL : PTP_RC_GeneralError;
+        }
+
+        /* the start packet goes out together with the first data packet */
+        if (curwrite == 0)
+        {
+            iov[iovcnt].iov_base = request;
+            iov[iovcnt++].iov_len = sizeof(request);
         }
 
-        towrite2 = xtowrite + 12;
-        htod32a(&xdata[ptpip_type], (uint32_t)type);
-        htod32a(&xdata[ptpip_len], (uint32_t)towrite2);
-        htod32a(&xdata[ptpip_data_transid+8], ptp->Transaction_ID);
+        htod32a(&packet[ptpip_type], (uint32_t)type);
+        htod32a(&packet[ptpip_len], (uint32_t)(xtowrite + sizeof(packet)));
+        htod32a(&packet[ptpip_data_transid+8], ptp->Transaction_ID);
+        iov[iovcnt].iov_base = packet;
+        iov[iovcnt++].iov_len = sizeof(packet);
+        iov[iovcnt].iov_base = xdata;
+        iov[iovcnt++].iov_len = xtowrite;
         VitaMTP_Log(VitaMTP_DEBUG, "ptpip/senddata\n");
 
         if (MASK_SET(g_VitaMTP_logmask, VitaMTP_DEBUG))
         {
-            VitaMTP_hex_dump(xdata, (unsigned int)towrite2, 16);
+            VitaMTP_hex_dump(packet, sizeof(packet), 16);
+            VitaMTP_hex_dump(xdata, (unsigned int)xtowrite, 16);
         }
 
-        written = 0;
-
-        while (written < towrite2)
+        if (ptp_ptpip_sendv((socket_t)params->cmdfd, iov, iovcnt) != PTP_RC_OK)
         {
-            ret = send((socket_t)params->cmdfd, xdata+written, towrite2-written, 0);
-
-            if (ret == -1)
-            {
-                perror("write in senddata failed");
-                free(xdata);
-                return PTP_RC_GeneralError;
-            }
-
-            written += ret;
+            ptp_ptpip_cork((socket_t)params->cmdfd, 0);
+            free(xdata);
+            return PTP_RC_GeneralError;
         }
 
         curwrite += towrite;
     }
 
+    ptp_ptpip_cork((socket_t)params->cmdfd, 0);
     free(xdata);
+    vita_tuner_end(params, size);
     return PTP_RC_OK;
 }
 
+/*
+ * Tells whether the packet whose header was just read belongs to a
+ * transaction before the current one, which is what is left over when
+ * a transaction is cancelled. The packet itself stays unread.
+ */
+static int
+ptp_ptpip_is_stale(PTPParams *params, struct ptpip_rxbuf *rx, PTPIPHeader *hdr, uint32_t transaction_id)
+{
+    unsigned long len = dtoh32(hdr->length) - sizeof(PTPIPHeader);
+    unsigned long offset;
+
+    switch (dtoh32(hdr->type))
+    {
+    case PTPIP_START_DATA_PACKET:
+    case PTPIP_DATA_PACKET:
+    case PTPIP_END_DATA_PACKET:
+        offset = ptpip_data_transid;
+        break;
+
+    case PTPIP_CMD_RESPONSE:
+        offset = ptpip_resp_transid;
+        break;
+
+    default:
+        return 0;
+    }
+
+    if (len < offset + sizeof(uint32_t) || ptp_ptpip_rx_fill(rx, offset + sizeof(uint32_t)) != PTP_RC_OK)
+        return 0;
+
+    return dtoh32a(rx->buf + rx->start + offset) < transaction_id;
+}
+
+/* Reads headers until one of a packet that is not stale, skipping the others */
+static uint16_t
+ptp_ptpip_read_current_header(PTPParams *params, PTPIPHeader *hdr, uint32_t transaction_id)
+{
+    struct ptpip_rxbuf  *rx = params->cmdrx;
+    uint16_t        ret;
+
+    while (1)
+    {
+        if ((ret = ptp_ptpip_read_header(params, rx, hdr)) != PTP_RC_OK)
+            return ret;
+
+        if (!ptp_ptpip_is_stale(params, rx, hdr, transaction_id))
+            return PTP_RC_OK;
+
+        VitaMTP_Log(VitaMTP_DEBUG, "ptpip: skipping packet type %d of an earlier transaction\n", dtoh32(hdr->type));
+
+        if ((ret = ptp_ptpip_rx_skip(rx, dtoh32(hdr->length) - sizeof(PTPIPHeader))) != PTP_RC_OK)
+            return ret;
+    }
+}
+
 uint16_t
 ptp_ptpip_getdata(PTPParams *params, PTPContainer *ptp, PTPDataHandler *handler)
 {
+    struct ptpip_rxbuf  *rx = params->cmdrx;
     PTPIPHeader     hdr;
     unsigned char       *xdata = NULL;
     uint16_t        ret;
     unsigned long       toread, curread;
-    int         xret;
+    int         xret = PTP_RC_OK;
 
-    ret = ptp_ptpip_cmd_read(params, &hdr, &xdata);
+    // a cancelled transaction may have left its data and response behind
+    ret = ptp_ptpip_read_current_header(params, &hdr, ptp->Transaction_ID);
 
     if (ret != PTP_RC_OK)
         return ret;
 
-    if (dtoh32(hdr.type) == PTPIP_CMD_RESPONSE)   /* might happen if we have no data transfer due to error? */
-    {
-        VitaMTP_Log(VitaMTP_ERROR, "ptpip/getdata: Unexpected ptp response, code %x\n", dtoh32a(&xdata[8]));
-        return PTP_RC_GeneralError;
+    ret = ptp_ptpip_read_payload(params, rx, &hdr, &xdata);
+
+    if (ret != PTP_RC_OK)
+        return ret;
+
+    if (dtoh32(hdr.type) == PTPIP_CMD_RESPONSE)   /* might happen if we have no data transfer due to error? */
+    {
+        VitaMTP_Log(VitaMTP_ERROR, "ptpip/getdata: Unexpected ptp response, code %x\n", dtoh16a(&xdata[0]));
+        return PTP_RC_GeneralError;
     }
 
     if (dtoh32(hdr.type) != PTPIP_START_DATA_PACKET)
@@ -433,92 +818,115 @@ ptp_ptpip_getdata(PTPParams *params, PTPContainer *ptp, PTPDataHandler *handler)
         return PTP_RC_GeneralError;
     }
 
-    toread = dtoh32a(&xdata[ptpip_data_payload]);
-    free(xdata);
-    xdata = NULL;
+    toread = dtoh32a(&xdata[ptpip_startdata_totallen]);
     curread = 0;
 
     while (curread < toread)
     {
-        ret = ptp_ptpip_cmd_read(params, &hdr, &xdata);
+        unsigned long datalen;
+
+        ret = ptp_ptpip_read_header(params, rx, &hdr);
 
         if (ret != PTP_RC_OK)
             return ret;
 
-        if (dtoh32(hdr.type) == PTPIP_END_DATA_PACKET)
+        datalen = dtoh32(hdr.length) - sizeof(PTPIPHeader);
+
+        if (dtoh32(hdr.type) != PTPIP_DATA_PACKET && dtoh32(hdr.type) != PTPIP_END_DATA_PACKET)
         {
-            unsigned long written;
-            unsigned long datalen = dtoh32(hdr.length)-8-ptpip_data_payload;
+            VitaMTP_Log(VitaMTP_ERROR, "ptpip/getdata: ret type %d\n", dtoh32(hdr.type));
 
-            if (datalen > (toread-curread))
-            {
-                VitaMTP_Log(VitaMTP_ERROR, "ptpip/getdata: returned data is too much, expected %ld, got %ld\n",
-                            (toread-curread),datalen
-                           );
-                break;
-            }
+            if ((ret = ptp_ptpip_rx_skip(rx, datalen)) != PTP_RC_OK)
+                return ret;
 
-            xret = handler->putfunc(params, handler->priv,
-                                    datalen, xdata+ptpip_data_payload, &written
-                                   );
+            continue;
+        }
 
-            if (xret == -1)
-            {
-                VitaMTP_Log(VitaMTP_ERROR, "ptpip/getdata: failed to putfunc of returned data\n");
-                break;
-            }
+        if (datalen < ptpip_data_payload)
+        {
+            VitaMTP_Log(VitaMTP_ERROR, "ptpip/getdata: data packet too short\n");
+            return PTP_RC_GeneralError;
+        }
 
-            curread += written;
-            free(xdata);
-            xdata = NULL;
-            continue;
+        if ((ret = ptp_ptpip_rx_skip(rx, ptpip_data_payload)) != PTP_RC_OK)
+            return ret;
+
+        datalen -= ptpip_data_payload;
+
+        if (datalen > (toread-curread))
+        {
+            VitaMTP_Log(VitaMTP_ERROR, "ptpip/getdata: returned data is too much, expected %ld, got %ld\n",
+                        (toread-curread),datalen
+                       );
+            ptp_ptpip_rx_skip(rx, datalen);
+            break;
         }
 
-        if (dtoh32(hdr.type) == PTPIP_DATA_PACKET)
+        /* hand the handler whatever part of the payload is buffered */
+        while (datalen > 0)
         {
             unsigned long written;
-            unsigned long datalen = dtoh32(hdr.length)-8-ptpip_data_payload;
+            unsigned long slice;
 
-            if (datalen > (toread-curread))
-            {
-                VitaMTP_Log(VitaMTP_ERROR, "ptpip/getdata: returned data is too much, expected %ld, got %ld\n",
-                            (toread-curread),datalen
-                           );
-                break;
-            }
+            if ((ret = ptp_ptpip_rx_fill(rx, 1)) != PTP_RC_OK)
+                return ret;
+
+            slice = rx->end - rx->start;
+
+            if (slice > datalen)
+                slice = datalen;
 
             xret = handler->putfunc(params, handler->priv,
-                                    datalen, xdata+ptpip_data_payload, &written
+                                    slice, rx->buf + rx->start, &written
                                    );
+            rx->start += slice;
+            datalen -= slice;
 
-            if (xret == -1)
+            if (xret != PTP_RC_OK)
             {
                 VitaMTP_Log(VitaMTP_ERROR, "ptpip/getdata: failed to putfunc of returned data\n");
+                /* keep the stream in step for the response */
+                ptp_ptpip_rx_skip(rx, datalen);
                 break;
             }
 
             curread += written;
-            free(xdata);
-            xdata = NULL;
-            continue;
         }
 
-        VitaMTP_Log(VitaMTP_ERROR, "ptpip/getdata: ret type %d\n", hdr.type);
+        if (xret != PTP_RC_OK)
+            break;
     }
 
+    if (xret == PTP_ERROR_CANCEL)
+        return PTP_ERROR_CANCEL;
+
     if (curread < toread)
         return PTP_RC_GeneralError;
 
     return PTP_RC_OK;
 }
 
-#define ptpip_resp_code     0
-#define ptpip_resp_transid  2
-#define ptpip_resp_param1   6
-#define ptpip_resp_param2   10
-#define ptpip_resp_param3   14
-#define ptpip_resp_param4   18
-#define ptpip_resp_param5   22
+/* Tells the Vita to stop the data phase of a transaction we aborted */
+uint16_t
+ptp_ptpip_cancelreq(PTPParams *params, uint32_t transaction_id)
+{
+    unsigned char   request[12];
+    ssize_t ret;
+
+    htod32a(&request[ptpip_type],PTPIP_CANCEL_TRANSACTION);
+    htod32a(&request[ptpip_len],sizeof(request));
+    htod32a(&request[8],transaction_id);
+    VitaMTP_Log(VitaMTP_DEBUG, "ptpip/cancelreq: transaction %d\n", transaction_id);
+    ret = send((socket_t)params->cmdfd, request, sizeof(request), 0);
+
+    if (ret != sizeof(request))
+    {
+        VitaMTP_Log(VitaMTP_ERROR, "ptpip/cancelreq: cannot send cancel\n");
+        return PTP_ERROR_IO;
+    }
+
+    return PTP_RC_OK;
+}
 
 uint16_t
 ptp_ptpip_getresp(PTPParams *params, PTPContainer *resp)
@@ -528,7 +936,25 @@ ptp_ptpip_getresp(PTPParams *params, PTPContainer *resp)
     uint16_t    ret;
     int     n;
 
-    ret = ptp_ptpip_cmd_read(params, &hdr, &data);
+    // skip what is left of a cancelled data phase
+    while (1)
+    {
+        ret = ptp_ptpip_read_header(params, params->cmdrx, &hdr);
+
+        if (ret != PTP_RC_OK)
+            return ret;
+
+        if (dtoh32(hdr.type) == PTPIP_CMD_RESPONSE)
+            break;
+
+        VitaMTP_Log(VitaMTP_DEBUG, "ptpip/getresp: skipping packet type %d\n", dtoh32(hdr.type));
+        ret = ptp_ptpip_rx_skip(params->cmdrx, dtoh32(hdr.length) - sizeof(PTPIPHeader));
+
+        if (ret != PTP_RC_OK)
+            return ret;
+    }
+
+    ret = ptp_ptpip_read_payload(params, params->cmdrx, &hdr, &data);
 
     if (ret != PTP_RC_OK)
         return ret;
@@ -562,7 +988,6 @@ ptp_ptpip_getresp(PTPParams *params, PTPContainer *resp)
         break;
     }
 
-    free(data);
     return PTP_RC_OK;
 }
 
@@ -624,7 +1049,7 @@ ptp_ptpip_init_command_ack(PTPParams *params)
     unsigned char   *data = NULL;
     uint16_t    ret;
 
-    ret = ptp_ptpip_generic_read(params, params->cmdfd, &hdr, &data);
+    ret = ptp_ptpip_cmd_read(params, &hdr, &data);
 
     if (ret != PTP_RC_OK)
         return ret;
@@ -636,7 +1061,6 @@ ptp_ptpip_init_command_ack(PTPParams *params)
     }
 
     params->eventpipeid = dtoh32a(&data[ptpip_cmdack_idx]);
-    free(data);
     return PTP_RC_OK;
 }
 
@@ -694,7 +1118,6 @@ ptp_ptpip_init_event_ack(PTPParams *params)
         return PTP_RC_GeneralError;
     }
 
-    free(data);
     return PTP_RC_OK;
 }
 
@@ -710,11 +1133,11 @@ ptp_ptpip_init_event_ack(PTPParams *params)
 #define ptpip_event_param1  6
 #define ptpip_event_param2  10
 #define ptpip_event_param3  14
-static inline uint16_t
-ptp_ptpip_event(PTPParams *params, PTPContainer *event, int wait)
+
+/* Reads the next event from the event connection, blocks until there is one */
+static uint16_t
+ptp_ptpip_read_event(PTPParams *params, PTPContainer *event)
 {
-    fd_set      infds;
-    struct timeval  timeout;
     int ret;
     unsigned char  *data = NULL;
     PTPIPHeader hdr;
@@ -722,17 +1145,6 @@ ptp_ptpip_event(PTPParams *params, PTPContainer *event, int wait)
 
     while (1)
     {
-        if (wait == PTP_EVENT_CHECK_FAST)
-        {
-            FD_ZERO(&infds);
-            FD_SET((socket_t)params->evtfd, &infds);
-            timeout.tv_sec = 0;
-            timeout.tv_usec = 1;
-
-            if (1 != select(params->evtfd+1, &infds, NULL, NULL, &timeout))
-                return PTP_RC_OK;
-        }
-
         ret = ptp_ptpip_evt_read(params, &hdr, &data);
 
         if (ret != PTP_RC_OK)
@@ -772,20 +1184,34 @@ ptp_ptpip_event(PTPParams *params, PTPContainer *event, int wait)
         break;
     }
 
-    free(data);
     return PTP_RC_OK;
 }
 
-uint16_t
-ptp_ptpip_event_check(PTPParams *params, PTPContainer *event)
-{
-    return ptp_ptpip_event(params, event, PTP_EVENT_CHECK_FAST);
-}
+/*
+ * Big enough for a Wi-Fi link's bandwidth-delay product. It is set
+ * before connecting so the window scale is negotiated for it.
+ */
+#define PTPIP_SOCKET_BUFSIZE    0x100000
 
-uint16_t
-ptp_ptpip_event_wait(PTPParams *params, PTPContainer *event)
+static void
+VitaMTP_PTPIP_Setup_Socket(socket_t sock, int bufsize)
 {
-    return ptp_ptpip_event(params, event, PTP_EVENT_CHECK);
+    int one = 1;
+
+    // requests and responses are single small packets, do not hold them back
+    if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char *)&one, sizeof(one)) < 0)
+    {
+        VitaMTP_Log(VitaMTP_DEBUG, "ptpip/connect: cannot set TCP_NODELAY\n");
+    }
+
+    if (bufsize > 0)
+    {
+        if (setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (const char *)&bufsize, sizeof(bufsize)) < 0 ||
+                setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (const char *)&bufsize, sizeof(bufsize)) < 0)
+        {
+            VitaMTP_Log(VitaMTP_DEBUG, "ptpip/connect: cannot set socket buffer size\n");
+        }
+    }
 }
 
 static int
@@ -812,6 +1238,11 @@ VitaMTP_PTPIP_Connect(PTPParams *params, struct sockaddr_in *saddr, int port)
         return -1;
     }
 
+    params->cmdrx->fd = params->cmdfd;
+    params->evtrx->fd = params->evtfd;
+    VitaMTP_PTPIP_Setup_Socket((socket_t)params->cmdfd, PTPIP_SOCKET_BUFSIZE);
+    VitaMTP_PTPIP_Setup_Socket((socket_t)params->evtfd, 0);
+
     if (-1 == connect((socket_t)params->cmdfd, (struct sockaddr *)saddr, sizeof(struct sockaddr_in)))
     {
         perror("connect cmd");
@@ -952,395 +1383,1062 @@ static int socketpair(int domain, int type, int protocol, SOCKET socks[2])
 }
 #endif
 
-static int VitaMTP_Data_Connect(vita_device_t *device)
+/*
+ * Events are read by a thread of their own as soon as they arrive, even
+ * while a long data phase holds the command connection, and are queued
+ * until the application takes them. notify[0] is readable while events
+ * are queued so the application can poll() it along with its own
+ * descriptors, see VitaMTP_Get_Event_FD().
+ */
+struct ptpip_event_pump
 {
-    device->params = malloc(sizeof(PTPParams));
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    PTPContainer *events; // circular queue
+    int size;
+    int head;
+    int count;
+    uint16_t error; // why the pump stopped, PTP_RC_OK while it runs
+    socket_t notify[2]; // holds one byte for every queued event
+    socket_t wake[2]; // written to stop the pump
+};
 
-    if (device->params == NULL)
-    {
-        VitaMTP_Log(VitaMTP_DEBUG, "out of memory\n");
-        return -1;
-    }
+static int
+ptp_ptpip_event_push(struct ptpip_event_pump *pump, PTPContainer *event)
+{
+    PTPContainer *events;
+    int i;
 
-    memset(device->params, 0, sizeof(PTPParams));
-    device->params->byteorder = PTP_DL_LE;
-#ifdef HAVE_ICONV
-    device->params->cd_locale_to_ucs2 = iconv_open("UCS-2LE", "UTF-8");
-    device->params->cd_ucs2_to_locale = iconv_open("UTF-8", "UCS-2LE");
+    pthread_mutex_lock(&pump->lock);
 
-    if (device->params->cd_locale_to_ucs2 == (iconv_t) -1 ||
-            device->params->cd_ucs2_to_locale == (iconv_t) -1)
+    if (pump->count == pump->size)
     {
-        VitaMTP_Log(VitaMTP_ERROR, "Cannot open iconv() converters to/from UCS-2!\n"
-                    "Too old stdlibc, glibc and libiconv?\n");
-        free(device->params);
-        return -1;
-    }
-
-#endif
-    device->params->sendreq_func    = ptp_ptpip_sendreq;
-    device->params->senddata_func   = ptp_ptpip_senddata;
-    device->params->getresp_func    = ptp_ptpip_getresp;
-    device->params->getdata_func    = ptp_ptpip_getdata;
-    device->params->event_wait  = ptp_ptpip_event_wait;
-    device->params->event_check = ptp_ptpip_event_check;
+        if ((events = malloc(2 * pump->size * sizeof(PTPContainer))) == NULL)
+        {
+            pthread_mutex_unlock(&pump->lock);
+            return -1;
+        }
 
-    if (VitaMTP_PTPIP_Connect(device->params, &device->network_device.addr, device->network_device.data_port) < 0)
-    {
-        VitaMTP_Log(VitaMTP_DEBUG, "cannot connect to PTP/IP protocol\n");
-        free(device->params);
-        return -1;
-    }
+        for (i = 0; i < pump->count; i++)
+        {
+            events[i] = pump->events[(pump->head + i) % pump->size];
+        }
 
-    if (ptp_opensession(device->params, 1) != PTP_RC_OK)
-    {
-        VitaMTP_Log(VitaMTP_DEBUG, "cannot create session\n");
-        free(device->params);
-        return -1;
+        free(pump->events);
+        pump->events = events;
+        pump->size *= 2;
+        pump->head = 0;
     }
 
+    pump->events[(pump->head + pump->count) % pump->size] = *event;
+    pump->count++;
+    send(pump->notify[1], "", 1, 0);
+    pthread_cond_broadcast(&pump->cond);
+    pthread_mutex_unlock(&pump->lock);
     return 0;
 }
 
-static int VitaMTP_Sock_Read_All(socket_t sockfd, unsigned char **p_data, size_t *p_len, struct sockaddr *src_addr,
-                                 socklen_t *addrlen)
+static void *
+ptp_ptpip_event_pump(void *arg)
 {
-    unsigned char buffer[REQUEST_BUFFER_SIZE];
-    unsigned char *data = NULL;
-    ssize_t len = 0;
-    
-    if (VitaMTP_Set_Socket_Blocking(sockfd, 1) < 0)
-    {
-        VitaMTP_Log(VitaMTP_ERROR, "error making socket blocking\n");
-        return -1;
-    }
+    PTPParams *params = (PTPParams *)arg;
+    struct ptpip_event_pump *pump = params->evtpump;
+    struct pollfd fds[3];
+    PTPContainer event;
+    uint16_t ret = PTP_RC_OK;
+
+    fds[0].fd = params->evtfd;
+    fds[0].events = POLLIN;
+    // nothing is read from the command connection here, but if it goes
+    // away the session is over and whoever waits for events has to know
+    fds[1].fd = params->cmdfd;
+    fds[1].events = 0;
+    fds[2].fd = pump->wake[0];
+    fds[2].events = POLLIN;
 
     while (1)
     {
-        ssize_t clen;
-        
-        if (len > 0 && VitaMTP_Set_Socket_Blocking(sockfd, 0) < 0)
-        {
-            VitaMTP_Log(VitaMTP_ERROR, "error making socket non-blocking\n");
-            free(data);
-            return -1;
-        }
-
-        if ((clen = recvfrom(sockfd, buffer, REQUEST_BUFFER_SIZE, 0, src_addr, addrlen)) < 0)
+        // poll() does not see packets that are already buffered
+        if (params->evtrx->start == params->evtrx->end)
         {
-#ifdef _WIN32
-            int err = WSAGetLastError();
-#else
-            int err = errno;
+            if (poll(fds, 3, -1) < 0)
+            {
+#ifndef _WIN32
+                if (errno == EINTR)
+                    continue;
 #endif
-            if (err == SOCK_EWOULDBLOCK)
+                ret = PTP_ERROR_IO;
+                break;
+            }
+
+            if (fds[2].revents)
             {
+                ret = PTP_ERROR_IO;
                 break;
             }
 
-            VitaMTP_Log(VitaMTP_ERROR, "error receiving data from socket, errno: %d\n", err);
-            free(data);
-            return -1;
-        }
+            if (fds[1].revents & (POLLERR | POLLHUP | POLLNVAL))
+            {
+                VitaMTP_Log(VitaMTP_ERROR, "ptpip/event: command connection closed\n");
+                ret = PTP_ERROR_IO;
+                break;
+            }
 
-        if (clen == 0)
-        {
-            break;
+            if (fds[0].revents == 0)
+                continue;
         }
 
-        VitaMTP_Log(VitaMTP_DEBUG, "Recieved %d bytes from socket %d\n", (unsigned int)clen, sockfd);
+        memset(&event, 0, sizeof(PTPContainer));
 
-        if (MASK_SET(g_VitaMTP_logmask, VitaMTP_DEBUG))
+        if ((ret = ptp_ptpip_read_event(params, &event)) != PTP_RC_OK)
+            break;
+
+        if (ptp_ptpip_event_push(pump, &event) < 0)
         {
-            VitaMTP_hex_dump(buffer, (unsigned int)clen, 16);
+            VitaMTP_Log(VitaMTP_ERROR, "ptpip/event: out of memory, dropping event 0x%x\n", event.Code);
         }
-
-        data = realloc(data, len+clen);
-        memcpy(data+len, buffer, clen);
-        len += clen;
     }
 
-    *p_data = data;
-    *p_len = len;
-    return 0;
+    pthread_mutex_lock(&pump->lock);
+    pump->error = ret;
+    // left unread so the descriptor stays readable and the error is seen
+    send(pump->notify[1], "", 1, 0);
+    pthread_cond_broadcast(&pump->cond);
+    pthread_mutex_unlock(&pump->lock);
+    return NULL;
 }
 
-static int VitaMTP_Sock_Write_All(socket_t sockfd, const unsigned char *data, size_t len, const struct sockaddr *dest_addr,
-                                  socklen_t addrlen)
+static int
+ptp_ptpip_event_pump_start(PTPParams *params)
 {
-    while (1)
-    {
-        ssize_t clen;
-
-        if ((clen = sendto(sockfd, data, len, 0, dest_addr, addrlen)) == len)
-        {
-            break;
-        }
-
-        if (clen < 0)
-        {
-            return -1;
-        }
+    struct ptpip_event_pump *pump;
 
-        data += clen;
-        len -= clen;
+    if ((pump = calloc(1, sizeof(struct ptpip_event_pump))) == NULL)
+    {
+        return -1;
     }
 
-    VitaMTP_Log(VitaMTP_DEBUG, "Sent %d bytes to socket %d\n", (unsigned int)len, sockfd);
+    pump->size = 16;
+    pump->error = PTP_RC_OK;
 
-    if (MASK_SET(g_VitaMTP_logmask, VitaMTP_DEBUG))
+    if ((pump->events = malloc(pump->size * sizeof(PTPContainer))) == NULL)
     {
-        VitaMTP_hex_dump(data, (unsigned int)len, 16);
+        free(pump);
+        return -1;
     }
 
-    return 0;
-}
-
-/**
- * Starts broadcasting host
- *
- * This is typically called in a separate thread from the listener thread, 
- * which waits on a device to try to connect via VitaMTP_Get_First_Wireless_Vita().
- * @param info pointer to structure containing information to show device
- * @param host_addr set to 0 if listen on all interfaces, otherwise the IP to listen on
- */
-int VitaMTP_Broadcast_Host(wireless_host_info_t *info, unsigned int host_addr)
-{
-    char *host_response;
-
-    if (asprintf(&host_response,
-                 "HTTP/1.1 200 OK\r\nhost-id:%s\r\nhost-type:%s\r\nhost-name:%s\r\nhost-mtp-protocol-version:%08d\r\nhost-request-port:%d\r\nhost-wireless-protocol-version:%08d\r\n",
-                 info->guid, info->type, info->name, VITAMTP_PROTOCOL_MAX_VERSION, info->port, VITAMTP_WIRELESS_MAX_VERSION) < 0)
+    if (socketpair(PF_LOCAL, SOCK_STREAM, 0, pump->notify) < 0)
     {
-        VitaMTP_Log(VitaMTP_ERROR, "out of memory\n");
-        free(host_response);
+        free(pump->events);
+        free(pump);
         return -1;
     }
 
-    socket_t sock;
-    struct sockaddr_in si_host;
-    struct sockaddr_in si_client;
-    unsigned int slen = sizeof(si_client);
-    
-#ifdef _WIN32
-    WSADATA wsa_data;
-    if (WSAStartup(0x202, &wsa_data) != 0)
+    if (socketpair(PF_LOCAL, SOCK_STREAM, 0, pump->wake) < 0)
     {
-        VitaMTP_Log(VitaMTP_ERROR, "cannot setup winsock\n");
+        closesocket(pump->notify[0]);
+        closesocket(pump->notify[1]);
+        free(pump->events);
+        free(pump);
         return -1;
     }
-#endif
 
-    if ((sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == INVALID_SOCKET)
-    {
-        VitaMTP_Log(VitaMTP_ERROR, "cannot create broadcast socket\n");
-        free(host_response);
+    // neither end may ever block while the lock is held
+    VitaMTP_Set_Socket_Blocking(pump->notify[0], 0);
+    VitaMTP_Set_Socket_Blocking(pump->notify[1], 0);
+    pthread_mutex_init(&pump->lock, NULL);
+    pthread_cond_init(&pump->cond, NULL);
+    params->evtpump = pump;
+
+    if (pthread_create(&pump->thread, NULL, ptp_ptpip_event_pump, params) != 0)
+    {
+        VitaMTP_Log(VitaMTP_ERROR, "ptpip/event: cannot start event thread\n");
+        params->evtpump = NULL;
+        pthread_mutex_destroy(&pump->lock);
+        pthread_cond_destroy(&pump->cond);
+        closesocket(pump->wake[0]);
+        closesocket(pump->wake[1]);
+        closesocket(pump->notify[0]);
+        closesocket(pump->notify[1]);
+        free(pump->events);
+        free(pump);
         return -1;
     }
 
-    memset(&si_host, 0, sizeof(si_host));
-    si_host.sin_family = AF_INET;
-    si_host.sin_port = htons(info->port);
-    si_host.sin_addr.s_addr = host_addr ? htonl(host_addr) : htonl(INADDR_ANY);
+    return 0;
+}
 
-    if (bind(sock, (struct sockaddr *)&si_host, sizeof(si_host)) < 0)
+/* Stops the pump, the event socket must still be open */
+static void
+ptp_ptpip_event_pump_stop(PTPParams *params)
+{
+    struct ptpip_event_pump *pump = params->evtpump;
+
+    if (pump == NULL)
     {
-        VitaMTP_Log(VitaMTP_ERROR, "cannot bind listening socket\n");
-        free(host_response);
-        return -1;
+        return;
     }
 
-    char *data;
-    size_t len;
-    fd_set fd;
-    enum broadcast_command cmd;
+    send(pump->wake[1], "", 1, 0);
+    // in case it is in the middle of reading a packet
+    shutdown((socket_t)params->evtfd, 2);
+    pthread_join(pump->thread, NULL);
+    params->evtpump = NULL;
+    pthread_mutex_destroy(&pump->lock);
+    pthread_cond_destroy(&pump->cond);
+    closesocket(pump->wake[0]);
+    closesocket(pump->wake[1]);
+    closesocket(pump->notify[0]);
+    closesocket(pump->notify[1]);
+    free(pump->events);
+    free(pump);
+}
+
+static inline uint16_t
+ptp_ptpip_event(PTPParams *params, PTPContainer *event, int wait)
+{
+    struct ptpip_event_pump *pump = params->evtpump;
+    uint16_t ret;
+    char c;
 
-    // in case a prevous broadcast went wrong
-    if (g_broadcast_command_fds[1])
+    if (pump == NULL)
     {
-        closesocket(g_broadcast_command_fds[1]);
+        return PTP_ERROR_IO;
     }
-    
-    if (socketpair(PF_LOCAL, SOCK_DGRAM, IPPROTO_IP, g_broadcast_command_fds) < 0)
+
+    pthread_mutex_lock(&pump->lock);
+
+    while (wait == PTP_EVENT_CHECK && pump->count == 0 && pump->error == PTP_RC_OK)
+    {
+        pthread_cond_wait(&pump->cond, &pump->lock);
+    }
+
+    if (pump->count > 0)
     {
-        VitaMTP_Log(VitaMTP_ERROR, "failed to create broadcast command socket pair\n");
+        *event = pump->events[pump->head];
+        pump->head = (pump->head + 1) % pump->size;
+        pump->count--;
+        recv(pump->notify[0], &c, 1, 0);
+        ret = PTP_RC_OK;
     }
     else
     {
-        VitaMTP_Log(VitaMTP_DEBUG, "start broadcasting as: %s\n", info->name);
+        ret = pump->error;
     }
 
-    while (g_broadcast_command_fds[0])
+    pthread_mutex_unlock(&pump->lock);
+    return ret;
+}
+
+uint16_t
+ptp_ptpip_event_check(PTPParams *params, PTPContainer *event)
+{
+    return ptp_ptpip_event(params, event, PTP_EVENT_CHECK_FAST);
+}
+
+uint16_t
+ptp_ptpip_event_wait(PTPParams *params, PTPContainer *event)
+{
+    return ptp_ptpip_event(params, event, PTP_EVENT_CHECK);
+}
+
+/**
+ * Gets a descriptor that is readable while events are waiting
+ *
+ * An application can poll() or select() it along with its own
+ * descriptors instead of keeping a thread blocked in
+ * VitaMTP_Read_Event(). While it is readable VitaMTP_Read_Event() does
+ * not block. It stays readable after the connection is lost so that
+ * VitaMTP_Read_Event() can report it.
+ * @param device a pointer to the device.
+ * @return the descriptor, or -1 if the device has none (USB devices).
+ */
+int VitaMTP_Get_Event_FD(vita_device_t *device)
+{
+    if (device->params->evtpump == NULL)
     {
-        FD_ZERO(&fd);
-        FD_SET(sock, &fd);
-        FD_SET(g_broadcast_command_fds[0], &fd);
+        return -1;
+    }
 
-        if (select(FD_SETSIZE, &fd, NULL, NULL, NULL) < 0)
+    return (int)device->params->evtpump->notify[0];
+}
+
+static int VitaMTP_Data_Connect(vita_device_t *device)
+{
+    device->params = malloc(sizeof(PTPParams));
+
+    if (device->params == NULL)
+    {
+        VitaMTP_Log(VitaMTP_DEBUG, "out of memory\n");
+        return -1;
+    }
+
+    memset(device->params, 0, sizeof(PTPParams));
+    device->params->byteorder = PTP_DL_LE;
+#ifdef HAVE_ICONV
+    device->params->cd_locale_to_ucs2 = iconv_open("UCS-2LE", "UTF-8");
+    device->params->cd_ucs2_to_locale = iconv_open("UTF-8", "UCS-2LE");
+
+    if (device->params->cd_locale_to_ucs2 == (iconv_t) -1 ||
+            device->params->cd_ucs2_to_locale == (iconv_t) -1)
+    {
+        VitaMTP_Log(VitaMTP_ERROR, "Cannot open iconv() converters to/from UCS-2!\n"
+                    "Too old stdlibc, glibc and libiconv?\n");
+        free(device->params);
+        return -1;
+    }
+
+#endif
+    device->params->sendreq_func    = ptp_ptpip_sendreq;
+    device->params->senddata_func   = ptp_ptpip_senddata;
+    device->params->getresp_func    = ptp_ptpip_getresp;
+    device->params->getdata_func    = ptp_ptpip_getdata;
+    device->params->event_wait  = ptp_ptpip_event_wait;
+    device->params->cancelreq_func  = ptp_ptpip_cancelreq;
+    device->params->event_check = ptp_ptpip_event_check;
+
+    if (vita_tuner_init(device->params, g_ptpip_block_sizes, sizeof(g_ptpip_block_sizes)/sizeof(uint32_t)) < 0)
+    {
+        free(device->params);
+        return -1;
+    }
+
+    if (vita_scheduler_init(device->params) < 0)
+    {
+        vita_tuner_free(device->params);
+        free(device->params);
+        return -1;
+    }
+
+    if (ptp_ptpip_rxbuf_init(device->params) < 0)
+    {
+        vita_scheduler_free(device->params);
+        vita_tuner_free(device->params);
+        free(device->params);
+        return -1;
+    }
+
+    if (VitaMTP_PTPIP_Connect(device->params, &device->network_device.addr, device->network_device.data_port) < 0)
+    {
+        VitaMTP_Log(VitaMTP_DEBUG, "cannot connect to PTP/IP protocol\n");
+        ptp_ptpip_rxbuf_free(device->params);
+        vita_scheduler_free(device->params);
+        vita_tuner_free(device->params);
+        free(device->params);
+        return -1;
+    }
+
+    if (ptp_ptpip_event_pump_start(device->params) < 0)
+    {
+        closesocket((socket_t)device->params->cmdfd);
+        closesocket((socket_t)device->params->evtfd);
+        ptp_ptpip_rxbuf_free(device->params);
+        vita_scheduler_free(device->params);
+        vita_tuner_free(device->params);
+        free(device->params);
+        return -1;
+    }
+
+    if (ptp_opensession(device->params, 1) != PTP_RC_OK)
+    {
+        VitaMTP_Log(VitaMTP_DEBUG, "cannot create session\n");
+        ptp_ptpip_event_pump_stop(device->params);
+        closesocket((socket_t)device->params->cmdfd);
+        closesocket((socket_t)device->params->evtfd);
+        ptp_ptpip_rxbuf_free(device->params);
+        vita_scheduler_free(device->params);
+        vita_tuner_free(device->params);
+        free(device->params);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int VitaMTP_Sock_Write_All(socket_t sockfd, const unsigned char *data, size_t len, const struct sockaddr *dest_addr,
+                                  socklen_t addrlen)
+{
+    while (1)
+    {
+        ssize_t clen;
+
+        if ((clen = sendto(sockfd, data, len, 0, dest_addr, addrlen)) == len)
         {
-            VitaMTP_Log(VitaMTP_ERROR, "Error polling broadcast socket\n");
             break;
         }
 
-        if (FD_ISSET(g_broadcast_command_fds[0], &fd))
+        if (clen < 0)
         {
-            if (recv(g_broadcast_command_fds[0], (char *)&cmd, sizeof(enum broadcast_command), 0) < sizeof(enum broadcast_command))
+            return -1;
+        }
+
+        data += clen;
+        len -= clen;
+    }
+
+    VitaMTP_Log(VitaMTP_DEBUG, "Sent %d bytes to socket %d\n", (unsigned int)len, sockfd);
+
+    if (MASK_SET(g_VitaMTP_logmask, VitaMTP_DEBUG))
+    {
+        VitaMTP_hex_dump(data, (unsigned int)len, 16);
+    }
+
+    return 0;
+}
+
+static inline int VitaMTP_Sock_Would_Block(void)
+{
+#ifdef _WIN32
+    return WSAGetLastError() == SOCK_EWOULDBLOCK;
+#else
+    return errno == SOCK_EWOULDBLOCK || errno == EAGAIN || errno == EINTR;
+#endif
+}
+
+static inline void VitaMTP_Parse_Device_Headers(char *data, wireless_vita_info_t *info, char **p_host, char **p_pin)
+{
+    char *info_str = strtok(data, "\r\n");
+
+    while (info_str != NULL)
+    {
+        if (strncmp(info_str, "host-id:", strlen("host-id:")) == 0)
+        {
+            if (p_host) *p_host = info_str + strlen("host-id:");
+        }
+        else if (strncmp(info_str, "device-id:", strlen("device-id:")) == 0)
+        {
+            info->deviceid = info_str + strlen("device-id:");
+        }
+        else if (strncmp(info_str, "device-type:", strlen("device-type:")) == 0)
+        {
+            info->type = info_str + strlen("device-type:");
+        }
+        else if (strncmp(info_str, "device-mac-address:", strlen("device-mac-address:")) == 0)
+        {
+            info->mac_addr = info_str + strlen("device-mac-address:");
+        }
+        else if (strncmp(info_str, "device-name:", strlen("device-name:")) == 0)
+        {
+            info->name = info_str + strlen("device-name:");
+        }
+        else if (strncmp(info_str, "pin-code:", strlen("pin-code:")) == 0)
+        {
+            if (p_pin) *p_pin = info_str + strlen("pin-code:");
+        }
+        else
+        {
+            VitaMTP_Log(VitaMTP_INFO, "Unknown field in Vita registration request: %s\n", info_str);
+        }
+
+        info_str = strtok(NULL, "\r\n");
+    }
+}
+
+#define SERVER_MAX_SOCKETS 64
+#define DISCOVERY_BUFFER_SIZE 512
+#define CLIENT_BUFFER_SIZE 1024
+
+enum vita_server_socket
+{
+    ServerCommand,
+    ServerDiscovery,
+    ServerListener,
+    ServerClient,
+    ServerConnect
+};
+
+/*
+ * A Vita going through the CONNECT/SHOWPIN/REGISTER/STANDBY handshake.
+ * Requests are NUL terminated and collected in buffer until complete.
+ */
+struct vita_server_client
+{
+    struct sockaddr_in addr;
+    char guid[33];
+    int data_port;
+    int pin;
+    int standby;
+    size_t len;
+    char buffer[CLIENT_BUFFER_SIZE];
+};
+
+/*
+ * The data connection to a Vita that finished the handshake. Connecting
+ * and opening the session can take long, so it is done on a thread of
+ * its own, which reports back through notify. If the server stops first
+ * it marks the connection abandoned and the thread cleans up after itself.
+ */
+struct vita_server_connect
+{
+    pthread_mutex_t lock;
+    vita_device_t *device; // NULL once connecting failed
+    int done;
+    int abandoned;
+    socket_t notify[2];
+};
+
+/*
+ * Serves discovery, registration and the handshake of any number of
+ * Vitas from one thread. All sockets are non-blocking and are only read
+ * when poll() finds them ready, so one slow Vita does not hold up the
+ * others and search requests are answered as they arrive.
+ */
+struct vita_server
+{
+    struct pollfd fds[SERVER_MAX_SOCKETS];
+    enum vita_server_socket types[SERVER_MAX_SOCKETS];
+    struct vita_server_client *clients[SERVER_MAX_SOCKETS];
+    struct vita_server_connect *connects[SERVER_MAX_SOCKETS];
+    int num_fds;
+    int running;
+    char *host_response;
+    device_registered_callback_t is_registered;
+    register_device_callback_t create_register_pin;
+    device_connected_callback_t device_connected; // if NULL, stop at the first device
+    vita_device_t *first;
+    char (*registered)[33]; // devices that registered with this server
+    int num_registered;
+};
+
+static int VitaMTP_Server_Add(struct vita_server *server, socket_t sock, enum vita_server_socket type,
+                              struct vita_server_client *client)
+{
+    if (server->num_fds == SERVER_MAX_SOCKETS)
+    {
+        VitaMTP_Log(VitaMTP_ERROR, "too many connections\n");
+        return -1;
+    }
+
+    if (VitaMTP_Set_Socket_Blocking(sock, 0) < 0)
+    {
+        VitaMTP_Log(VitaMTP_ERROR, "error making socket non-blocking\n");
+        return -1;
+    }
+
+    server->fds[server->num_fds].fd = sock;
+    server->fds[server->num_fds].events = POLLIN;
+    server->fds[server->num_fds].revents = 0;
+    server->types[server->num_fds] = type;
+    server->clients[server->num_fds] = client;
+    server->connects[server->num_fds] = NULL;
+    server->num_fds++;
+    return 0;
+}
+
+static void VitaMTP_Server_Free_Connect(struct vita_server_connect *connect)
+{
+    closesocket(connect->notify[1]);
+    pthread_mutex_destroy(&connect->lock);
+    free(connect);
+}
+
+/* Closes a socket, the slot is reclaimed after the current poll() round */
+static void VitaMTP_Server_Drop(struct vita_server *server, int i)
+{
+    struct vita_server_connect *connect = server->connects[i];
+    int done;
+
+    if (server->types[i] == ServerCommand)
+    {
+        g_broadcast_command_fds[0] = -1;
+    }
+
+    if (connect != NULL)
+    {
+        pthread_mutex_lock(&connect->lock);
+        done = connect->done;
+        connect->abandoned = 1;
+        pthread_mutex_unlock(&connect->lock);
+
+        // still connecting, the thread frees it
+        if (done)
+        {
+            if (connect->device)
             {
-                VitaMTP_Log(VitaMTP_ERROR, "Error recieving broadcast command. Stopping broadcast.\n");
-                cmd = BroadcastStop;
+                VitaMTP_Release_Wireless_Device(connect->device);
             }
 
-            if (cmd == BroadcastStop)
+            VitaMTP_Server_Free_Connect(connect);
+        }
+
+        server->connects[i] = NULL;
+    }
+
+    closesocket((socket_t)server->fds[i].fd);
+    free(server->clients[i]);
+    server->clients[i] = NULL;
+    server->fds[i].fd = INVALID_SOCKET;
+}
+
+static int VitaMTP_Server_Is_Registered(struct vita_server *server, const char *guid)
+{
+    int i;
+
+    for (i = 0; i < server->num_registered; i++)
+    {
+        if (strcmp(server->registered[i], guid) == 0)
+        {
+            return 1;
+        }
+    }
+
+    return server->is_registered(guid);
+}
+
+static void VitaMTP_Server_Set_Registered(struct vita_server *server, const char *guid)
+{
+    char (*registered)[33];
+
+    if ((registered = realloc(server->registered, (server->num_registered + 1) * sizeof(*registered))) == NULL)
+    {
+        VitaMTP_Log(VitaMTP_ERROR, "out of memory\n");
+        return;
+    }
+
+    strcpy(registered[server->num_registered++], guid);
+    server->registered = registered;
+}
+
+static void VitaMTP_Server_Discovery(struct vita_server *server, socket_t sock)
+{
+    char data[DISCOVERY_BUFFER_SIZE+1];
+    struct sockaddr_in si_client;
+    socklen_t slen;
+    ssize_t len;
+
+    // every datagram is a whole request, answer all that are queued
+    while (1)
+    {
+        slen = sizeof(si_client);
+
+        if ((len = recvfrom(sock, data, DISCOVERY_BUFFER_SIZE, 0, (struct sockaddr *)&si_client, &slen)) < 0)
+        {
+            if (!VitaMTP_Sock_Would_Block())
             {
-                free(data);
-                break;
+                VitaMTP_Log(VitaMTP_ERROR, "error receiving broadcast data\n");
             }
-            else
+
+            return;
+        }
+
+        data[len] = '\0';
+        VitaMTP_Log(VitaMTP_DEBUG, "Recieved %d bytes from socket %d\n", (unsigned int)len, sock);
+
+        if (MASK_SET(g_VitaMTP_logmask, VitaMTP_DEBUG))
+        {
+            VitaMTP_hex_dump((unsigned char *)data, (unsigned int)len, 16);
+        }
+
+        if (strcmp(data, "SRCH * HTTP/1.1\r\n"))
+        {
+            VitaMTP_Log(VitaMTP_DEBUG, "Unknown request: %.*s\n", (int)len, data);
+            continue;
+        }
+
+        if (VitaMTP_Sock_Write_All(sock, (unsigned char *)server->host_response, strlen(server->host_response)+1,
+                                   (struct sockaddr *)&si_client, slen) < 0)
+        {
+            VitaMTP_Log(VitaMTP_ERROR, "error sending response\n");
+        }
+    }
+}
+
+static void VitaMTP_Server_Accept(struct vita_server *server, socket_t sock)
+{
+    struct vita_server_client *client;
+    struct sockaddr_in si_client;
+    socklen_t slen;
+    socket_t c_sock;
+
+    while (1)
+    {
+        slen = sizeof(si_client);
+
+        if ((c_sock = accept(sock, (struct sockaddr *)&si_client, &slen)) == INVALID_SOCKET)
+        {
+            if (!VitaMTP_Sock_Would_Block())
             {
-                VitaMTP_Log(VitaMTP_ERROR, "Unknown command recieved: %d\n", cmd);
+                VitaMTP_Log(VitaMTP_ERROR, "Error accepting connection\n");
             }
+
+            return;
         }
 
-        if (!FD_ISSET(sock, &fd))
+        VitaMTP_Log(VitaMTP_DEBUG, "Found new client.\n");
+
+        if ((client = calloc(1, sizeof(struct vita_server_client))) == NULL)
         {
+            VitaMTP_Log(VitaMTP_ERROR, "out of memory\n");
+            closesocket(c_sock);
             continue;
         }
 
-        if (VitaMTP_Sock_Read_All(sock, (unsigned char **)&data, &len, (struct sockaddr *)&si_client, &slen) < 0)
+        client->addr = si_client;
+        client->pin = -1;
+
+        if (VitaMTP_Server_Add(server, c_sock, ServerClient, client) < 0)
         {
-            VitaMTP_Log(VitaMTP_ERROR, "error receiving broadcast data\n");
-            free(host_response);
-            closesocket(sock);
-            closesocket(g_broadcast_command_fds[0]);
-            closesocket(g_broadcast_command_fds[1]);
-            g_broadcast_command_fds[0] = -1;
-            g_broadcast_command_fds[1] = -1;
+            free(client);
+            closesocket(c_sock);
+        }
+    }
+}
+
+/* Answers one handshake request, returns negative to drop the client */
+static int VitaMTP_Server_Request(struct vita_server *server, struct vita_server_client *client, socket_t c_sock,
+                                  char *data)
+{
+    char resp[RESPONSE_MAX_SIZE];
+    char method[21];
+    int read;
+
+    if (sscanf(data, "%20s * HTTP/1.1\r\n%n", method, &read) < 1)
+    {
+        VitaMTP_Log(VitaMTP_ERROR, "Device request malformed: %s\n", data);
+        return -1;
+    }
+
+    if (strcmp(method, "CONNECT") == 0)
+    {
+        if (sscanf(data+read, "device-id:%32s\r\ndevice-port:%d\r\n", client->guid, &client->data_port) < 2)
+        {
+            VitaMTP_Log(VitaMTP_ERROR, "Error parsing device request\n");
             return -1;
         }
 
-        if (len == 0)
-        {
-            //VitaMTP_Log(VitaMTP_DEBUG, "No clients found.\n");
-            sleep(1);
-            continue;
-        }
+        if (VitaMTP_Server_Is_Registered(server, client->guid))
+        {
+            strcpy(resp, "HTTP/1.1 210 OK\r\n");
+        }
+        else
+        {
+            strcpy(resp, "HTTP/1.1 605 NG\r\n");
+        }
+    }
+    else if (strcmp(method, "SHOWPIN") == 0)
+    {
+        wireless_vita_info_t info = {0};
+        int err;
+        VitaMTP_Parse_Device_Headers(data+read, &info, NULL, NULL);
+
+        if (info.deviceid == NULL)
+        {
+            VitaMTP_Log(VitaMTP_ERROR, "Error parsing device request\n");
+            return -1;
+        }
+
+        strncpy(client->guid, info.deviceid, 32);
+        client->guid[32] = '\0';
+        // TODO: Check if host GUID is actually our GUID
+        const char *okay = "HTTP/1.1 200 OK\r\n";
+
+        if (VitaMTP_Sock_Write_All(c_sock, (const unsigned char *)okay, strlen(okay)+1, NULL, 0) < 0)
+        {
+            VitaMTP_Log(VitaMTP_ERROR, "Error sending request result\n");
+            return -1;
+        }
+
+        if ((client->pin = server->create_register_pin(&info, &err)) >= 0)
+        {
+            return 0;
+        }
+
+        snprintf(resp, sizeof(resp), "REGISTERCANCEL * HTTP/1.1\r\nerrorcode:%d\r\n", err);
+    }
+    else if (strcmp(method, "REGISTER") == 0)
+    {
+        wireless_vita_info_t info = {0};
+        char *pin_try = NULL;
+        VitaMTP_Parse_Device_Headers(data+read, &info, NULL, &pin_try);
+
+        if (info.deviceid == NULL || strcmp(client->guid, info.deviceid))
+        {
+            VitaMTP_Log(VitaMTP_ERROR, "PIN generated for device %s, but response came from %s!\n", client->guid,
+                        info.deviceid ? info.deviceid : "(none)");
+            strcpy(resp, "HTTP/1.1 610 NG\r\n");
+        }
+        else if (client->pin < 0)
+        {
+            VitaMTP_Log(VitaMTP_ERROR, "No PIN generated. Cannot register device %s.\n", info.deviceid);
+            strcpy(resp, "HTTP/1.1 610 NG\r\n");
+        }
+        else if (pin_try == NULL || client->pin != atoi(pin_try))
+        {
+            VitaMTP_Log(VitaMTP_ERROR, "PIN mismatch. Correct: %08d, Got: %s\n", client->pin, pin_try ? pin_try : "(none)");
+            strcpy(resp, "HTTP/1.1 610 NG\r\n");
+        }
+        else
+        {
+            VitaMTP_Server_Set_Registered(server, client->guid);
+            strcpy(resp, "HTTP/1.1 200 OK\r\n");
+        }
+    }
+    else if (strcmp(method, "STANDBY") == 0)
+    {
+        // the data connection is made once the Vita closes this one
+        VitaMTP_Log(VitaMTP_DEBUG, "Device registration complete\n");
+        client->standby = 1;
+        return 0;
+    }
+    else
+    {
+        // no response needed
+        if (strcmp(method, "REGISTERRESULT") && strcmp(method, "REGISTERCANCEL"))
+        {
+            VitaMTP_Log(VitaMTP_INFO, "Unkown method %s\n", method);
+        }
+
+        return 0;
+    }
+
+    if (VitaMTP_Sock_Write_All(c_sock, (const unsigned char *)resp, strlen(resp)+1, NULL, 0) < 0)
+    {
+        VitaMTP_Log(VitaMTP_ERROR, "Error sending request result\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int VitaMTP_Data_Connect(vita_device_t *device);
+
+static void *VitaMTP_Server_Connect_Thread(void *arg)
+{
+    struct vita_server_connect *connect = (struct vita_server_connect *)arg;
+    vita_device_t *device = connect->device;
+    int abandoned;
+
+    if (VitaMTP_Data_Connect(device) < 0)
+    {
+        VitaMTP_Log(VitaMTP_ERROR, "error connecting to Vita %s\n", device->guid);
+        free(device);
+        device = NULL;
+    }
+
+    pthread_mutex_lock(&connect->lock);
+    connect->device = device;
+    connect->done = 1;
+
+    if (!(abandoned = connect->abandoned))
+    {
+        send(connect->notify[1], "", 1, 0);
+    }
+
+    pthread_mutex_unlock(&connect->lock);
+
+    if (abandoned)
+    {
+        if (device)
+        {
+            VitaMTP_Release_Wireless_Device(device);
+        }
+
+        VitaMTP_Server_Free_Connect(connect);
+    }
+
+    return NULL;
+}
+
+/* Starts connecting to a Vita that finished the handshake */
+static void VitaMTP_Server_Connect_Device(struct vita_server *server, struct vita_server_client *client)
+{
+    struct vita_server_connect *connect;
+    vita_device_t *device;
+    pthread_t thread;
+
+    if ((connect = calloc(1, sizeof(struct vita_server_connect))) == NULL ||
+            (device = calloc(1, sizeof(vita_device_t))) == NULL)
+    {
+        VitaMTP_Log(VitaMTP_ERROR, "out of memory\n");
+        free(connect);
+        return;
+    }
+
+    device->device_type = VitaDeviceWireless;
+    strcpy(device->guid, client->guid);
+    device->network_device.registered = 1;
+    device->network_device.addr = client->addr;
+    device->network_device.data_port = client->data_port;
+    connect->device = device;
+
+    if (socketpair(PF_LOCAL, SOCK_DGRAM, IPPROTO_IP, connect->notify) < 0)
+    {
+        VitaMTP_Log(VitaMTP_ERROR, "cannot create socket pair to connect Vita %s\n", device->guid);
+        free(device);
+        free(connect);
+        return;
+    }
+
+    if (VitaMTP_Server_Add(server, connect->notify[0], ServerConnect, NULL) < 0)
+    {
+        closesocket(connect->notify[0]);
+        closesocket(connect->notify[1]);
+        free(device);
+        free(connect);
+        return;
+    }
+
+    pthread_mutex_init(&connect->lock, NULL);
+    server->connects[server->num_fds - 1] = connect;
+    VitaMTP_Log(VitaMTP_DEBUG, "Beginning connection\n");
+
+    if (pthread_create(&thread, NULL, VitaMTP_Server_Connect_Thread, connect) != 0)
+    {
+        VitaMTP_Log(VitaMTP_ERROR, "cannot create thread to connect Vita %s\n", device->guid);
+        connect->device = NULL;
+        connect->done = 1;
+        free(device);
+        VitaMTP_Server_Drop(server, server->num_fds - 1);
+        return;
+    }
+
+    pthread_detach(thread);
+}
+
+/* Hands out a Vita whose data connection was made */
+static void VitaMTP_Server_Connected(struct vita_server *server, int i)
+{
+    struct vita_server_connect *connect = server->connects[i];
+    vita_device_t *device;
+    char byte;
+
+    if (recv((socket_t)server->fds[i].fd, &byte, 1, 0) < 1 && VitaMTP_Sock_Would_Block())
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&connect->lock);
+    device = connect->done ? connect->device : NULL;
+    connect->device = NULL; // it is no longer ours to release
+    pthread_mutex_unlock(&connect->lock);
+    VitaMTP_Server_Drop(server, i);
+
+    if (device == NULL)
+    {
+        return;
+    }
+
+    if (server->device_connected == NULL)
+    {
+        server->first = device;
+        server->running = 0;
+    }
+    else if (server->device_connected(device))
+    {
+        server->running = 0;
+    }
+}
+
+static void VitaMTP_Server_Client(struct vita_server *server, int i)
+{
+    struct vita_server_client *client = server->clients[i];
+    socket_t c_sock = (socket_t)server->fds[i].fd;
+    ssize_t len;
+    char *end;
+
+    if ((len = recv(c_sock, client->buffer + client->len, CLIENT_BUFFER_SIZE - client->len, 0)) < 0)
+    {
+        if (VitaMTP_Sock_Would_Block())
+        {
+            return;
+        }
+
+        VitaMTP_Log(VitaMTP_ERROR, "Error reading from client\n");
+        VitaMTP_Server_Drop(server, i);
+        return;
+    }
+
+    if (len == 0)
+    {
+        // connection closed
+        if (client->standby)
+        {
+            VitaMTP_Server_Connect_Device(server, client);
+        }
+
+        VitaMTP_Server_Drop(server, i);
+        return;
+    }
+
+    VitaMTP_Log(VitaMTP_DEBUG, "Recieved %d bytes from socket %d\n", (unsigned int)len, c_sock);
+
+    if (MASK_SET(g_VitaMTP_logmask, VitaMTP_DEBUG))
+    {
+        VitaMTP_hex_dump((unsigned char *)client->buffer + client->len, (unsigned int)len, 16);
+    }
+
+    client->len += len;
 
-        if (strcmp(data, "SRCH * HTTP/1.1\r\n"))
-        {
-            VitaMTP_Log(VitaMTP_DEBUG, "Unknown request: %.*s\n", (int)len, data);
-            free(data);
-            continue;
-        }
+    while ((end = memchr(client->buffer, '\0', client->len)) != NULL)
+    {
+        size_t reqlen = end - client->buffer + 1;
 
-        if (VitaMTP_Sock_Write_All(sock, (unsigned char *)host_response, strlen(host_response)+1, (struct sockaddr *)&si_client,
-                                   slen) < 0)
+        if (VitaMTP_Server_Request(server, client, c_sock, client->buffer) < 0)
         {
-            VitaMTP_Log(VitaMTP_ERROR, "error sending response\n");
-            free(host_response);
-            free(data);
-            closesocket(sock);
-            closesocket(g_broadcast_command_fds[0]);
-            closesocket(g_broadcast_command_fds[1]);
-            g_broadcast_command_fds[0] = -1;
-            g_broadcast_command_fds[1] = -1;
-            return -1;
+            VitaMTP_Server_Drop(server, i);
+            return;
         }
+
+        client->len -= reqlen;
+        memmove(client->buffer, client->buffer + reqlen, client->len);
     }
 
-    free(host_response);
-    closesocket(sock);
-    closesocket(g_broadcast_command_fds[0]);
-    g_broadcast_command_fds[0] = -1;
-    return 0;
+    if (client->len == CLIENT_BUFFER_SIZE)
+    {
+        VitaMTP_Log(VitaMTP_ERROR, "Device request too long\n");
+        VitaMTP_Server_Drop(server, i);
+    }
 }
 
-/**
- * Stops broadcasting host
- * 
- * If called, the thread running VitaMTP_Broadcast_Host() will 
- * return as soon as possible.
- */
-void VitaMTP_Stop_Broadcast(void)
+static void VitaMTP_Server_Command(struct vita_server *server, socket_t sock)
 {
-    VitaMTP_Log(VitaMTP_DEBUG, "stopping broadcast\n");
-    static const enum broadcast_command cmd = BroadcastStop;
+    enum broadcast_command cmd;
 
-    if (g_broadcast_command_fds[1] < 0)
+    if (recv(sock, (char *)&cmd, sizeof(enum broadcast_command), 0) < (ssize_t)sizeof(enum broadcast_command))
     {
-        VitaMTP_Log(VitaMTP_ERROR, "no broadcast in progress\n");
-        return;
+        if (VitaMTP_Sock_Would_Block())
+        {
+            return;
+        }
+
+        VitaMTP_Log(VitaMTP_ERROR, "Error recieving broadcast command. Stopping broadcast.\n");
+        cmd = BroadcastStop;
     }
 
-    if (send(g_broadcast_command_fds[1], (const char *)&cmd, sizeof(cmd), 0) < sizeof(cmd))
+    if (cmd == BroadcastStop)
     {
-        VitaMTP_Log(VitaMTP_ERROR, "failed to send command to broadcast\n");
+        server->running = 0;
+    }
+    else
+    {
+        VitaMTP_Log(VitaMTP_ERROR, "Unknown command recieved: %d\n", cmd);
     }
-    
-    closesocket(g_broadcast_command_fds[1]);
-    g_broadcast_command_fds[1] = -1;
-    
-#ifdef _WIN32
-    WSACleanup();
-#endif
 }
 
-static inline void VitaMTP_Parse_Device_Headers(char *data, wireless_vita_info_t *info, char **p_host, char **p_pin)
+static void VitaMTP_Server_Free(struct vita_server *server)
 {
-    char *info_str = strtok(data, "\r\n");
+    int i;
 
-    while (info_str != NULL)
+    for (i = 0; i < server->num_fds; i++)
     {
-        if (strncmp(info_str, "host-id:", strlen("host-id:")) == 0)
-        {
-            if (p_host) *p_host = info_str + strlen("host-id:");
-        }
-        else if (strncmp(info_str, "device-id:", strlen("device-id:")) == 0)
-        {
-            info->deviceid = info_str + strlen("device-id:");
-        }
-        else if (strncmp(info_str, "device-type:", strlen("device-type:")) == 0)
-        {
-            info->type = info_str + strlen("device-type:");
-        }
-        else if (strncmp(info_str, "device-mac-address:", strlen("device-mac-address:")) == 0)
-        {
-            info->mac_addr = info_str + strlen("device-mac-address:");
-        }
-        else if (strncmp(info_str, "device-name:", strlen("device-name:")) == 0)
-        {
-            info->name = info_str + strlen("device-name:");
-        }
-        else if (strncmp(info_str, "pin-code:", strlen("pin-code:")) == 0)
-        {
-            if (p_pin) *p_pin = info_str + strlen("pin-code:");
-        }
-        else
+        if (server->fds[i].fd != INVALID_SOCKET)
         {
-            VitaMTP_Log(VitaMTP_INFO, "Unknown field in Vita registration request: %s\n", info_str);
+            VitaMTP_Server_Drop(server, i);
         }
-
-        info_str = strtok(NULL, "\r\n");
     }
+
+    server->num_fds = 0;
+    free(server->host_response);
+    free(server->registered);
 }
 
-static int VitaMTP_Get_Wireless_Device(wireless_host_info_t *info, vita_device_t *device, unsigned int host_addr,
-                                       int timeout, device_registered_callback_t is_registered, register_device_callback_t create_register_pin)
+static int VitaMTP_Server_Bind(struct vita_server *server, int type, wireless_host_info_t *info, unsigned int host_addr)
 {
-    socket_t s_sock;
-    unsigned int slen;
     struct sockaddr_in si_host;
-    struct sockaddr_in si_client;
-    
-#ifdef _WIN32
-    WSADATA wsa_data;
-    if (WSAStartup(0x202, &wsa_data) != 0)
-    {
-        VitaMTP_Log(VitaMTP_ERROR, "cannot setup winsock\n");
-        return -1;
-    }
-#endif
+    socket_t sock;
 
-    if ((s_sock = socket(AF_INET, SOCK_STREAM, 0)) == INVALID_SOCKET)
+    if ((sock = socket(AF_INET, type, type == SOCK_DGRAM ? IPPROTO_UDP : 0)) == INVALID_SOCKET)
     {
         VitaMTP_Log(VitaMTP_ERROR, "cannot create server socket\n");
         return -1;
@@ -1351,207 +2449,236 @@ static int VitaMTP_Get_Wireless_Device(wireless_host_info_t *info, vita_device_t
     si_host.sin_port = htons(info->port);
     si_host.sin_addr.s_addr = host_addr ? htonl(host_addr) : htonl(INADDR_ANY);
 
-    if (bind(s_sock, (struct sockaddr *)&si_host, sizeof(si_host)) < 0)
+    if (bind(sock, (struct sockaddr *)&si_host, sizeof(si_host)) < 0)
     {
         VitaMTP_Log(VitaMTP_ERROR, "cannot bind server socket\n");
-        closesocket(s_sock);
+        closesocket(sock);
         return -1;
     }
 
-    if (listen(s_sock, SOMAXCONN) < 0)
+    if (type == SOCK_STREAM && listen(sock, SOMAXCONN) < 0)
     {
         VitaMTP_Log(VitaMTP_ERROR, "cannot listen on server socket\n");
-        closesocket(s_sock);
+        closesocket(sock);
         return -1;
     }
 
-    fd_set fd;
-    struct timeval time = {0};
-    int ret;
-    socket_t c_sock = INVALID_SOCKET;
-    char *data = NULL;
-    size_t len;
-    char method[20];
-    int read;
-    int pin = -1;
-    int listen = 1;
-    memset(device, 0, sizeof(vita_device_t));
-    VitaMTP_Log(VitaMTP_DEBUG, "waiting for connection\n");
-
-    while (listen)
+    if (VitaMTP_Server_Add(server, sock, type == SOCK_DGRAM ? ServerDiscovery : ServerListener, NULL) < 0)
     {
-        FD_ZERO(&fd);
-        FD_SET(s_sock, &fd);
+        closesocket(sock);
+        return -1;
+    }
 
-        if (timeout) time.tv_sec = timeout;
+    return 0;
+}
+
+/*
+ * Sets up a server. With discovery it answers search broadcasts and can
+ * be stopped with VitaMTP_Stop_Broadcast(). With callbacks it accepts
+ * Vitas for registration and connection.
+ */
+static int VitaMTP_Server_Init(struct vita_server *server, wireless_host_info_t *info, unsigned int host_addr,
+                               int discovery, device_registered_callback_t is_registered,
+                               register_device_callback_t create_register_pin, device_connected_callback_t device_connected)
+{
+    memset(server, 0, sizeof(struct vita_server));
+    server->running = 1;
+    server->is_registered = is_registered;
+    server->create_register_pin = create_register_pin;
+    server->device_connected = device_connected;
 
-        // use select for the timeout feature, ignore fd
-        // s_sock+1 allows us to check fd "s_sock" but ignore the rest
-        if ((ret = select(s_sock+1, &fd, NULL, NULL, timeout ? &time : NULL)) < 0)
+    if (discovery)
+    {
+        if (asprintf(&server->host_response,
+                     "HTTP/1.1 200 OK\r\nhost-id:%s\r\nhost-type:%s\r\nhost-name:%s\r\nhost-mtp-protocol-version:%08d\r\nhost-request-port:%d\r\nhost-wireless-protocol-version:%08d\r\n",
+                     info->guid, info->type, info->name, VITAMTP_PROTOCOL_MAX_VERSION, info->port, VITAMTP_WIRELESS_MAX_VERSION) < 0)
         {
-            VitaMTP_Log(VitaMTP_ERROR, "Error polling listener\n");
-            break;
+            VitaMTP_Log(VitaMTP_ERROR, "out of memory\n");
+            server->host_response = NULL;
+            return -1;
         }
-        else if (ret == 0)
+
+        if (VitaMTP_Server_Bind(server, SOCK_DGRAM, info, host_addr) < 0)
         {
-            VitaMTP_Log(VitaMTP_INFO, "Listening timed out.\n");
-            break;
+            VitaMTP_Server_Free(server);
+            return -1;
         }
 
-        slen = sizeof(si_client);
+        // in case a prevous broadcast went wrong
+        if (g_broadcast_command_fds[1] != -1)
+        {
+            closesocket(g_broadcast_command_fds[1]);
+            g_broadcast_command_fds[1] = -1;
+        }
 
-        if ((c_sock = accept(s_sock, (struct sockaddr *)&si_client, &slen)) == INVALID_SOCKET)
+        if (socketpair(PF_LOCAL, SOCK_DGRAM, IPPROTO_IP, g_broadcast_command_fds) < 0 ||
+                VitaMTP_Server_Add(server, g_broadcast_command_fds[0], ServerCommand, NULL) < 0)
         {
-            VitaMTP_Log(VitaMTP_ERROR, "Error accepting connection\n");
-            break;
+            VitaMTP_Log(VitaMTP_ERROR, "failed to create broadcast command socket pair\n");
         }
+        else
+        {
+            VitaMTP_Log(VitaMTP_DEBUG, "start broadcasting as: %s\n", info->name);
+        }
+    }
 
-        VitaMTP_Log(VitaMTP_DEBUG, "Found new client.\n");
+    if (create_register_pin && VitaMTP_Server_Bind(server, SOCK_STREAM, info, host_addr) < 0)
+    {
+        VitaMTP_Server_Free(server);
+        return -1;
+    }
 
-        while (1)
-        {
-            char resp[RESPONSE_MAX_SIZE];
+    return 0;
+}
 
-            if (VitaMTP_Sock_Read_All(c_sock, (unsigned char **)&data, &len, NULL, NULL) < 0)
-            {
-                VitaMTP_Log(VitaMTP_ERROR, "Error reading from client\n");
-                listen = 0;
-                break;
-            }
+/* Serves until stopped or for timeout seconds without any requests */
+static int VitaMTP_Server_Run(struct vita_server *server, int timeout)
+{
+    int i, j, n, ret;
 
-            if (len == 0)
-            {
-                pin = -1; // reset any current registration
-                closesocket(c_sock);
-                break; // connection closed
-            }
+    VitaMTP_Log(VitaMTP_DEBUG, "waiting for connection\n");
 
-            if (sscanf(data, "%20s * HTTP/1.1\r\n%n", method, &read) < 1)
+    while (server->running)
+    {
+        if ((ret = poll(server->fds, server->num_fds, timeout ? timeout * 1000 : -1)) < 0)
+        {
+            if (VitaMTP_Sock_Would_Block())
             {
-                VitaMTP_Log(VitaMTP_ERROR, "Device request malformed: %.*s\n", (int)len, data);
-                listen = 0;
-                break;
+                continue;
             }
 
-            if (strcmp(method, "CONNECT") == 0)
-            {
-                if (sscanf(data+read, "device-id:%32s\r\ndevice-port:%d\r\n", device->guid, &device->network_device.data_port) < 2)
-                {
-                    VitaMTP_Log(VitaMTP_ERROR, "Error parsing device request\n");
-                    listen = 0;
-                    break;
-                }
-
-                if (device->network_device.registered || is_registered(device->guid))
-                {
-                    strcpy(resp, "HTTP/1.1 210 OK\r\n");
-                }
-                else
-                {
-                    strcpy(resp, "HTTP/1.1 605 NG\r\n");
-                }
-            }
-            else if (strcmp(method, "SHOWPIN") == 0)
-            {
-                wireless_vita_info_t info;
-                int err;
-                VitaMTP_Parse_Device_Headers(data+read, &info, NULL, NULL);
-                strncpy(device->guid, info.deviceid, 32);
-                device->guid[32] = '\0';
-                // TODO: Check if host GUID is actually our GUID
-                const char *okay = "HTTP/1.1 200 OK\r\n";
-
-                if (VitaMTP_Sock_Write_All(c_sock, (const unsigned char *)okay, strlen(okay)+1, NULL, 0) < 0)
-                {
-                    VitaMTP_Log(VitaMTP_ERROR, "Error sending request result\n");
-                    listen = 0;
-                    break;
-                }
-
-                if ((pin = create_register_pin(&info, &err)) < 0)
-                {
-                    sprintf(resp, "REGISTERCANCEL * HTTP/1.1\r\nerrorcode:%d\r\n", err);
-                }
-                else
-                {
-                    free(data);
-                    continue;
-                }
-            }
-            else if (strcmp(method, "REGISTER") == 0)
+            VitaMTP_Log(VitaMTP_ERROR, "Error polling server sockets\n");
+            return -1;
+        }
+        else if (ret == 0)
+        {
+            // a Vita being connected is not idle
+            for (i = 0; i < server->num_fds && server->types[i] != ServerConnect; i++);
+
+            if (i < server->num_fds)
             {
-                wireless_vita_info_t info;
-                char *pin_try;
-                VitaMTP_Parse_Device_Headers(data+read, &info, NULL, &pin_try);
-
-                if (strcmp(device->guid, info.deviceid))
-                {
-                    VitaMTP_Log(VitaMTP_ERROR, "PIN generated for device %s, but response came from %s!\n", device->guid, info.deviceid);
-                    strcpy(resp, "HTTP/1.1 610 NG\r\n");
-                }
-                else if (pin < 0)
-                {
-                    VitaMTP_Log(VitaMTP_ERROR, "No PIN generated. Cannot register device %s.\n", info.deviceid);
-                    strcpy(resp, "HTTP/1.1 610 NG\r\n");
-                }
-                else if (pin != atoi(pin_try))
-                {
-                    VitaMTP_Log(VitaMTP_ERROR, "PIN mismatch. Correct: %08d, Got: %s\n", pin, pin_try);
-                    strcpy(resp, "HTTP/1.1 610 NG\r\n");
-                }
-                else
-                {
-                    device->network_device.registered = 1;
-                    strcpy(resp, "HTTP/1.1 200 OK\r\n");
-                }
+                continue;
             }
-            else if (strcmp(method, "STANDBY") == 0)
+
+            VitaMTP_Log(VitaMTP_INFO, "Listening timed out.\n");
+            return 0;
+        }
+
+        // sockets added by the handlers are looked at next round
+        n = server->num_fds;
+
+        for (i = 0; i < n && server->running; i++)
+        {
+            if (server->fds[i].fd == INVALID_SOCKET || server->fds[i].revents == 0)
             {
-                VitaMTP_Log(VitaMTP_DEBUG, "Device registration complete\n");
-                listen = 0; // found client to connect, need to let client close init socket
-                device->network_device.addr = si_client;
-                free(data);
                 continue;
             }
-            else
+
+            switch (server->types[i])
             {
-                // no response needed
-                if (!(strcmp(method, "REGISTERRESULT") || strcmp(method, "REGISTERCANCEL")))
-                {
-                    VitaMTP_Log(VitaMTP_INFO, "Unkown method %s\n", method);
-                }
+            case ServerCommand:
+                VitaMTP_Server_Command(server, (socket_t)server->fds[i].fd);
+                break;
 
-                free(data);
-                continue;
+            case ServerDiscovery:
+                VitaMTP_Server_Discovery(server, (socket_t)server->fds[i].fd);
+                break;
+
+            case ServerListener:
+                VitaMTP_Server_Accept(server, (socket_t)server->fds[i].fd);
+                break;
+
+            case ServerClient:
+                VitaMTP_Server_Client(server, i);
+                break;
+
+            case ServerConnect:
+                VitaMTP_Server_Connected(server, i);
+                break;
             }
+        }
 
-            if (VitaMTP_Sock_Write_All(c_sock, (const unsigned char *)resp, strlen(resp)+1, NULL, 0) < 0)
+        for (i = 0, j = 0; i < server->num_fds; i++)
+        {
+            if (server->fds[i].fd == INVALID_SOCKET)
             {
-                VitaMTP_Log(VitaMTP_ERROR, "Error sending request result\n");
-                listen = 0;
-                break;
+                continue;
             }
 
-            free(data);
+            server->fds[j] = server->fds[i];
+            server->types[j] = server->types[i];
+            server->clients[j] = server->clients[i];
+            server->connects[j] = server->connects[i];
+            j++;
         }
 
-        closesocket(c_sock);
+        server->num_fds = j;
     }
 
-    free(data);
-    closesocket(c_sock);
-    closesocket(s_sock);
+    return 0;
+}
+
+/**
+ * Starts broadcasting host
+ *
+ * This is typically called in a separate thread from the listener thread, 
+ * which waits on a device to try to connect via VitaMTP_Get_First_Wireless_Vita().
+ * VitaMTP_Serve_Wireless() does both from one thread.
+ * @param info pointer to structure containing information to show device
+ * @param host_addr set to 0 if listen on all interfaces, otherwise the IP to listen on
+ */
+int VitaMTP_Broadcast_Host(wireless_host_info_t *info, unsigned int host_addr)
+{
+    struct vita_server server;
+    int ret;
 
-    if (device->network_device.addr.sin_addr.s_addr > 0)
+#ifdef _WIN32
+    WSADATA wsa_data;
+    if (WSAStartup(0x202, &wsa_data) != 0)
     {
-        // we found a device to connect to
-        VitaMTP_Log(VitaMTP_DEBUG, "Beginning connection\n");
-        return VitaMTP_Data_Connect(device);
+        VitaMTP_Log(VitaMTP_ERROR, "cannot setup winsock\n");
+        return -1;
     }
-    else
+#endif
+
+    if (VitaMTP_Server_Init(&server, info, host_addr, 1, NULL, NULL, NULL) < 0)
     {
         return -1;
     }
+
+    ret = VitaMTP_Server_Run(&server, 0);
+    VitaMTP_Server_Free(&server);
+    return ret;
+}
+
+/**
+ * Stops broadcasting host
+ * 
+ * If called, the thread running VitaMTP_Broadcast_Host() or
+ * VitaMTP_Serve_Wireless() will return as soon as possible.
+ */
+void VitaMTP_Stop_Broadcast(void)
+{
+    VitaMTP_Log(VitaMTP_DEBUG, "stopping broadcast\n");
+    static const enum broadcast_command cmd = BroadcastStop;
+
+    if (g_broadcast_command_fds[1] < 0)
+    {
+        VitaMTP_Log(VitaMTP_ERROR, "no broadcast in progress\n");
+        return;
+    }
+
+    if (send(g_broadcast_command_fds[1], (const char *)&cmd, sizeof(cmd), 0) < sizeof(cmd))
+    {
+        VitaMTP_Log(VitaMTP_ERROR, "failed to send command to broadcast\n");
+    }
+    
+    closesocket(g_broadcast_command_fds[1]);
+    g_broadcast_command_fds[1] = -1;
+    
+#ifdef _WIN32
+    WSACleanup();
+#endif
 }
 
 /**
@@ -1565,6 +2692,7 @@ void VitaMTP_Release_Wireless_Device(vita_device_t *device)
         VitaMTP_Log(VitaMTP_ERROR, "ERROR: Could not close session!\n");
     }
 
+    ptp_ptpip_event_pump_stop(device->params);
     closesocket(device->params->cmdfd);
     closesocket(device->params->evtfd);
 #ifdef HAVE_ICONV
@@ -1572,6 +2700,9 @@ void VitaMTP_Release_Wireless_Device(vita_device_t *device)
     iconv_close(device->params->cd_locale_to_ucs2);
     iconv_close(device->params->cd_ucs2_to_locale);
 #endif
+    ptp_ptpip_rxbuf_free(device->params);
+    vita_scheduler_free(device->params);
+    vita_tuner_free(device->params);
     ptp_free_params(device->params);
     free(device->params);
     free(device);
@@ -1600,21 +2731,74 @@ void VitaMTP_Release_Wireless_Device(vita_device_t *device)
 vita_device_t *VitaMTP_Get_First_Wireless_Vita(wireless_host_info_t *info, unsigned int host_addr, int timeout,
         device_registered_callback_t is_registered, register_device_callback_t create_register_pin)
 {
-    vita_device_t *device = malloc(sizeof(vita_device_t));
+    struct vita_server server;
 
-    if (device == NULL)
+#ifdef _WIN32
+    WSADATA wsa_data;
+    if (WSAStartup(0x202, &wsa_data) != 0)
     {
-        VitaMTP_Log(VitaMTP_ERROR, "out of memory\n");
+        VitaMTP_Log(VitaMTP_ERROR, "cannot setup winsock\n");
         return NULL;
     }
+#endif
 
-    if (VitaMTP_Get_Wireless_Device(info, device, host_addr, timeout, is_registered, create_register_pin) < 0)
+    if (VitaMTP_Server_Init(&server, info, host_addr, 0, is_registered, create_register_pin, NULL) < 0)
     {
-        VitaMTP_Log(VitaMTP_ERROR, "error locating Vita\n");
         return NULL;
     }
 
-    return device;
+    VitaMTP_Server_Run(&server, timeout);
+    VitaMTP_Server_Free(&server);
+
+    if (server.first == NULL)
+    {
+        VitaMTP_Log(VitaMTP_ERROR, "error locating Vita\n");
+    }
+
+    return server.first;
+}
+
+/**
+ * Answers discovery broadcasts and connects any number of Vitas
+ *
+ * Searching, registering and connecting Vitas are all served from the
+ * calling thread, which is blocked until VitaMTP_Stop_Broadcast() is
+ * called, device_connected returns non-zero or nothing happens for
+ * timeout seconds.
+ * @param info pointer to structure containing information to show device
+ * @param host_addr set to 0 if listen on all interfaces, otherwise the IP to listen on
+ * @param timeout how long (in seconds) to wait for a request, 0 to wait forever
+ * @param is_registered see VitaMTP_Get_First_Wireless_Vita()
+ * @param create_register_pin see VitaMTP_Get_First_Wireless_Vita()
+ * @param device_connected called with every Vita that connects. The device
+ *          belongs to the callback, which should hand it to another thread
+ *          and return quickly. Return non-zero to stop serving.
+ * @return zero when stopped, negative on error.
+ */
+int VitaMTP_Serve_Wireless(wireless_host_info_t *info, unsigned int host_addr, int timeout,
+                           device_registered_callback_t is_registered, register_device_callback_t create_register_pin,
+                           device_connected_callback_t device_connected)
+{
+    struct vita_server server;
+    int ret;
+
+#ifdef _WIN32
+    WSADATA wsa_data;
+    if (WSAStartup(0x202, &wsa_data) != 0)
+    {
+        VitaMTP_Log(VitaMTP_ERROR, "cannot setup winsock\n");
+        return -1;
+    }
+#endif
+
+    if (VitaMTP_Server_Init(&server, info, host_addr, 1, is_registered, create_register_pin, device_connected) < 0)
+    {
+        return -1;
+    }
+
+    ret = VitaMTP_Server_Run(&server, timeout);
+    VitaMTP_Server_Free(&server);
+    return ret;
 }
 
 /**